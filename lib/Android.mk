@@ -4,8 +4,15 @@ include $(CLEAR_VARS)
 
 LOCAL_COPY_HEADERS := ble.h
 LOCAL_COPY_HEADERS_TO := libble
-LOCAL_SRC_FILES := ble.c
+LOCAL_SRC_FILES := ble.c aes.c
 LOCAL_SHARED_LIBRARIES := libhardware
+# Enable when building against a GATT client HAL providing configure_mtu()
+#LOCAL_CFLAGS += -DHAVE_GATT_CONFIGURE_MTU
+# Enable when building against a GATT client HAL providing
+# conn_parameter_update()
+#LOCAL_CFLAGS += -DHAVE_GATT_CONN_PARAMETER_UPDATE
+# Enable when building against a GATT client HAL providing conn_updated_cb
+#LOCAL_CFLAGS += -DHAVE_GATT_CONN_UPDATED_CB
 LOCAL_MODULE_TAGS := eng
 LOCAL_MODULE := libble
 
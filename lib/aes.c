@@ -0,0 +1,210 @@
+/*
+ *  Android BLE Library -- AES-128 encryption, for the resolution of private
+ *  addresses
+ *
+ *  Copyright (C) 2013 João Paulo Rechi Vita
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation; either version 2.1 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "aes.h"
+
+/* Keys encrypted together by aes128_find_key(), so that the table lookups of
+ * one key overlap with those of the others */
+#define AES_BATCH 2
+
+static const uint8_t sbox[256] = {
+    0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5,
+    0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76,
+    0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0,
+    0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0,
+    0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f, 0xf7, 0xcc,
+    0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15,
+    0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a,
+    0x07, 0x12, 0x80, 0xe2, 0xeb, 0x27, 0xb2, 0x75,
+    0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0,
+    0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84,
+    0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b,
+    0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf,
+    0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85,
+    0x45, 0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8,
+    0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5,
+    0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2,
+    0xcd, 0x0c, 0x13, 0xec, 0x5f, 0x97, 0x44, 0x17,
+    0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73,
+    0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88,
+    0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb,
+    0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c,
+    0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79,
+    0xe7, 0xc8, 0x37, 0x6d, 0x8d, 0xd5, 0x4e, 0xa9,
+    0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08,
+    0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6,
+    0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a,
+    0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e,
+    0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e,
+    0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94,
+    0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
+    0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68,
+    0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16
+};
+
+static const uint8_t rcon[10] = {
+    0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0x1b, 0x36
+};
+
+/* SubBytes, ShiftRows and MixColumns of one byte of each column, the tables
+ * differing by the row of the byte */
+static uint32_t te[4][256];
+static pthread_once_t te_once = PTHREAD_ONCE_INIT;
+
+static void te_init(void) {
+    uint32_t s, s2, w;
+    int i;
+
+    for (i = 0; i < 256; i++) {
+        s = sbox[i];
+        s2 = (s << 1 ^ (s & 0x80 ? 0x1b : 0)) & 0xff;
+        w = s2 << 24 | s << 16 | s << 8 | (s2 ^ s);
+        te[0][i] = w;
+        te[1][i] = w >> 8 | w << 24;
+        te[2][i] = w >> 16 | w << 16;
+        te[3][i] = w >> 24 | w << 8;
+    }
+}
+
+static uint32_t load_be32(const uint8_t *p) {
+    return (uint32_t) p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static void store_be32(uint8_t *p, uint32_t w) {
+    p[0] = w >> 24;
+    p[1] = w >> 16;
+    p[2] = w >> 8;
+    p[3] = w;
+}
+
+static uint32_t sub_word(uint32_t w) {
+    return (uint32_t) sbox[w >> 24] << 24 | sbox[w >> 16 & 0xff] << 16 |
+           sbox[w >> 8 & 0xff] << 8 | sbox[w & 0xff];
+}
+
+void aes128_expand_key(const uint8_t *key, aes128_key_t *k) {
+    uint32_t w;
+    int i;
+
+    pthread_once(&te_once, te_init);
+
+    for (i = 0; i < 4; i++)
+        k->rk[i] = load_be32(key + 4 * i);
+
+    for (i = 4; i < 44; i++) {
+        w = k->rk[i - 1];
+        if (i % 4 == 0)
+            w = sub_word(w << 8 | w >> 24) ^ (uint32_t) rcon[i / 4 - 1] << 24;
+        k->rk[i] = k->rk[i - 4] ^ w;
+    }
+}
+
+static inline void aes_round(uint32_t *t, const uint32_t *s,
+                             const uint32_t *rk) {
+    t[0] = te[0][s[0] >> 24] ^ te[1][s[1] >> 16 & 0xff] ^
+           te[2][s[2] >> 8 & 0xff] ^ te[3][s[3] & 0xff] ^ rk[0];
+    t[1] = te[0][s[1] >> 24] ^ te[1][s[2] >> 16 & 0xff] ^
+           te[2][s[3] >> 8 & 0xff] ^ te[3][s[0] & 0xff] ^ rk[1];
+    t[2] = te[0][s[2] >> 24] ^ te[1][s[3] >> 16 & 0xff] ^
+           te[2][s[0] >> 8 & 0xff] ^ te[3][s[1] & 0xff] ^ rk[2];
+    t[3] = te[0][s[3] >> 24] ^ te[1][s[0] >> 16 & 0xff] ^
+           te[2][s[1] >> 8 & 0xff] ^ te[3][s[2] & 0xff] ^ rk[3];
+}
+
+/* Column c of the final round, which has no MixColumns */
+static inline uint32_t aes_final(const uint32_t *s, int c,
+                                 const uint32_t *rk) {
+    return ((uint32_t) sbox[s[c] >> 24] << 24 |
+            sbox[s[(c + 1) & 3] >> 16 & 0xff] << 16 |
+            sbox[s[(c + 2) & 3] >> 8 & 0xff] << 8 |
+            sbox[s[(c + 3) & 3] & 0xff]) ^ rk[40 + c];
+}
+
+/* Rounds 1 to 9, leaving the state in t */
+static inline void aes_rounds(uint32_t *s, uint32_t *t, const uint32_t *rk) {
+    int r;
+
+    for (r = 1; r < 9; r += 2) {
+        aes_round(t, s, rk + 4 * r);
+        aes_round(s, t, rk + 4 * r + 4);
+    }
+    aes_round(t, s, rk + 36);
+}
+
+void aes128_encrypt(const aes128_key_t *k, const uint8_t *in, uint8_t *out) {
+    uint32_t s[4], t[4];
+    int i;
+
+    for (i = 0; i < 4; i++)
+        s[i] = load_be32(in + 4 * i) ^ k->rk[i];
+
+    aes_rounds(s, t, k->rk);
+
+    for (i = 0; i < 4; i++)
+        store_be32(out + 4 * i, aes_final(t, i, k->rk));
+}
+
+int aes128_find_key(const aes128_key_t *keys, int count, const uint8_t *in,
+                    uint32_t last, uint32_t mask) {
+    uint32_t p[4], s[AES_BATCH][4], t[AES_BATCH][4];
+    const uint32_t *rk[AES_BATCH];
+    int i, j, c, r;
+
+    for (c = 0; c < 4; c++)
+        p[c] = load_be32(in + 4 * c);
+
+    last &= mask;
+
+    for (i = 0; i + AES_BATCH <= count; i += AES_BATCH) {
+        for (j = 0; j < AES_BATCH; j++) {
+            rk[j] = keys[i + j].rk;
+            for (c = 0; c < 4; c++)
+                s[j][c] = p[c] ^ rk[j][c];
+        }
+
+        for (r = 1; r < 9; r += 2) {
+            for (j = 0; j < AES_BATCH; j++)
+                aes_round(t[j], s[j], rk[j] + 4 * r);
+            for (j = 0; j < AES_BATCH; j++)
+                aes_round(s[j], t[j], rk[j] + 4 * r + 4);
+        }
+        for (j = 0; j < AES_BATCH; j++)
+            aes_round(t[j], s[j], rk[j] + 36);
+
+        for (j = 0; j < AES_BATCH; j++)
+            if ((aes_final(t[j], 3, rk[j]) & mask) == last)
+                return i + j;
+    }
+
+    for (; i < count; i++) {
+        for (c = 0; c < 4; c++)
+            s[0][c] = p[c] ^ keys[i].rk[c];
+        aes_rounds(s[0], t[0], keys[i].rk);
+        if ((aes_final(t[0], 3, keys[i].rk) & mask) == last)
+            return i;
+    }
+
+    return -1;
+}
@@ -0,0 +1,46 @@
+/*
+ *  Android BLE Library -- AES-128 encryption, for the resolution of private
+ *  addresses
+ *
+ *  Copyright (C) 2013 João Paulo Rechi Vita
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation; either version 2.1 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef AES_H
+#define AES_H
+
+#include <stdint.h>
+
+/* Round keys of an AES-128 key, as big-endian words */
+typedef struct {
+    uint32_t rk[44];
+} aes128_key_t;
+
+/* Expand a key, most-significant byte first as in FIPS-197 */
+void aes128_expand_key(const uint8_t *key, aes128_key_t *k);
+
+/* Encrypt a 16-byte block */
+void aes128_encrypt(const aes128_key_t *k, const uint8_t *in, uint8_t *out);
+
+/* Encrypt the same block with count keys, several keys at a time, and return
+ * the index of the first key whose ciphertext ends with the big-endian word
+ * last, once masked with mask, or -1 if none does. Only the last word of each
+ * ciphertext is computed in the final round. */
+int aes128_find_key(const aes128_key_t *keys, int count, const uint8_t *in,
+                    uint32_t last, uint32_t mask);
+
+#endif
@@ -20,15 +20,22 @@
  *
  */
 
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <sys/mman.h>
+
 #include <hardware/bluetooth.h>
 #include <hardware/bt_gatt.h>
 #include <hardware/bt_gatt_client.h>
 #include <hardware/hardware.h>
 
+#include "aes.h"
 #include "ble.h"
 
 /* Internal representation of a GATT characteristic */
@@ -36,6 +43,7 @@ typedef struct ble_gatt_char ble_gatt_char_t;
 struct ble_gatt_char {
     btgatt_srvc_id_t s;
     btgatt_char_id_t c;
+    int props;
 };
 
 /* Internal representation of a GATT descriptor */
@@ -45,20 +53,296 @@ struct ble_gatt_desc {
     bt_uuid_t d;
 };
 
+/* Internal representation of a service inclusion (an edge of the graph) */
+typedef struct ble_gatt_incl ble_gatt_incl_t;
+struct ble_gatt_incl {
+    uint8_t srvc;
+    uint8_t incl;
+};
+
+/* Per-service state of the included services walk */
+#define INCL_QUEUED 0x01
+#define INCL_WALKED 0x02
+
 typedef enum {
     BLE_GATT_ELEM_SERVICE,
     BLE_GATT_ELEM_CHARACTERISTIC,
     BLE_GATT_ELEM_DESCRIPTOR
 } gatt_elem_t;
 
-/* Internal representation of a BLE device */
+/* Write types of write_characteristic() and write_descriptor() */
+#define GATT_WRITE_NO_RSP  1
+#define GATT_WRITE_REQ     2
+#define GATT_WRITE_PREPARE 3
+
+/* Largest value of an attribute, as defined by the ATT protocol */
+#define ATT_MAX_VALUE_LEN 512
+
+/* ATT MTU used before any negotiation, and the room left for a value on a
+ * write or a notification */
+#define ATT_DEFAULT_MTU 23
+#define ATT_MAX_MTU 517
+#define ATT_WRITE_HDR_LEN 3
+
+/* Default timeout of a connection attempt, in ms, and maximum number of
+ * links, which is what Bluedroid supports */
+#define CONN_DEFAULT_TIMEOUT 10000
+#define CONN_DEFAULT_MAX_LINKS 7
+
+/* A link recovered for less than this, in ms, is lost again without
+ * resetting the reconnection backoff */
+#define RECONNECT_STABLE_MS 5000
+
+/* Priority of the connections requested by sweeps */
+#define SWEEP_PRIORITY -1
+
+/* Priority and timeout, in ms, of the connections requested on matching
+ * advertisements */
+#define FAST_CONNECT_PRIORITY 1000
+#define FAST_CONNECT_TIMEOUT 2000
+#define FAST_CONNECT_MAX_RULES 16
+
+/* Scan results carry the advertising data followed by the scan response, of
+ * up to 31 bytes each */
+#define ADV_PACKET_LEN 31
+#define ADV_DATA_LEN 62
+
+/* Devices kept in the scan table by default. Its index has at least twice
+ * as many slots to keep probe sequences short. */
+#define SCAN_TABLE_SIZE 1024
+#define SCAN_INDEX_EMPTY 0
+
+/* Decoders of manufacturer and service data, in an open addressing table
+ * twice as large as the number of decoders */
+#define DECODER_TABLE_BITS 6
+#define DECODER_TABLE_SIZE (1 << DECODER_TABLE_BITS)
+
+/* Identifiers of the data of the built-in decoders */
+#define COMPANY_APPLE 0x004c
+#define UUID_EDDYSTONE 0xfeaa
+#define EDDYSTONE_URL_MAX 17
+
+/* Buckets of the presence timing wheel, which spans twice the presence
+ * timeout */
+#define PRESENCE_WHEEL_SIZE 256
+
+/* Present devices, in a table grown by doubling from 64 devices, with an
+ * index twice as large */
+#define PRESENCE_MIN_BITS 7
+
+/* Weight of a new report in the RSSI of the strongest devices, which is kept
+ * in 1/16 dBm */
+#define TOP_RSSI_SHIFT 2
+
+/* Conditions of a compiled scan filter needing the advertising data */
+#define FILTER_UUID    0x01
+#define FILTER_COMPANY 0x02
+
+/* Allowlist sizes: the set is kept at most half full, and each address sets
+ * up to ALLOW_BLOOM_MAX_K bits, taken 6 at a time from a 42-bit hash */
+#define ALLOW_MIN_SLOTS 16
+#define ALLOW_BLOOM_MAX_BITS 32
+#define ALLOW_BLOOM_MAX_K 7
+
+/* Cache of resolved private addresses, RPA_CACHE_WAYS entries per set */
+#define RPA_CACHE_SETS 1024
+#define RPA_CACHE_WAYS 4
+
+/* Advertising data types */
+#define AD_UUID16_SOME     0x02
+#define AD_UUID16_ALL      0x03
+#define AD_UUID32_SOME     0x04
+#define AD_UUID32_ALL      0x05
+#define AD_UUID128_SOME    0x06
+#define AD_UUID128_ALL     0x07
+#define AD_NAME_SHORT      0x08
+#define AD_NAME_COMPLETE   0x09
+#define AD_TX_POWER        0x0a
+#define AD_SERVICE_DATA16  0x16
+#define AD_SERVICE_DATA128 0x21
+#define AD_MANUFACTURER    0xff
+
+/* Connection parameter limits from the Core specification, in units of
+ * 1.25 ms for intervals and 10 ms for the supervision timeout */
+#define CONN_MIN_INTERVAL 6
+#define CONN_MAX_INTERVAL 3200
+#define CONN_MAX_LATENCY 499
+#define CONN_MIN_TIMEOUT 10
+#define CONN_MAX_TIMEOUT 3200
+
+/* Default number of write commands of a stream in flight at the same time.
+ * Bluedroid keeps a single pending command per connection and silently drops
+ * any other sent before it completes. */
+#define STREAM_DEFAULT_CREDITS 1
+#define STREAM_MAX_CREDITS 16
+
+/* Minimum interval between two stream progress reports, in ms */
+#define STREAM_REPORT_INTERVAL 100
+
+/* Characteristic properties enabling notifications and indications */
+#define GATT_CHAR_PROP_NOTIFY   0x10
+#define GATT_CHAR_PROP_INDICATE 0x20
+
+/* Client Characteristic Configuration values */
+#define GATT_CCC_NONE     0x0000
+#define GATT_CCC_NOTIFY   0x0001
+#define GATT_CCC_INDICATE 0x0002
+
+/* Most characteristics a device can have notifications registered for */
+#define MAX_SUBSCRIPTIONS 32
+
+/* Progress of the lookup of a CCC descriptor */
+#define CCC_LOOKUP_NONE    0
+#define CCC_LOOKUP_PENDING 1
+#define CCC_LOOKUP_DONE    2
+
+typedef enum {
+    GATT_REQ_WRITE_LONG,
+    GATT_REQ_STREAM,
+    GATT_REQ_WRITE_CCC,
+    GATT_REQ_READ_MANY,
+    GATT_REQ_READ_CHAR,
+    GATT_REQ_READ_DESC,
+    GATT_REQ_WRITE_CHAR,
+    GATT_REQ_WRITE_DESC,
+    GATT_REQ_EXECUTE
+} gatt_req_type_t;
+
+/* Characteristic the application has registered notifications for. The set
+ * is kept per device address and replayed on every connection. */
+typedef struct ble_gatt_sub ble_gatt_sub_t;
+struct ble_gatt_sub {
+    uint8_t used;
+    uint8_t char_id;
+    uint8_t registered;
+    uint8_t enabled;
+    uint8_t busy;
+    uint8_t lookup;
+    uint8_t record;     /* Recorded, protected by rec.lock */
+
+    /* Reception statistics, protected by stats_lock */
+    ble_notify_stats_t stats;
+    uint64_t stats_prev;
+    uint32_t stats_interval;
+    uint32_t stats_jitter;
+    uint64_t stats_interval_sum;
+    uint64_t stats_intervals;
+    int seq_offset;
+    uint8_t seq_width;
+    uint8_t seq_valid;
+    uint32_t seq_last;
+
+    /* Delivery policy, protected by notify_lock */
+    ble_notify_policy_t policy;
+    int param;
+    ble_value_format_t format;
+    int offset;
+    int count;
+    uint64_t deadline;
+    uint8_t *held;
+    uint16_t held_len;
+    uint8_t held_ind;
+    int64_t agg_min;
+    int64_t agg_max;
+    int64_t agg_sum;
+};
+
+/* Timer run on the libble timer thread */
+typedef struct ble_timer ble_timer_t;
+struct ble_timer {
+    uint64_t when;
+    void (*cb)(void *arg);
+    void *arg;
+    uint8_t armed;
+
+    ble_timer_t *next;
+};
+
+/* GATT request queued on a connection */
+typedef struct ble_gatt_req ble_gatt_req_t;
+struct ble_gatt_req {
+    gatt_req_type_t type;
+    int id;
+    int char_id;
+    int auth;
+    char *value;
+    int len;
+    uint8_t issued;
+
+    /* Single read or write, by operation of ble_gatt_op() */
+    int op;
+    uint8_t execute;
+
+    /* Stream of write commands */
+    ble_gatt_stream_cb_t stream_cb;
+    int chunk;
+    int sent;
+    int acked;
+    int in_flight;
+    uint8_t filling;
+    uint64_t start_ms;
+    uint64_t report_ms;
+
+    /* Batch of reads, whose results and values are packed in value */
+    ble_gatt_read_many_cb_t read_cb;
+    int *ids;
+    int count;
+    int idx;
+    int size;
+
+    ble_gatt_req_t *next;
+};
+
+/* States of the connection request of a device */
+typedef enum {
+    CONN_IDLE,
+    CONN_QUEUED,
+    CONN_PENDING
+} conn_state_t;
+
+/* States of the recovery of a lost link */
+typedef enum {
+    RECONNECT_IDLE,
+    RECONNECT_WAITING,
+    RECONNECT_CONNECTING
+} reconnect_state_t;
+
+/* States of a device of a sweep */
+typedef enum {
+    SWEEP_PENDING,
+    SWEEP_CONNECTING,
+    SWEEP_DISCOVERING,
+    SWEEP_READING,
+    SWEEP_CLOSING,
+    SWEEP_DONE,
+    SWEEP_FAILED
+} sweep_state_t;
+
 typedef struct ble_device ble_device_t;
+
+/* Device of a sweep */
+typedef struct ble_sweep_entry ble_sweep_entry_t;
+struct ble_sweep_entry {
+    uint8_t address[6];
+    sweep_state_t state;
+    uint8_t ok;
+    int attempts;
+    int srvc_idx;
+    uint64_t deadline;
+    ble_device_t *dev;
+};
+
+/* Internal representation of a BLE device */
 struct ble_device {
     bt_bdaddr_t bda;
     int conn_id;
 
     btgatt_srvc_id_t *srvcs;
+    uint8_t *srvc_flags;
     uint8_t srvc_count;
+    ble_gatt_incl_t *incls;
+    int incl_count;
+    int incl_walk;
     ble_gatt_char_t *chars;
     uint8_t char_count;
     ble_gatt_desc_t *descs;
@@ -68,9 +352,149 @@ struct ble_device {
     gatt_elem_t prep_write_type;
     uint8_t prep_write_id;
 
+    ble_discovery_state_t disc_state;
+    uint8_t disc_counted;       /* In data.disc_pending, by disc_lock */
+    int disc_idx;
+
+    ble_gatt_req_t *reqs;
+    uint8_t req_running;
+
+    uint16_t mtu;
+
+    /* Connection parameters reported by the stack, 0 if unknown */
+    uint16_t conn_interval;
+    uint16_t conn_latency;
+    uint16_t conn_timeout;
+
+    ble_gatt_sub_t *subs;
+    ble_timer_t notify_timer;
+    ble_sweep_entry_t *sweep;
+    uint8_t sweep_dropped;  /* A sweep gave up connecting, by sweep.lock */
+
+    /* Connection request, protected by conn_sched.lock */
+    conn_state_t conn_state;
+    uint8_t conn_cancelled;
+    int conn_priority;
+    int conn_attempt_timeout;
+    ble_device_t *conn_next;
+
+    /* Automatic reconnection, protected by conn_sched.lock */
+    uint8_t reconnect;
+    uint8_t user_disconnect;
+    reconnect_state_t reconnect_state;
+    int reconnect_min;
+    int reconnect_max;
+    int reconnect_attempts;
+    uint64_t reconnect_down;
+    uint64_t reconnect_up;
+    uint32_t reconnect_seed;
+    ble_timer_t reconnect_timer;
+
+    /* Connection requested on an advertisement, protected by fast.lock */
+    uint8_t fast_pending;
+    uint64_t fast_advert;
+
     ble_device_t *next;
 };
 
+/* Device of the scan table. Slots never move, so the index only holds their
+ * position plus one, 0 marking free index slots. */
+typedef struct {
+    uint64_t key;
+    uint8_t used;
+    uint8_t ref;
+    uint8_t dirty;
+    uint16_t hist_pos;
+    uint16_t hist_len;
+    uint8_t top;
+    int64_t rssi_sum;
+    ble_scan_entry_t e;
+} scan_slot_t;
+
+/* Device among the strongest ones */
+typedef struct {
+    int slot;
+    int rssi;
+    uint64_t last;
+} scan_top_t;
+
+/* Presence change caused by a report, delivered once scan.lock is released */
+typedef struct {
+    ble_presence_cb_t cb;
+    ble_scan_entry_t entry;
+} presence_event_t;
+
+/* Device present, apart from the scan table so that it stays present
+ * whatever the number of the other devices. It keeps the entry of its last
+ * report, to be reported when it leaves. Slots never move: the free ones are
+ * chained through wheel_next, and the index holds their position plus one. */
+typedef struct {
+    uint64_t key;
+    uint64_t seen;
+    uint8_t used;
+    uint8_t wheel_bucket;
+    int wheel_next;
+    int wheel_prev;
+    ble_scan_entry_t e;
+} presence_dev_t;
+
+/* Scan filter compiled for scan_filter_match(): the address prefix becomes a
+ * mask over the packed address, and a UUID from the base UUID is matched in
+ * its 16-bit form as well */
+typedef struct {
+    uint64_t addr_mask;
+    uint64_t addr_value;
+    int rssi;
+    uint8_t needs;
+    uint8_t has_uuid16;
+    uint16_t uuid16;
+    uint8_t uuid128[16];
+    uint16_t company;
+    uint8_t data_len;
+    uint8_t data[BLE_SCAN_FILTER_DATA_LEN];
+    uint8_t mask[BLE_SCAN_FILTER_DATA_LEN];
+} scan_filter_t;
+
+/* Allowlist of addresses. Addresses are packed in 6 bytes each in an open
+ * addressing set with linear probing; the zero address marks free slots, so
+ * it is kept apart. The Bloom filter, if any, sets all the bits of an address
+ * in a single word, so it costs one memory access. */
+typedef struct {
+    uint32_t count;
+    uint32_t mask;
+    uint8_t shift;
+    uint8_t has_zero;
+    uint8_t bloom_k;
+    uint32_t bloom_mask;
+    uint64_t *bloom;
+    uint8_t slots[];
+} allowlist_t;
+
+/* Decoder of manufacturer or service data */
+typedef struct {
+    uint32_t key;
+    ble_decoder_cb_t cb;
+} decoder_t;
+
+/* Result of the resolution of a private address, the index of the key it
+ * resolved with or -1, valid until expires */
+typedef struct {
+    uint64_t key;
+    uint64_t expires;
+    int irk;
+} rpa_entry_t;
+
+/* Rule of connection on matching advertisements */
+typedef struct {
+    uint8_t used;
+    uint8_t has_address;
+    uint8_t address[6];
+    uint8_t ad_type;
+    uint8_t len;
+    uint8_t value[ADV_PACKET_LEN - 2];
+    uint8_t mask[ADV_PACKET_LEN - 2];
+} fast_rule_t;
+
 /* Data that have to be acessable by the callbacks */
 static struct libdata {
     ble_cbs_t cbs;
@@ -83,322 +507,5515 @@ static struct libdata {
     uint8_t adapter_state;
     uint8_t scan_state;
     ble_device_t *devices;
+
+    ble_discovery_cb_t disc_cb;
+    ble_discovery_ready_cb_t disc_ready_cb;
+    int disc_count;
+    int disc_failed;
+    int disc_pending;
+
+    int stream_credits;
 } data;
 
-/* Called every time an advertising report is seen */
-static void scan_result_cb(bt_bdaddr_t *bda, int rssi, uint8_t *adv_data) {
-    if (data.cbs.scan_cb)
-        data.cbs.scan_cb(bda->address, rssi, adv_data);
+/* Serializes the additions to the list of devices, which are made by the
+ * application thread and by the stack callbacks. Devices are only removed
+ * once the adapter is off, so the list is walked without it. */
+static pthread_mutex_t devices_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Protects the state of ble_gatt_discover_all(), which is started by the
+ * application thread and advanced by the stack callbacks */
+static pthread_mutex_t disc_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Protects the request queues, which are fed by the application thread and
+ * drained by the stack callbacks. req_idle is signalled when a stream stops
+ * sending chunks. */
+static pthread_mutex_t req_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t req_idle = PTHREAD_COND_INITIALIZER;
+
+/* Protects the values held back by the notification policies, which are
+ * released either by the stack callbacks or by the timer thread */
+static pthread_mutex_t notify_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Protects the notification statistics, which are updated by the stack
+ * callbacks and read by the application thread */
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Notification recorder. Records are only written by the stack callback
+ * thread; the lock keeps the mapping alive while a record is written, and
+ * protects the record flag of the subscriptions. */
+static struct {
+    pthread_mutex_t lock;
+    int fd;
+    size_t size;
+    ble_rec_header_t *hdr;
+    uint8_t *ring;
+} rec = { PTHREAD_MUTEX_INITIALIZER, -1, 0, NULL, NULL };
+
+/* Connection requests, issued one at a time since the stack only supports
+ * one pending connection */
+static struct {
+    pthread_mutex_t lock;
+    ble_device_t *queue;
+    ble_device_t *pending;
+    uint64_t deadline;
+    int max_links;
+    int links;
+    int background;     /* Background connections of reconnections */
+    ble_timer_t timer;
+} conn_sched = { .lock = PTHREAD_MUTEX_INITIALIZER,
+                 .max_links = CONN_DEFAULT_MAX_LINKS };
+
+/* Connections on matching advertisements. The number of rules is read
+ * without the lock so scan results cost nothing when there are none. */
+static struct {
+    pthread_mutex_t lock;
+    fast_rule_t rules[FAST_CONNECT_MAX_RULES];
+    int count;
+    uint8_t pause_scan;
+    uint8_t paused;
+    int pending;
+    uint64_t latency_sum;
+    ble_fast_connect_stats_t stats;
+} fast = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/* Scan filters, replaced as a whole by ble_scan_set_filters() */
+static struct {
+    pthread_mutex_t lock;
+    scan_filter_t set[BLE_SCAN_MAX_FILTERS];
+    int count;
+} filters = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/* Decoders of the advertising data, keyed by the kind of data and its
+ * identifier, and the callbacks of the built-in decoders, which are kept out
+ * of the table. The number of decoders and callbacks set, active, is read
+ * without the lock so scan results cost nothing when there are none. */
+static struct {
+    pthread_mutex_t lock;
+    int count;
+    int active;
+    decoder_t table[DECODER_TABLE_SIZE];
+    ble_ibeacon_cb_t ibeacon_cb;
+    ble_eddystone_cb_t eddystone_cb;
+} decoders = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/* Identity resolving keys, with the identity address and the last private
+ * address of each, and the cache of the addresses resolved with them. All of
+ * it is replaced by ble_rpa_set_keys(). The number of keys is read without
+ * the lock so scan results cost nothing when there are none. */
+static struct {
+    pthread_mutex_t lock;
+    int count;
+    int period;
+    aes128_key_t *keys;
+    uint8_t (*identity)[6];
+    uint8_t (*current)[6];
+    rpa_entry_t *cache;
+    ble_rpa_stats_t stats;
+} rpa = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/* Allowlist, looked up by the scan path without locking. Lookups count
+ * themselves in one of readers, chosen by the parity of epoch, while they use
+ * the list, so a replaced list is only freed once they are done; lock
+ * serializes the replacements. */
+static struct {
+    pthread_mutex_t lock;
+    allowlist_t *cur;
+    unsigned int epoch;
+    int readers[2];
+} allow = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/* Scan reports collected for batched delivery. Reports are added to one
+ * buffer while the other one is delivered. A single batch is delivered at a
+ * time, by the thread which swapped it out, without the lock held so that the
+ * callback may change the settings; idle is signalled when it is done. */
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t idle;
+    int size;
+    int interval;
+    ble_scan_batch_cb_t cb;
+    ble_scan_report_t *buf[2];
+    int cur;
+    int count;
+    ble_scan_report_t *delivering;  /* Buffer being delivered, if any */
+    pthread_t deliverer;
+    ble_timer_t timer;
+} batch = { .lock = PTHREAD_MUTEX_INITIALIZER,
+            .idle = PTHREAD_COND_INITIALIZER };
+
+/* Table of the devices found while scanning, updated by scan_result_cb and
+ * read by the application and timer threads. It holds size devices, and is
+ * keyed by packed address in an open addressing index with linear probing. When full, the slot to
+ * reuse is chosen by the CLOCK algorithm, using the bit set on each report.
+ * The RSSI history of the slots is kept in two arrays, hist_depth samples per
+ * slot, with the timestamps apart from the RSSI. Present devices are kept in
+ * a table of their own, indexed like the scan table, and linked in the bucket
+ * of the timing wheel where they may leave; reports only update the time
+ * they were seen, and are checked again when their bucket is due.
+ * presence_lock keeps presence changes delivered in order, and is held by
+ * every report. The strongest devices are kept in top, sorted by smoothed
+ * RSSI. */
+static struct {
+    pthread_mutex_t lock;
+    scan_slot_t *slots;     /* Allocated on the first report if not set */
+    uint32_t *index;
+    int size;
+    int index_bits;
+    int used;
+    int hand;
+    ble_scan_policy_t policy;
+    int interval;
+    ble_scan_digest_cb_t digest_cb;
+    ble_timer_t timer;
+    int hist_depth;
+    uint64_t *hist_time;
+    int8_t *hist_rssi;
+    pthread_mutex_t presence_lock;
+    ble_presence_cb_t presence_cb;
+    int enter_rssi;
+    int exit_rssi;
+    int presence_timeout;
+    int tick;
+    uint64_t wheel_tick;
+    presence_dev_t *present_devs;
+    int *present_index;
+    int present_bits;   /* Of the index size, 0 if not allocated */
+    int present_used;   /* Slots ever used */
+    int present_free;   /* First free slot plus one */
+    int present;
+    int wheel[PRESENCE_WHEEL_SIZE];
+    ble_timer_t presence_timer;
+    int top_k;
+    int top_age;
+    int top_count;
+    scan_top_t top[BLE_SCAN_MAX_TOP];
+} scan = { .lock = PTHREAD_MUTEX_INITIALIZER,
+           .size = SCAN_TABLE_SIZE,
+           .presence_lock = PTHREAD_MUTEX_INITIALIZER };
+
+/* Sweep over a list of devices, driven by the stack callbacks and by the
+ * timer thread */
+static struct {
+    pthread_mutex_t lock;
+    uint8_t running;
+    ble_sweep_entry_t *entries;
+    int count;
+    int *queue;
+    int q_head;
+    int q_len;
+    int *reports;
+    int r_len;
+    bt_uuid_t service;
+    uint8_t has_service;
+    bt_uuid_t *chars;
+    int char_count;
+    int max_links;
+    int timeout;
+    int retries;
+    int active;
+    int done;
+    int failed;
+    uint64_t start_ms;
+    ble_sweep_cb_t cb;
+    ble_sweep_done_cb_t done_cb;
+    ble_timer_t timer;
+} sweep = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/* Timers armed, sorted by expiration, and the thread running them */
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_cond_t idle;
+    uint8_t started;
+    uint8_t stop;
+    pthread_t thread;
+    ble_timer_t *list;
+    ble_timer_t *running;   /* Timer whose callback is in progress */
+} timers = { .lock = PTHREAD_MUTEX_INITIALIZER,
+             .cond = PTHREAD_COND_INITIALIZER,
+             .idle = PTHREAD_COND_INITIALIZER };
+
+/* Monotonic time in milliseconds */
+static uint64_t now_ms() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
-static int ble_scan(uint8_t start) {
-    bt_status_t s;
+/* Monotonic time in microseconds */
+static uint64_t now_us() {
+    struct timespec ts;
 
-    if (!data.client)
-        return -1;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
 
-    if (data.gattiface == NULL)
-        return -1;
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 
-    if (!data.adapter_state)
-        return -1;
+/* Unlink a timer from the armed list. Must hold timers.lock. */
+static void timer_unlink(ble_timer_t *t) {
+    ble_timer_t **p;
 
-    if (data.scan_state == start)
-        return 1;
+    for (p = &timers.list; *p; p = &(*p)->next)
+        if (*p == t) {
+            *p = t->next;
+            break;
+        }
 
-    s = data.gattiface->client->scan(data.client, start);
-    if (s != BT_STATUS_SUCCESS)
-        return -s;
+    t->armed = 0;
+}
 
-    data.scan_state = start;
+static void *timer_thread(void *arg) {
+    ble_timer_t *t;
+    struct timespec ts;
+    uint64_t now, wait;
+
+    pthread_mutex_lock(&timers.lock);
+    while (!timers.stop) {
+        t = timers.list;
+        if (!t) {
+            pthread_cond_wait(&timers.cond, &timers.lock);
+            continue;
+        }
+
+        now = now_ms();
+        if (t->when > now) {
+            /* Condition variables wait on the realtime clock */
+            wait = t->when - now;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_sec += wait / 1000;
+            ts.tv_nsec += (wait % 1000) * 1000000;
+            if (ts.tv_nsec >= 1000000000) {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&timers.cond, &timers.lock, &ts);
+            continue;
+        }
+
+        timer_unlink(t);
+        timers.running = t;
+        pthread_mutex_unlock(&timers.lock);
+        t->cb(t->arg);
+        pthread_mutex_lock(&timers.lock);
+        timers.running = NULL;
+        pthread_cond_broadcast(&timers.idle);
+    }
 
-    return 0;
-}
+    timers.started = 0;
+    pthread_cond_broadcast(&timers.idle);
+    pthread_mutex_unlock(&timers.lock);
 
-int ble_start_scan() {
-    return ble_scan(1);
+    return NULL;
 }
 
-int ble_stop_scan() {
-    return ble_scan(0);
-}
+/* Arm a timer to expire at a monotonic time in ms, rearming it if needed */
+static void timer_arm(ble_timer_t *t, uint64_t when) {
+    ble_timer_t **p;
+    pthread_t thread;
 
-static ble_device_t *find_device_by_address(const uint8_t *address) {
-    ble_device_t *dev;
+    pthread_mutex_lock(&timers.lock);
 
-    for (dev = data.devices; dev ; dev = dev->next)
-        if (!memcmp(dev->bda.address, address, sizeof(dev->bda.address)))
-            break;
+    if (!timers.started) {
+        if (pthread_create(&thread, NULL, timer_thread, NULL)) {
+            pthread_mutex_unlock(&timers.lock);
+            return;
+        }
+        pthread_detach(thread);
+        timers.thread = thread;
+        timers.started = 1;
+    }
 
-    return dev;
-}
+    if (t->armed)
+        timer_unlink(t);
 
-/* Called every time a device gets connected */
-static void connect_cb(int conn_id, int status, int client_if,
-                       bt_bdaddr_t *bda) {
-    ble_device_t *dev;
+    for (p = &timers.list; *p && (*p)->when <= when; p = &(*p)->next);
+    t->when = when;
+    t->next = *p;
+    t->armed = 1;
+    *p = t;
 
-    dev = find_device_by_address(bda->address);
-    if (!dev)
-        return;
+    pthread_cond_signal(&timers.cond);
+    pthread_mutex_unlock(&timers.lock);
+}
 
-    dev->conn_id = conn_id;
+/* Disarm a timer, without waiting for its callback if in progress. For callers
+ * holding a lock that the callback takes. */
+static void timer_disarm(ble_timer_t *t) {
+    pthread_mutex_lock(&timers.lock);
+    if (t->armed)
+        timer_unlink(t);
+    pthread_mutex_unlock(&timers.lock);
+}
 
-    if (data.cbs.connect_cb)
-        data.cbs.connect_cb(bda->address, conn_id, status);
+/* Disarm a timer and wait for its callback if in progress, unless called from
+ * the callback itself, so that the timer can be freed afterwards */
+static void timer_cancel(ble_timer_t *t) {
+    pthread_mutex_lock(&timers.lock);
+    for (;;) {
+        /* The callback may arm the timer again */
+        if (t->armed)
+            timer_unlink(t);
+        if (timers.running != t ||
+            pthread_equal(pthread_self(), timers.thread))
+            break;
+        pthread_cond_wait(&timers.idle, &timers.lock);
+    }
+    pthread_mutex_unlock(&timers.lock);
 }
 
-int ble_connect(const uint8_t *address) {
-    ble_device_t *dev;
-    bt_status_t s;
+/* Stop the timer thread, waiting for it to exit. Timers still armed run
+ * once a timer is armed again, which starts a new thread. */
+static void timer_stop(void) {
+    pthread_mutex_lock(&timers.lock);
+    if (timers.started && !pthread_equal(pthread_self(), timers.thread)) {
+        timers.stop = 1;
+        pthread_cond_signal(&timers.cond);
+        while (timers.started)
+            pthread_cond_wait(&timers.idle, &timers.lock);
+        timers.stop = 0;
+    }
+    pthread_mutex_unlock(&timers.lock);
+}
 
-    if (!data.client)
-        return -1;
+/* The Bluetooth base UUID, least-significant byte first, with the 16 or
+ * 32-bit UUID from byte 12 */
+static const uint8_t base_uuid[16] = {
+    0xfb, 0x34, 0x9b, 0x5f, 0x80, 0x00, 0x00, 0x80,
+    0x00, 0x10, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
+};
 
-    if (!data.gattiface)
-        return -1;
+void ble_ad_iter_init(ble_ad_iter_t *it, const uint8_t *adv_data,
+                      int adv_len) {
+    it->data = adv_data;
+    it->len = adv_data ? adv_len : 0;
+    it->pos = 0;
+}
 
-    if (!data.adapter_state)
-        return -1;
+int ble_ad_next(ble_ad_iter_t *it, uint8_t *type, const uint8_t **value,
+                int *len) {
+    int l;
 
-    dev = find_device_by_address(address);
-    if (!dev) {
-        int i;
+    while (it->pos < it->len) {
+        l = it->data[it->pos];
 
-        dev = calloc(1, sizeof(ble_device_t));
-        if (!dev)
-            return -1;
+        /* The advertising data ends, the scan response may follow */
+        if (!l) {
+            if (it->pos >= ADV_PACKET_LEN)
+                break;
+            it->pos = ADV_PACKET_LEN;
+            continue;
+        }
 
-        /* TODO: memcpy() */
-        for (i = 0; i < 6; i++)
-            dev->bda.address[i] = address[i];
+        if (it->pos + 1 + l > it->len)
+            break;
 
-        dev->next = data.devices;
-        data.devices = dev;
+        *type = it->data[it->pos + 1];
+        *value = it->data + it->pos + 2;
+        *len = l - 1;
+        it->pos += 1 + l;
+
+        return 1;
     }
 
-    s = data.gattiface->client->connect(data.client, &dev->bda, true);
-    if (s != BT_STATUS_SUCCESS)
-        return -s;
+    it->pos = it->len;
 
     return 0;
 }
 
-/* Called every time a device gets disconnected */
-static void disconnect_cb(int conn_id, int status, int client_if,
-                          bt_bdaddr_t *bda) {
-    ble_device_t *dev;
+int ble_ad_get_name(const uint8_t *adv_data, int adv_len, char *name,
+                    int size) {
+    ble_ad_iter_t it;
+    const uint8_t *value, *found = NULL;
+    uint8_t type;
+    int len, found_len = 0;
 
-    dev = find_device_by_address(bda->address);
-    if (!dev)
-        return;
+    if (!name || size <= 0)
+        return -1;
 
-    dev->conn_id = 0;
+    ble_ad_iter_init(&it, adv_data, adv_len);
+    while (ble_ad_next(&it, &type, &value, &len)) {
+        if (type == AD_NAME_COMPLETE) {
+            found = value;
+            found_len = len;
+            break;
+        }
+        if (type == AD_NAME_SHORT && !found) {
+            found = value;
+            found_len = len;
+        }
+    }
+
+    if (!found)
+        return -1;
+
+    if (found_len > size - 1)
+        found_len = size - 1;
+    memcpy(name, found, found_len);
+    name[found_len] = '\0';
 
-    if (data.cbs.disconnect_cb)
-        data.cbs.disconnect_cb(bda->address, conn_id, status);
+    return found_len;
 }
 
-int ble_disconnect(const uint8_t *address) {
-    ble_device_t *dev;
-    bt_status_t s;
+int ble_ad_get_uuids(const uint8_t *adv_data, int adv_len, uint8_t *uuids,
+                     int max) {
+    ble_ad_iter_t it;
+    const uint8_t *value;
+    uint8_t type, *uuid;
+    int len, size, i, count = 0;
+
+    ble_ad_iter_init(&it, adv_data, adv_len);
+    while (ble_ad_next(&it, &type, &value, &len)) {
+        if (type == AD_UUID16_SOME || type == AD_UUID16_ALL)
+            size = 2;
+        else if (type == AD_UUID32_SOME || type == AD_UUID32_ALL)
+            size = 4;
+        else if (type == AD_UUID128_SOME || type == AD_UUID128_ALL)
+            size = 16;
+        else
+            continue;
+
+        for (i = 0; i + size <= len; i += size, count++) {
+            if (!uuids || count >= max)
+                continue;
+
+            uuid = uuids + 16 * count;
+            if (size == 16)
+                memcpy(uuid, value + i, 16);
+            else {
+                memcpy(uuid, base_uuid, 16);
+                memcpy(uuid + 12, value + i, size);
+            }
+        }
+    }
 
-    if (!data.client)
-        return -1;
+    return count;
+}
 
-    if (!data.gattiface)
-        return -1;
+int ble_ad_get_tx_power(const uint8_t *adv_data, int adv_len, int *tx_power) {
+    ble_ad_iter_t it;
+    const uint8_t *value;
+    uint8_t type;
+    int len;
 
-    if (!data.adapter_state)
+    if (!tx_power)
         return -1;
 
-    if (!address)
-        return -1;
+    ble_ad_iter_init(&it, adv_data, adv_len);
+    while (ble_ad_next(&it, &type, &value, &len))
+        if (type == AD_TX_POWER && len >= 1) {
+            *tx_power = (int8_t) value[0];
+            return 0;
+        }
 
-    dev = find_device_by_address(address);
-    if (!dev)
+    return -1;
+}
+
+int ble_ad_get_manufacturer_data(const uint8_t *adv_data, int adv_len,
+                                 int *company, const uint8_t **data,
+                                 int *len) {
+    ble_ad_iter_t it;
+    const uint8_t *value;
+    uint8_t type;
+    int l;
+
+    if (!company || !data || !len)
         return -1;
 
-    s = data.gattiface->client->disconnect(data.client, &dev->bda,
-                                           dev->conn_id);
-    if (s != BT_STATUS_SUCCESS)
-        return -s;
+    ble_ad_iter_init(&it, adv_data, adv_len);
+    while (ble_ad_next(&it, &type, &value, &l))
+        if (type == AD_MANUFACTURER && l >= 2) {
+            *company = value[0] | value[1] << 8;
+            *data = value + 2;
+            *len = l - 2;
+            return 0;
+        }
 
-    return 0;
+    return -1;
 }
 
-/* Called every time the bond state with a device changes */
-static void bond_state_changed_cb(bt_status_t status, bt_bdaddr_t *bda,
-                                  bt_bond_state_t state) {
-    ble_bond_state_t s;
-    ble_device_t *dev;
+/* Key of a decoder in the table: the kind of data in the upper half, from 1
+ * so no key is 0 */
+static uint32_t decoder_key(ble_decoder_kind_t kind, uint16_t id) {
+    return (uint32_t) (kind + 1) << 16 | id;
+}
 
-    switch (state) {
-        case BT_BOND_STATE_NONE:
-            s = BLE_BOND_NONE;
-            break;
-        case BT_BOND_STATE_BONDING:
-            s = BLE_BOND_BONDING;
-            break;
-        case BT_BOND_STATE_BONDED:
-            s = BLE_BOND_BONDED;
+static int decoder_slot(uint32_t key) {
+    return (key * 0x9e3779b9U) >> (32 - DECODER_TABLE_BITS);
+}
+
+/* Position in the table of a decoder, or of the empty slot ending its probe
+ * sequence. Must hold decoders.lock. */
+static int decoder_find(uint32_t key) {
+    int i;
+
+    for (i = decoder_slot(key); decoders.table[i].key;
+         i = (i + 1) % DECODER_TABLE_SIZE)
+        if (decoders.table[i].key == key)
             break;
-        default:
-            return;
-    }
 
-    dev = find_device_by_address(bda->address);
-    if (dev && data.cbs.bond_state_cb)
-        data.cbs.bond_state_cb(bda->address, s, status);
+    return i;
 }
 
-static int ble_pair_internal(const uint8_t *address, uint8_t operation) {
-    ble_device_t *dev;
-    bt_status_t s = BT_STATUS_UNSUPPORTED;
+int ble_decoder_register(ble_decoder_kind_t kind, uint16_t id,
+                         ble_decoder_cb_t cb) {
+    uint32_t key;
+    int i, j, home;
 
-    if (!data.btiface)
+    if (kind < BLE_DECODER_MANUFACTURER || kind > BLE_DECODER_SERVICE_DATA)
         return -1;
 
-    if (!data.adapter_state)
-        return -1;
+    key = decoder_key(kind, id);
 
-    dev = find_device_by_address(address);
-    if (!dev) {
-        int i;
+    pthread_mutex_lock(&decoders.lock);
 
-        dev = calloc(1, sizeof(ble_device_t));
-        if (!dev)
-            return -1;
+    i = decoder_find(key);
 
-        /* TODO: memcpy() */
-        for (i = 0; i < 6; i++)
-            dev->bda.address[i] = address[i];
+    if (cb) {
+        if (!decoders.table[i].key) {
+            if (decoders.count == BLE_DECODER_MAX) {
+                pthread_mutex_unlock(&decoders.lock);
+                return -1;
+            }
+            decoders.table[i].key = key;
+            decoders.count++;
+            decoders.active++;
+        }
+        decoders.table[i].cb = cb;
+        pthread_mutex_unlock(&decoders.lock);
+        return 0;
+    }
 
-        dev->next = data.devices;
-        data.devices = dev;
+    if (!decoders.table[i].key) {
+        pthread_mutex_unlock(&decoders.lock);
+        return 0;
     }
 
-    switch (operation) {
-        case 0: /* Pair */
-            s = data.btiface->create_bond(&dev->bda);
-            break;
-        case 1: /* Cancel pairing */
-            s = data.btiface->cancel_bond(&dev->bda);
-            break;
-        case 2: /* Remove bond */
-            s = data.btiface->remove_bond(&dev->bda);
-            break;
+    /* Move back the decoders of the probe sequence, as for the scan index */
+    for (j = (i + 1) % DECODER_TABLE_SIZE; decoders.table[j].key;
+         j = (j + 1) % DECODER_TABLE_SIZE) {
+        home = decoder_slot(decoders.table[j].key);
+        if ((j > i && (home <= i || home > j)) ||
+            (j < i && home <= i && home > j)) {
+            decoders.table[i] = decoders.table[j];
+            i = j;
+        }
     }
+    memset(&decoders.table[i], 0, sizeof(decoders.table[i]));
+    decoders.count--;
+    decoders.active--;
 
-    if (s != BT_STATUS_SUCCESS)
-        return -s;
+    pthread_mutex_unlock(&decoders.lock);
 
     return 0;
 }
 
-int ble_pair(const uint8_t *address) {
-    return ble_pair_internal(address, 0);
-}
+static void decode_ibeacon(ble_ibeacon_cb_t cb, const uint8_t *address,
+                           int rssi, const uint8_t *data, int len) {
+    ble_ibeacon_t b;
 
-int ble_cancel_pairing(const uint8_t *address) {
-    return ble_pair_internal(address, 1);
-}
+    /* Type and length of the iBeacon payload */
+    if (len < 23 || data[0] != 0x02 || data[1] != 0x15)
+        return;
 
-int ble_remove_bond(const uint8_t *address) {
-    return ble_pair_internal(address, 2);
+    memcpy(b.uuid, data + 2, sizeof(b.uuid));
+    b.major = data[18] << 8 | data[19];
+    b.minor = data[20] << 8 | data[21];
+    b.tx_power = (int8_t) data[22];
+
+    cb(address, rssi, &b);
 }
 
-static ble_device_t *find_device_by_conn_id(int conn_id) {
-    ble_device_t *dev;
+/* Eddystone-URL scheme prefixes and expansions of the URL bytes */
+static const char *const eddystone_schemes[] = {
+    "http://www.", "https://www.", "http://", "https://"
+};
 
-    for (dev = data.devices; dev ; dev = dev->next)
-        if (dev->conn_id == conn_id)
-            break;
+static const char *const eddystone_expansions[] = {
+    ".com/", ".org/", ".edu/", ".net/", ".info/", ".biz/", ".gov/",
+    ".com", ".org", ".edu", ".net", ".info", ".biz", ".gov"
+};
 
-    return dev;
-}
+static int decode_eddystone_url(char *url, const uint8_t *data, int len) {
+    const char *s;
+    int i, n;
 
-/* Called in response of a read remote RSSI operation */
-void read_remote_rssi_cb(int client_if, bt_bdaddr_t *bda, int rssi,
-                         int status) {
-    ble_device_t *dev;
-    int conn_id = -1;
+    if (data[0] >= sizeof(eddystone_schemes) / sizeof(eddystone_schemes[0]))
+        return -1;
 
-    if (!status) {
-        dev = find_device_by_address(bda->address);
-        if (dev)
-            conn_id = dev->conn_id;
+    n = strlen(eddystone_schemes[data[0]]);
+    memcpy(url, eddystone_schemes[data[0]], n);
+
+    for (i = 1; i < len; i++) {
+        if (data[i] < sizeof(eddystone_expansions) /
+                      sizeof(eddystone_expansions[0])) {
+            s = eddystone_expansions[data[i]];
+            memcpy(url + n, s, strlen(s));
+            n += strlen(s);
+        } else if (data[i] > 0x20 && data[i] < 0x7f)
+            url[n++] = data[i];
+        else
+            return -1;
     }
 
-    if (data.cbs.rssi_cb)
-        data.cbs.rssi_cb(conn_id, rssi, status);
+    url[n] = '\0';
+
+    return 0;
 }
 
-int ble_read_remote_rssi(int conn_id) {
-    ble_device_t *dev;
-    bt_status_t s;
+static void decode_eddystone(ble_eddystone_cb_t cb, const uint8_t *address,
+                             int rssi, const uint8_t *data, int len) {
+    ble_eddystone_t f;
 
-    if (!data.client)
-        return -1;
+    if (len < 2)
+        return;
 
-    if (conn_id <= 0)
-        return -1;
+    memset(&f, 0, sizeof(f));
+    f.frame = data[0];
 
-    if (!data.gattiface)
-        return -1;
+    switch (f.frame) {
+        case BLE_EDDYSTONE_UID:
+            if (len < 18)
+                return;
+            f.tx_power = (int8_t) data[1];
+            memcpy(f.namespace_id, data + 2, sizeof(f.namespace_id));
+            memcpy(f.instance_id, data + 12, sizeof(f.instance_id));
+            break;
+        case BLE_EDDYSTONE_URL:
+            if (len < 3 || len > 3 + EDDYSTONE_URL_MAX)
+                return;
+            f.tx_power = (int8_t) data[1];
+            if (decode_eddystone_url(f.url, data + 2, len - 2) < 0)
+                return;
+            break;
+        case BLE_EDDYSTONE_TLM:
+            /* Only the unencrypted version */
+            if (len < 14 || data[1] != 0x00)
+                return;
+            f.battery = data[2] << 8 | data[3];
+            f.temperature = (int16_t) (data[4] << 8 | data[5]);
+            f.adv_count = (uint32_t) data[6] << 24 | data[7] << 16 |
+                          data[8] << 8 | data[9];
+            f.uptime = (uint32_t) data[10] << 24 | data[11] << 16 |
+                       data[12] << 8 | data[13];
+            break;
+        case BLE_EDDYSTONE_EID:
+            if (len < 10)
+                return;
+            f.tx_power = (int8_t) data[1];
+            memcpy(f.eid, data + 2, sizeof(f.eid));
+            break;
+        default:
+            return;
+    }
 
-    dev = find_device_by_conn_id(conn_id);
-    if (!dev)
-        return -1;
+    cb(address, rssi, &f);
+}
 
-    s = data.gattiface->client->read_remote_rssi(data.client, &dev->bda);
-    if (s != BT_STATUS_SUCCESS)
-        return -s;
+/* Run the decoders of the manufacturer and service data of a report, the
+ * registered ones and then the built-in ones. The decoders are looked up
+ * first, so they are called without the lock and may register others. */
+static void decoders_run(const uint8_t *address, int rssi,
+                         const uint8_t *adv_data) {
+    struct {
+        ble_decoder_cb_t cb;
+        ble_ibeacon_cb_t ibeacon_cb;
+        ble_eddystone_cb_t eddystone_cb;
+        uint16_t id;
+        const uint8_t *data;
+        int len;
+    } run[ADV_DATA_LEN / 2];
+    ble_ad_iter_t it;
+    const uint8_t *value;
+    uint16_t id;
+    uint8_t type;
+    int i, len, count = 0;
+
+    pthread_mutex_lock(&decoders.lock);
+
+    /* AD structures with an identifier take 4 bytes at least, so each can
+     * have both kinds of decoders */
+    ble_ad_iter_init(&it, adv_data, ADV_DATA_LEN);
+    while (ble_ad_next(&it, &type, &value, &len)) {
+        if (len < 2)
+            continue;
+
+        id = value[0] | value[1] << 8;
+        if (type == AD_MANUFACTURER)
+            i = decoder_find(decoder_key(BLE_DECODER_MANUFACTURER, id));
+        else if (type == AD_SERVICE_DATA16)
+            i = decoder_find(decoder_key(BLE_DECODER_SERVICE_DATA, id));
+        else
+            continue;
+
+        memset(&run[count], 0, sizeof(run[count]));
+        run[count].cb = decoders.table[i].key ? decoders.table[i].cb : NULL;
+        if (type == AD_MANUFACTURER && id == COMPANY_APPLE)
+            run[count].ibeacon_cb = decoders.ibeacon_cb;
+        else if (type == AD_SERVICE_DATA16 && id == UUID_EDDYSTONE)
+            run[count].eddystone_cb = decoders.eddystone_cb;
+
+        if (!run[count].cb && !run[count].ibeacon_cb &&
+            !run[count].eddystone_cb)
+            continue;
+
+        run[count].id = id;
+        run[count].data = value + 2;
+        run[count].len = len - 2;
+        count++;
+    }
 
-    return 0;
+    pthread_mutex_unlock(&decoders.lock);
+
+    for (i = 0; i < count; i++) {
+        if (run[i].cb)
+            run[i].cb(address, rssi, run[i].id, run[i].data, run[i].len);
+        if (run[i].ibeacon_cb)
+            decode_ibeacon(run[i].ibeacon_cb, address, rssi, run[i].data,
+                           run[i].len);
+        if (run[i].eddystone_cb)
+            decode_eddystone(run[i].eddystone_cb, address, rssi, run[i].data,
+                             run[i].len);
+    }
 }
 
-static int find_service(ble_device_t *dev, btgatt_srvc_id_t *srvc_id) {
-    int id;
+int ble_decoder_set_ibeacon_cb(ble_ibeacon_cb_t cb) {
+    pthread_mutex_lock(&decoders.lock);
+    decoders.active += !!cb - !!decoders.ibeacon_cb;
+    decoders.ibeacon_cb = cb;
+    pthread_mutex_unlock(&decoders.lock);
 
-    for (id = 0; id < dev->srvc_count; id++)
-        if (!memcmp(&dev->srvcs[id], srvc_id, sizeof(btgatt_srvc_id_t)))
-            return id;
+    return 0;
+}
 
-    return -1;
+int ble_decoder_set_eddystone_cb(ble_eddystone_cb_t cb) {
+    pthread_mutex_lock(&decoders.lock);
+    decoders.active += !!cb - !!decoders.eddystone_cb;
+    decoders.eddystone_cb = cb;
+    pthread_mutex_unlock(&decoders.lock);
+
+    return 0;
+}
+
+static uint64_t scan_key(const uint8_t *address) {
+    uint64_t key = 0;
+    int i;
+
+    for (i = 0; i < 6; i++)
+        key = key << 8 | address[i];
+
+    return key;
+}
+
+/* Home slot of a packed address in an index of 2^bits slots */
+static int scan_index_slot(uint64_t key, int bits) {
+    return (key * 0x9e3779b97f4a7c15ULL) >> (64 - bits);
+}
+
+/* Conditions of a filter on the advertising data satisfied by an AD
+ * structure */
+static int scan_filter_ad(const scan_filter_t *f, uint8_t type,
+                          const uint8_t *value, int len) {
+    int i;
+
+    switch (type) {
+        case AD_UUID16_SOME:
+        case AD_UUID16_ALL:
+            if (!f->has_uuid16)
+                return 0;
+            for (i = 0; i + 2 <= len; i += 2)
+                if ((value[i] | value[i + 1] << 8) == f->uuid16)
+                    return FILTER_UUID;
+            return 0;
+        case AD_SERVICE_DATA16:
+            if (f->has_uuid16 && len >= 2 &&
+                (value[0] | value[1] << 8) == f->uuid16)
+                return FILTER_UUID;
+            return 0;
+        case AD_UUID128_SOME:
+        case AD_UUID128_ALL:
+            if (!(f->needs & FILTER_UUID))
+                return 0;
+            for (i = 0; i + 16 <= len; i += 16)
+                if (!memcmp(value + i, f->uuid128, 16))
+                    return FILTER_UUID;
+            return 0;
+        case AD_SERVICE_DATA128:
+            if ((f->needs & FILTER_UUID) && len >= 16 &&
+                !memcmp(value, f->uuid128, 16))
+                return FILTER_UUID;
+            return 0;
+        case AD_MANUFACTURER:
+            if (!(f->needs & FILTER_COMPANY) || len < 2 + f->data_len ||
+                (value[0] | value[1] << 8) != f->company)
+                return 0;
+            for (i = 0; i < f->data_len; i++)
+                if ((value[2 + i] ^ f->data[i]) & f->mask[i])
+                    return 0;
+            return FILTER_COMPANY;
+    }
+
+    return 0;
+}
+
+/* Whether a scan report passes the filters. The address and RSSI, which are
+ * cheap to check, are checked first, and the advertising data is only walked
+ * for the filters left. */
+static int scan_filter_match(const uint8_t *address, int rssi,
+                             const uint8_t *adv_data) {
+    const scan_filter_t *f;
+    ble_ad_iter_t it;
+    const uint8_t *value;
+    uint64_t key = 0;
+    uint32_t left = 0;
+    uint8_t met[BLE_SCAN_MAX_FILTERS], type;
+    int i, len, r = 0;
+
+    pthread_mutex_lock(&filters.lock);
+
+    if (!filters.count) {
+        pthread_mutex_unlock(&filters.lock);
+        return 1;
+    }
+
+    for (i = 0; i < 6; i++)
+        key = key << 8 | address[i];
+
+    for (i = 0; i < filters.count && !r; i++) {
+        f = &filters.set[i];
+        if (rssi < f->rssi || (key & f->addr_mask) != f->addr_value)
+            continue;
+        if (!f->needs)
+            r = 1;
+        left |= 1U << i;
+        met[i] = 0;
+    }
+
+    ble_ad_iter_init(&it, adv_data, ADV_DATA_LEN);
+    while (!r && left && ble_ad_next(&it, &type, &value, &len)) {
+        for (i = 0; i < filters.count && !r; i++) {
+            if (!(left & 1U << i))
+                continue;
+            f = &filters.set[i];
+            met[i] |= scan_filter_ad(f, type, value, len);
+            if (met[i] == f->needs)
+                r = 1;
+        }
+    }
+
+    pthread_mutex_unlock(&filters.lock);
+
+    return r;
+}
+
+int ble_scan_set_filters(const ble_scan_filter_t *set, int count) {
+    scan_filter_t compiled[BLE_SCAN_MAX_FILTERS];
+    const ble_scan_filter_t *in;
+    scan_filter_t *f;
+    int i, j;
+
+    if (count < 0 || count > BLE_SCAN_MAX_FILTERS || (count && !set))
+        return -1;
+
+    memset(compiled, 0, sizeof(compiled));
+
+    for (i = 0; i < count; i++) {
+        in = &set[i];
+        f = &compiled[i];
+
+        if (in->address_len > 6 || in->data_len > BLE_SCAN_FILTER_DATA_LEN ||
+            (in->has_company && (in->company < 0 || in->company > 0xffff)) ||
+            (in->data_len && !in->has_company))
+            return -1;
+
+        for (j = 0; j < in->address_len; j++) {
+            f->addr_mask |= 0xffULL << (40 - 8 * j);
+            f->addr_value |= (uint64_t) in->address[j] << (40 - 8 * j);
+        }
+
+        /* No report is weaker than -128 dBm */
+        f->rssi = in->rssi ? in->rssi : -128;
+
+        if (in->has_uuid) {
+            f->needs |= FILTER_UUID;
+            memcpy(f->uuid128, in->uuid, 16);
+            if (!memcmp(in->uuid, base_uuid, 12) && !in->uuid[14] &&
+                !in->uuid[15]) {
+                f->has_uuid16 = 1;
+                f->uuid16 = in->uuid[12] | in->uuid[13] << 8;
+            }
+        }
+
+        if (in->has_company) {
+            f->needs |= FILTER_COMPANY;
+            f->company = in->company;
+            f->data_len = in->data_len;
+            memcpy(f->data, in->data, in->data_len);
+            memcpy(f->mask, in->mask, in->data_len);
+        }
+    }
+
+    pthread_mutex_lock(&filters.lock);
+    memcpy(filters.set, compiled, count * sizeof(compiled[0]));
+    filters.count = count;
+    pthread_mutex_unlock(&filters.lock);
+
+    return 0;
+}
+
+static uint64_t allowlist_slot_get(const allowlist_t *l, uint32_t i) {
+    const uint8_t *s = l->slots + 6 * i;
+
+    return (uint64_t) s[0] << 40 | (uint64_t) s[1] << 32 |
+           (uint64_t) s[2] << 24 | (uint64_t) s[3] << 16 |
+           (uint64_t) s[4] << 8 | s[5];
+}
+
+static void allowlist_slot_set(allowlist_t *l, uint32_t i, uint64_t key) {
+    uint8_t *s = l->slots + 6 * i;
+    int j;
+
+    for (j = 5; j >= 0; j--, key >>= 8)
+        s[j] = key;
+}
+
+/* Word of the Bloom filter and bits set in it for an address */
+static uint64_t allowlist_bloom_bits(const allowlist_t *l, uint64_t key,
+                                     uint32_t *word) {
+    uint64_t h = (key ^ key >> 23) * 0xff51afd7ed558ccdULL, bits = 0;
+    int k;
+
+    h ^= h >> 32;
+    *word = h & l->bloom_mask;
+
+    for (h >>= 22, k = 0; k < l->bloom_k; k++, h >>= 6)
+        bits |= 1ULL << (h & 63);
+
+    return bits;
+}
+
+static int allowlist_find(const allowlist_t *l, uint64_t key) {
+    uint64_t bits, v;
+    uint32_t i, word;
+
+    if (!key)
+        return l->has_zero;
+
+    if (l->bloom) {
+        bits = allowlist_bloom_bits(l, key, &word);
+        if ((l->bloom[word] & bits) != bits)
+            return 0;
+    }
+
+    for (i = (key * 0x9e3779b97f4a7c15ULL) >> l->shift;; i = (i + 1) & l->mask) {
+        v = allowlist_slot_get(l, i);
+        if (v == key)
+            return 1;
+        if (!v)
+            return 0;
+    }
+}
+
+static void allowlist_add(allowlist_t *l, uint64_t key) {
+    uint64_t bits, v;
+    uint32_t i, word;
+
+    if (!key) {
+        l->count += !l->has_zero;
+        l->has_zero = 1;
+        return;
+    }
+
+    for (i = (key * 0x9e3779b97f4a7c15ULL) >> l->shift;; i = (i + 1) & l->mask) {
+        v = allowlist_slot_get(l, i);
+        if (v == key)
+            return;
+        if (!v)
+            break;
+    }
+
+    allowlist_slot_set(l, i, key);
+    l->count++;
+
+    if (l->bloom) {
+        bits = allowlist_bloom_bits(l, key, &word);
+        l->bloom[word] |= bits;
+    }
+}
+
+static void allowlist_free(allowlist_t *l) {
+    if (!l)
+        return;
+
+    free(l->bloom);
+    free(l);
+}
+
+/* Empty allowlist sized for count addresses */
+static allowlist_t *allowlist_new(uint32_t count, int bloom_bits) {
+    allowlist_t *l;
+    uint64_t size = ALLOW_MIN_SLOTS, words = 1;
+    int shift = 64 - 4, k;
+
+    while (size < 2 * (uint64_t) count) {
+        size <<= 1;
+        shift--;
+    }
+
+    l = calloc(1, sizeof(*l) + 6 * size);
+    if (!l)
+        return NULL;
+
+    l->mask = size - 1;
+    l->shift = shift;
+
+    if (bloom_bits) {
+        while (words * 64 < (uint64_t) count * bloom_bits)
+            words <<= 1;
+
+        l->bloom = calloc(words, sizeof(uint64_t));
+        if (!l->bloom) {
+            free(l);
+            return NULL;
+        }
+
+        /* ln 2 bits per address is best for a plain Bloom filter */
+        k = (bloom_bits * 69 + 50) / 100;
+        l->bloom_k = k < 1 ? 1 : k > ALLOW_BLOOM_MAX_K ? ALLOW_BLOOM_MAX_K : k;
+        l->bloom_mask = words - 1;
+    }
+
+    return l;
+}
+
+/* Replace the allowlist, waiting for the lookups still using the old one.
+ * Those may have counted themselves in either counter, so new lookups are
+ * moved to the other counter while one drains, twice; waiting for both
+ * counters at once could last forever under a steady flow of lookups. */
+static void allowlist_install(allowlist_t *l) {
+    allowlist_t *old;
+    unsigned int e;
+    int i;
+
+    pthread_mutex_lock(&allow.lock);
+    old = __atomic_exchange_n(&allow.cur, l, __ATOMIC_SEQ_CST);
+    for (i = 0; old && i < 2; i++) {
+        e = __atomic_add_fetch(&allow.epoch, 1, __ATOMIC_SEQ_CST);
+        while (__atomic_load_n(&allow.readers[~e & 1], __ATOMIC_SEQ_CST))
+            sched_yield();
+    }
+    pthread_mutex_unlock(&allow.lock);
+
+    allowlist_free(old);
+}
+
+/* 1 if the address is in the allowlist, 0 if not, -1 if there is none */
+static int allowlist_lookup(const uint8_t *address) {
+    allowlist_t *l;
+    unsigned int e;
+    int r = -1;
+
+    e = __atomic_load_n(&allow.epoch, __ATOMIC_SEQ_CST) & 1;
+    __atomic_add_fetch(&allow.readers[e], 1, __ATOMIC_SEQ_CST);
+    l = __atomic_load_n(&allow.cur, __ATOMIC_SEQ_CST);
+    if (l)
+        r = allowlist_find(l, scan_key(address));
+    __atomic_sub_fetch(&allow.readers[e], 1, __ATOMIC_RELEASE);
+
+    return r;
+}
+
+int ble_scan_set_allowlist(const uint8_t *addresses, int count,
+                           int bloom_bits) {
+    allowlist_t *l = NULL;
+    int i;
+
+    if (count < 0 || (count && !addresses) || bloom_bits < 0 ||
+        bloom_bits > ALLOW_BLOOM_MAX_BITS)
+        return -1;
+
+    if (count) {
+        l = allowlist_new(count, bloom_bits);
+        if (!l)
+            return -1;
+
+        for (i = 0; i < count; i++)
+            allowlist_add(l, scan_key(addresses + 6 * i));
+    }
+
+    allowlist_install(l);
+
+    return 0;
+}
+
+int ble_scan_load_allowlist(const char *path, int bloom_bits) {
+    allowlist_t *l;
+    uint64_t *keys = NULL, *tmp;
+    unsigned int a[6];
+    char line[64], c;
+    const char *p;
+    size_t count = 0, size = 0;
+    FILE *f;
+    int i, n;
+
+    if (!path || bloom_bits < 0 || bloom_bits > ALLOW_BLOOM_MAX_BITS)
+        return -1;
+
+    f = fopen(path, "r");
+    if (!f)
+        return -1;
+
+    while (fgets(line, sizeof(line), f)) {
+        p = line + strspn(line, " \t\r\n");
+        if (!*p || *p == '#')
+            continue;
+
+        n = sscanf(p, "%2x:%2x:%2x:%2x:%2x:%2x %c", &a[0], &a[1], &a[2],
+                   &a[3], &a[4], &a[5], &c);
+        if (n != 6 || count >= INT32_MAX)
+            goto fail;
+
+        if (count == size) {
+            size = size ? 2 * size : 1024;
+            tmp = realloc(keys, size * sizeof(*keys));
+            if (!tmp)
+                goto fail;
+            keys = tmp;
+        }
+
+        keys[count] = 0;
+        for (i = 0; i < 6; i++)
+            keys[count] = keys[count] << 8 | a[i];
+        count++;
+    }
+
+    if (ferror(f))
+        goto fail;
+
+    l = allowlist_new(count, bloom_bits);
+    if (!l)
+        goto fail;
+
+    while (count)
+        allowlist_add(l, keys[--count]);
+
+    fclose(f);
+    free(keys);
+
+    n = l->count;
+    allowlist_install(l);
+
+    return n;
+
+fail:
+    fclose(f);
+    free(keys);
+
+    return -1;
+}
+
+int ble_scan_allowlist_contains(const uint8_t *address) {
+    if (!address)
+        return -1;
+
+    return allowlist_lookup(address);
+}
+
+/* Index of the key a resolvable private address resolves with, or -1. Each
+ * address is looked up in its set of the cache first, the set being chosen by
+ * the hash part of the address, which is random. Must hold rpa.lock. */
+static int rpa_lookup(const uint8_t *address, uint64_t now) {
+    rpa_entry_t *set, *victim;
+    uint64_t key = scan_key(address);
+    uint8_t prand[16];
+    uint32_t hash;
+    int i, irk;
+
+    set = rpa.cache + (key & (RPA_CACHE_SETS - 1)) * RPA_CACHE_WAYS;
+    victim = set;
+    for (i = 0; i < RPA_CACHE_WAYS; i++) {
+        if (set[i].key == key && set[i].expires > now) {
+            rpa.stats.cache_hits++;
+            return set[i].irk;
+        }
+
+        /* Free and expired entries expire first, then the oldest ones */
+        if (set[i].expires < victim->expires)
+            victim = &set[i];
+    }
+
+    /* The address is prand followed by hash, with hash = ah(IRK, prand), the
+     * last 24 bits of AES-128 of prand padded with zeros */
+    memset(prand, 0, sizeof(prand) - 3);
+    memcpy(prand + sizeof(prand) - 3, address, 3);
+    hash = address[3] << 16 | address[4] << 8 | address[5];
+    irk = aes128_find_key(rpa.keys, rpa.count, prand, hash, 0xffffff);
+
+    if (irk < 0)
+        rpa.stats.unresolved++;
+    else
+        rpa.stats.resolved++;
+
+    victim->key = key;
+    victim->irk = irk;
+    victim->expires = now + (uint64_t) rpa.period * 1000000;
+
+    return irk;
+}
+
+/* 1 and the identity address if the address is a resolvable private address
+ * resolved by one of the keys, 0 if not */
+static int rpa_resolve(const uint8_t *address, uint8_t *identity,
+                       uint64_t now) {
+    int irk = -1;
+
+    /* The two most significant bits of resolvable private addresses are 01 */
+    if ((address[0] & 0xc0) != 0x40)
+        return 0;
+
+    pthread_mutex_lock(&rpa.lock);
+    if (rpa.count)
+        irk = rpa_lookup(address, now);
+    if (irk >= 0) {
+        memcpy(identity, rpa.identity[irk], 6);
+        memcpy(rpa.current[irk], address, 6);
+    }
+    pthread_mutex_unlock(&rpa.lock);
+
+    return irk >= 0;
+}
+
+int ble_rpa_set_keys(const ble_irk_t *keys, int count, int period) {
+    aes128_key_t *k = NULL, *old_k;
+    uint8_t (*identity)[6] = NULL, (*old_identity)[6];
+    uint8_t (*current)[6] = NULL, (*old_current)[6];
+    rpa_entry_t *cache = NULL, *old_cache;
+    int i;
+
+    if (count < 0 || count > BLE_RPA_MAX_KEYS || (count && !keys) ||
+        period < 0)
+        return -1;
+
+    if (count) {
+        k = malloc(count * sizeof(*k));
+        identity = malloc(count * sizeof(*identity));
+        current = calloc(count, sizeof(*current));
+        cache = calloc(RPA_CACHE_SETS * RPA_CACHE_WAYS, sizeof(*cache));
+        if (!k || !identity || !current || !cache) {
+            free(k);
+            free(identity);
+            free(current);
+            free(cache);
+            return -1;
+        }
+
+        for (i = 0; i < count; i++) {
+            aes128_expand_key(keys[i].irk, &k[i]);
+            memcpy(identity[i], keys[i].identity, 6);
+        }
+    }
+
+    pthread_mutex_lock(&rpa.lock);
+    old_k = rpa.keys;
+    old_identity = rpa.identity;
+    old_current = rpa.current;
+    old_cache = rpa.cache;
+    rpa.keys = k;
+    rpa.identity = identity;
+    rpa.current = current;
+    rpa.cache = cache;
+    rpa.period = period ? period : BLE_RPA_DEFAULT_PERIOD;
+    rpa.count = count;
+    pthread_mutex_unlock(&rpa.lock);
+
+    free(old_k);
+    free(old_identity);
+    free(old_current);
+    free(old_cache);
+
+    return 0;
+}
+
+int ble_rpa_resolve(const uint8_t *address, uint8_t *identity) {
+    if (!address || !identity)
+        return -1;
+
+    return rpa_resolve(address, identity, now_us());
+}
+
+int ble_rpa_get_address(const uint8_t *identity, uint8_t *address) {
+    static const uint8_t none[6];
+    int i, r = -1;
+
+    if (!identity || !address)
+        return -1;
+
+    pthread_mutex_lock(&rpa.lock);
+    for (i = 0; i < rpa.count; i++)
+        if (!memcmp(rpa.identity[i], identity, 6) &&
+            memcmp(rpa.current[i], none, 6)) {
+            memcpy(address, rpa.current[i], 6);
+            r = 0;
+            break;
+        }
+    pthread_mutex_unlock(&rpa.lock);
+
+    return r;
+}
+
+int ble_rpa_get_stats(ble_rpa_stats_t *stats, int reset) {
+    if (!stats)
+        return -1;
+
+    pthread_mutex_lock(&rpa.lock);
+    *stats = rpa.stats;
+    if (reset)
+        memset(&rpa.stats, 0, sizeof(rpa.stats));
+    pthread_mutex_unlock(&rpa.lock);
+
+    return 0;
+}
+
+/* FNV-1a over the advertising data */
+static uint32_t scan_adv_hash(const uint8_t *adv_data) {
+    uint32_t h = 2166136261U;
+    int i;
+
+    for (i = 0; i < ADV_DATA_LEN; i++)
+        h = (h ^ adv_data[i]) * 16777619U;
+
+    return h;
+}
+
+/* Position in the index of a device, or of the empty slot ending its probe
+ * sequence. Must hold scan.lock. */
+static int scan_index_find(uint64_t key) {
+    int mask = (1 << scan.index_bits) - 1, i;
+
+    for (i = scan_index_slot(key, scan.index_bits);
+         scan.index[i] != SCAN_INDEX_EMPTY; i = (i + 1) & mask)
+        if (scan.slots[scan.index[i] - 1].key == key)
+            break;
+
+    return i;
+}
+
+/* Remove a device from the index, moving back the entries of the probe
+ * sequence after it so no tombstone is needed. Must hold scan.lock. */
+static void scan_index_remove(uint64_t key) {
+    int mask = (1 << scan.index_bits) - 1, i, j, home;
+
+    i = scan_index_find(key);
+    if (scan.index[i] == SCAN_INDEX_EMPTY)
+        return;
+
+    for (j = (i + 1) & mask; scan.index[j] != SCAN_INDEX_EMPTY;
+         j = (j + 1) & mask) {
+        home = scan_index_slot(scan.slots[scan.index[j] - 1].key,
+                               scan.index_bits);
+
+        /* Entries between their home and the hole stay */
+        if ((j > i && (home <= i || home > j)) ||
+            (j < i && home <= i && home > j)) {
+            scan.index[i] = scan.index[j];
+            i = j;
+        }
+    }
+
+    scan.index[i] = SCAN_INDEX_EMPTY;
+}
+
+/* Bits of the index of a table of size devices */
+static int scan_index_bits(int size) {
+    int bits = 1;
+
+    while (1 << bits < 2 * size)
+        bits++;
+
+    return bits;
+}
+
+/* Allocate the table with the current settings, on the first report. Must
+ * hold scan.lock. */
+static int scan_table_init(void) {
+    scan.index_bits = scan_index_bits(scan.size);
+    scan.slots = calloc(scan.size, sizeof(*scan.slots));
+    scan.index = calloc(1 << scan.index_bits, sizeof(*scan.index));
+    if (!scan.slots || !scan.index) {
+        free(scan.slots);
+        free(scan.index);
+        scan.slots = NULL;
+        scan.index = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Position in the presence index of a device, or of the empty slot ending
+ * its probe sequence. Must hold scan.lock, with the index allocated. */
+static int presence_find(uint64_t key) {
+    int mask = (1 << scan.present_bits) - 1, i;
+
+    for (i = scan_index_slot(key, scan.present_bits); scan.present_index[i];
+         i = (i + 1) & mask)
+        if (scan.present_devs[scan.present_index[i] - 1].key == key)
+            break;
+
+    return i;
+}
+
+/* Remove a device from the presence index, as scan_index_remove() does.
+ * Must hold scan.lock. */
+static void presence_index_remove(uint64_t key) {
+    int mask = (1 << scan.present_bits) - 1, i, j, home;
+
+    i = presence_find(key);
+    if (!scan.present_index[i])
+        return;
+
+    for (j = (i + 1) & mask; scan.present_index[j]; j = (j + 1) & mask) {
+        home = scan_index_slot(scan.present_devs[scan.present_index[j] - 1].key,
+                               scan.present_bits);
+
+        if ((j > i && (home <= i || home > j)) ||
+            (j < i && home <= i && home > j)) {
+            scan.present_index[i] = scan.present_index[j];
+            i = j;
+        }
+    }
+
+    scan.present_index[i] = 0;
+}
+
+/* Double the presence table, and rebuild its index. Must hold scan.lock. */
+static int presence_grow(void) {
+    presence_dev_t *devs;
+    int *index;
+    int bits, n;
+
+    bits = scan.present_bits ? scan.present_bits + 1 : PRESENCE_MIN_BITS;
+    if (1 << (bits - 1) > BLE_SCAN_MAX_PRESENT)
+        return -1;
+
+    devs = realloc(scan.present_devs, (1 << (bits - 1)) * sizeof(*devs));
+    if (!devs)
+        return -1;
+    scan.present_devs = devs;
+
+    index = calloc(1 << bits, sizeof(*index));
+    if (!index)
+        return -1;
+    free(scan.present_index);
+    scan.present_index = index;
+    scan.present_bits = bits;
+
+    for (n = 0; n < scan.present_used; n++)
+        if (devs[n].used)
+            index[presence_find(devs[n].key)] = n + 1;
+
+    return 0;
+}
+
+static void presence_link(int n) {
+    presence_dev_t *p = &scan.present_devs[n];
+    uint64_t tick;
+
+    /* The first tick after the device may leave */
+    tick = (p->seen / 1000 + scan.presence_timeout) / scan.tick + 1;
+    p->wheel_bucket = tick % PRESENCE_WHEEL_SIZE;
+    p->wheel_prev = 0;
+    p->wheel_next = scan.wheel[p->wheel_bucket];
+    if (p->wheel_next)
+        scan.present_devs[p->wheel_next - 1].wheel_prev = n + 1;
+    scan.wheel[p->wheel_bucket] = n + 1;
+}
+
+/* Add a device entering, returns its slot or -1 if the table is full. Must
+ * hold scan.lock. */
+static int presence_add(uint64_t key, uint64_t now,
+                        const ble_scan_entry_t *e) {
+    presence_dev_t *p;
+    int n;
+
+    if (scan.present_free) {
+        n = scan.present_free - 1;
+        scan.present_free = scan.present_devs[n].wheel_next;
+    } else {
+        if (!scan.present_bits ||
+            scan.present_used == 1 << (scan.present_bits - 1))
+            if (presence_grow() != 0)
+                return -1;
+        n = scan.present_used++;
+    }
+
+    scan.present_index[presence_find(key)] = n + 1;
+
+    p = &scan.present_devs[n];
+    p->key = key;
+    p->seen = now;
+    p->used = 1;
+    p->e = *e;
+    presence_link(n);
+
+    return n;
+}
+
+/* Free the slot of a device left, already unlinked from the wheel. Must hold
+ * scan.lock. */
+static void presence_remove(int n) {
+    presence_dev_t *p = &scan.present_devs[n];
+
+    presence_index_remove(p->key);
+    p->used = 0;
+    p->wheel_next = scan.present_free;
+    scan.present_free = n + 1;
+}
+
+/* Account a report of a device for its presence, setting ev if it enters.
+ * Present devices stay as long as they are heard above the exit threshold,
+ * others enter above the enter threshold. Must hold scan.lock. */
+static void presence_update(const scan_slot_t *s, int rssi, uint64_t now,
+                            presence_event_t *ev) {
+    presence_dev_t *p;
+    int i;
+
+    if (scan.present_bits) {
+        i = presence_find(s->key);
+        if (scan.present_index[i]) {
+            p = &scan.present_devs[scan.present_index[i] - 1];
+            p->e = s->e;
+            if (rssi >= scan.exit_rssi)
+                p->seen = now;
+            return;
+        }
+    }
+
+    if (rssi < scan.enter_rssi || presence_add(s->key, now, &s->e) < 0)
+        return;
+
+    if (!scan.present++) {
+        scan.wheel_tick = now / 1000 / scan.tick;
+        timer_arm(&scan.presence_timer,
+                  (now / 1000 + scan.presence_timeout) /
+                  scan.tick * scan.tick + scan.tick);
+    }
+
+    ev->cb = scan.presence_cb;
+    ev->entry = s->e;
+}
+
+/* Time of the last report of the devices left out */
+static uint64_t scan_top_stale(uint64_t now) {
+    uint64_t age = (uint64_t) scan.top_age * 1000;
+
+    return now > age ? now - age : 0;
+}
+
+static void scan_top_remove(int i) {
+    scan.slots[scan.top[i].slot].top = 0;
+    memmove(&scan.top[i], &scan.top[i + 1],
+            (--scan.top_count - i) * sizeof(scan.top[0]));
+}
+
+/* Update the strongest devices with a report. The list is only kept sorted
+ * as reports come, so a device weakening only loses its place when stronger
+ * ones report. */
+static void scan_top_update(int n, int rssi, uint64_t now) {
+    scan_slot_t *s = &scan.slots[n];
+    uint64_t stale = scan_top_stale(now);
+    scan_top_t t;
+    int i;
+
+    if (s->top) {
+        for (i = 0; scan.top[i].slot != n; i++);
+        t = scan.top[i];
+        t.rssi += (rssi * 16 - t.rssi) >> TOP_RSSI_SHIFT;
+        t.last = now;
+        scan_top_remove(i);
+    } else {
+        t.slot = n;
+        t.rssi = rssi * 16;
+        t.last = now;
+
+        if (scan.top_count == scan.top_k) {
+            /* Take the place of a stale device, or else of the weakest */
+            for (i = scan.top_count - 1; i >= 0; i--)
+                if (scan.top[i].last < stale)
+                    break;
+            if (i < 0) {
+                i = scan.top_count - 1;
+                if (scan.top[i].rssi >= t.rssi)
+                    return;
+            }
+            scan_top_remove(i);
+        }
+    }
+
+    for (i = scan.top_count; i > 0 && scan.top[i - 1].rssi < t.rssi; i--)
+        scan.top[i] = scan.top[i - 1];
+    scan.top[i] = t;
+    scan.top_count++;
+    s->top = 1;
+}
+
+/* Choose a slot for a new device. Must hold scan.lock. */
+static int scan_slot_alloc(void) {
+    scan_slot_t *s;
+    int i, n;
+
+    if (scan.used < scan.size)
+        return scan.used++;
+
+    for (;;) {
+        n = scan.hand;
+        s = &scan.slots[n];
+        scan.hand = (scan.hand + 1) % scan.size;
+        if (!s->ref)
+            break;
+        s->ref = 0;
+    }
+
+    scan_index_remove(s->key);
+    s->used = 0;
+
+    if (s->top) {
+        for (i = 0; scan.top[i].slot != n; i++);
+        scan_top_remove(i);
+    }
+
+    return n;
+}
+
+/* Aggregate a report in the table, returns whether it should be delivered
+ * through scan_cb. A device entering is set in ev. */
+static int scan_table_update(const uint8_t *address, int rssi,
+                             const uint8_t *adv_data, uint64_t now,
+                             presence_event_t *ev) {
+    uint64_t key = scan_key(address);
+    uint32_t hash = scan_adv_hash(adv_data);
+    scan_slot_t *s;
+    int i, n, deliver;
+
+    pthread_mutex_lock(&scan.lock);
+
+    if (!scan.slots && scan_table_init() != 0) {
+        pthread_mutex_unlock(&scan.lock);
+        return scan.policy != BLE_SCAN_DIGEST;
+    }
+
+    i = scan_index_find(key);
+    if (scan.index[i] == SCAN_INDEX_EMPTY) {
+        n = scan_slot_alloc();
+        /* The removal may have moved the entries of the probe sequence */
+        i = scan_index_find(key);
+        scan.index[i] = n + 1;
+
+        s = &scan.slots[n];
+        memset(s, 0, sizeof(*s));
+        s->key = key;
+        s->used = 1;
+        memcpy(s->e.address, address, sizeof(s->e.address));
+        s->e.rssi_min = rssi;
+        s->e.rssi_max = rssi;
+        s->e.first = now;
+        s->e.adv_hash = hash;
+        deliver = scan.policy != BLE_SCAN_DIGEST;
+    } else {
+        s = &scan.slots[scan.index[i] - 1];
+        deliver = scan.policy == BLE_SCAN_ALL ||
+                  (scan.policy == BLE_SCAN_CHANGED && s->e.adv_hash != hash);
+        s->e.adv_hash = hash;
+    }
+
+    s->ref = 1;
+    s->dirty = 1;
+    s->rssi_sum += rssi;
+    s->e.count++;
+    s->e.last = now;
+    s->e.rssi_last = rssi;
+    s->e.rssi_mean = s->rssi_sum / (int64_t) s->e.count;
+    if (rssi < s->e.rssi_min)
+        s->e.rssi_min = rssi;
+    if (rssi > s->e.rssi_max)
+        s->e.rssi_max = rssi;
+
+    if (scan.hist_depth) {
+        n = (s - scan.slots) * scan.hist_depth + s->hist_pos;
+        scan.hist_time[n] = now;
+        scan.hist_rssi[n] = rssi;
+        if (++s->hist_pos == scan.hist_depth)
+            s->hist_pos = 0;
+        if (s->hist_len < scan.hist_depth)
+            s->hist_len++;
+    }
+
+    if (scan.presence_cb)
+        presence_update(s, rssi, now, ev);
+
+    if (scan.top_k)
+        scan_top_update(s - scan.slots, rssi, now);
+
+    pthread_mutex_unlock(&scan.lock);
+
+    return deliver;
+}
+
+/* Called on the timer thread to deliver the digest of the devices seen */
+static void scan_digest_timer_cb(void *arg) {
+    ble_scan_entry_t *digest;
+    ble_scan_digest_cb_t cb;
+    int i, count = 0;
+
+    pthread_mutex_lock(&scan.lock);
+
+    cb = scan.digest_cb;
+    if (scan.policy != BLE_SCAN_DIGEST || !cb) {
+        pthread_mutex_unlock(&scan.lock);
+        return;
+    }
+
+    /* Without memory, the devices are reported in the next digest */
+    digest = malloc(scan.used * sizeof(*digest));
+    for (i = 0; digest && i < scan.used; i++)
+        if (scan.slots[i].used && scan.slots[i].dirty) {
+            scan.slots[i].dirty = 0;
+            digest[count++] = scan.slots[i].e;
+        }
+
+    timer_arm(&scan.timer, now_ms() + scan.interval);
+
+    pthread_mutex_unlock(&scan.lock);
+
+    if (count)
+        cb(digest, count);
+
+    free(digest);
+}
+
+int ble_scan_set_policy(ble_scan_policy_t policy, int interval,
+                        ble_scan_digest_cb_t cb) {
+    if (policy < BLE_SCAN_ALL || policy > BLE_SCAN_DIGEST)
+        return -1;
+
+    if (policy == BLE_SCAN_DIGEST && (interval <= 0 || !cb))
+        return -1;
+
+    pthread_mutex_lock(&scan.lock);
+
+    scan.policy = policy;
+    scan.interval = interval;
+    scan.digest_cb = cb;
+
+    if (policy == BLE_SCAN_DIGEST) {
+        scan.timer.cb = scan_digest_timer_cb;
+        timer_arm(&scan.timer, now_ms() + interval);
+    } else
+        timer_disarm(&scan.timer);
+
+    pthread_mutex_unlock(&scan.lock);
+
+    return 0;
+}
+
+int ble_scan_get_entry(const uint8_t *address, ble_scan_entry_t *entry) {
+    int i, r = -1;
+
+    if (!address || !entry)
+        return -1;
+
+    pthread_mutex_lock(&scan.lock);
+
+    if (scan.slots) {
+        i = scan_index_find(scan_key(address));
+        if (scan.index[i] != SCAN_INDEX_EMPTY) {
+            *entry = scan.slots[scan.index[i] - 1].e;
+            r = 0;
+        }
+    }
+
+    pthread_mutex_unlock(&scan.lock);
+
+    return r;
+}
+
+static void presence_reset(void) {
+    free(scan.present_devs);
+    free(scan.present_index);
+    scan.present_devs = NULL;
+    scan.present_index = NULL;
+    scan.present_bits = 0;
+    scan.present_used = 0;
+    scan.present_free = 0;
+    memset(scan.wheel, 0, sizeof(scan.wheel));
+    scan.present = 0;
+    timer_disarm(&scan.presence_timer);
+}
+
+void ble_scan_clear(void) {
+    pthread_mutex_lock(&scan.lock);
+    if (scan.index)
+        memset(scan.index, 0, (1 << scan.index_bits) * sizeof(*scan.index));
+    scan.used = 0;
+    scan.hand = 0;
+    presence_reset();
+    scan.top_count = 0;
+    pthread_mutex_unlock(&scan.lock);
+}
+
+int ble_scan_set_top(int k, int max_age) {
+    if (k < 0 || k > BLE_SCAN_MAX_TOP || (k && max_age <= 0))
+        return -1;
+
+    pthread_mutex_lock(&scan.lock);
+
+    while (scan.top_count)
+        scan_top_remove(scan.top_count - 1);
+    scan.top_k = k;
+    scan.top_age = max_age;
+
+    pthread_mutex_unlock(&scan.lock);
+
+    return 0;
+}
+
+int ble_scan_get_top(ble_scan_entry_t *entries, int8_t *rssi, int count) {
+    uint64_t now = now_us(), stale;
+    const scan_top_t *t;
+    int i, n = 0;
+
+    if (count < 0 || (count && !entries))
+        return -1;
+
+    pthread_mutex_lock(&scan.lock);
+
+    if (!scan.top_k) {
+        pthread_mutex_unlock(&scan.lock);
+        return -1;
+    }
+
+    stale = scan_top_stale(now);
+    for (i = 0; i < scan.top_count && n < count; i++) {
+        t = &scan.top[i];
+        if (t->last < stale)
+            continue;
+        entries[n] = scan.slots[t->slot].e;
+        if (rssi)
+            rssi[n] = t->rssi / 16;
+        n++;
+    }
+
+    pthread_mutex_unlock(&scan.lock);
+
+    return n;
+}
+
+int ble_scan_set_history(int depth, int devices) {
+    scan_slot_t *slots, *old_slots;
+    uint32_t *index, *old_index;
+    uint64_t *time = NULL, *old_time;
+    int8_t *rssi = NULL, *old_rssi;
+
+    if (depth < 0 || depth > BLE_SCAN_MAX_HISTORY || devices < 0 ||
+        devices > BLE_SCAN_MAX_DEVICES)
+        return -1;
+
+    if (!devices)
+        devices = SCAN_TABLE_SIZE;
+
+    slots = calloc(devices, sizeof(*slots));
+    index = calloc(1 << scan_index_bits(devices), sizeof(*index));
+    if (depth) {
+        time = malloc((size_t) devices * depth * sizeof(*time));
+        rssi = malloc((size_t) devices * depth * sizeof(*rssi));
+    }
+    if (!slots || !index || (depth && (!time || !rssi))) {
+        free(slots);
+        free(index);
+        free(time);
+        free(rssi);
+        return -1;
+    }
+
+    pthread_mutex_lock(&scan.lock);
+
+    old_slots = scan.slots;
+    old_index = scan.index;
+    old_time = scan.hist_time;
+    old_rssi = scan.hist_rssi;
+    scan.slots = slots;
+    scan.index = index;
+    scan.size = devices;
+    scan.index_bits = scan_index_bits(devices);
+    scan.used = 0;
+    scan.hand = 0;
+    scan.top_count = 0;
+    scan.hist_time = time;
+    scan.hist_rssi = rssi;
+    scan.hist_depth = depth;
+
+    pthread_mutex_unlock(&scan.lock);
+
+    free(old_slots);
+    free(old_index);
+    free(old_time);
+    free(old_rssi);
+
+    return 0;
+}
+
+/* Free the table, back to the default settings */
+static void scan_table_free(void) {
+    pthread_mutex_lock(&scan.lock);
+
+    free(scan.slots);
+    free(scan.index);
+    free(scan.hist_time);
+    free(scan.hist_rssi);
+    scan.slots = NULL;
+    scan.index = NULL;
+    scan.hist_time = NULL;
+    scan.hist_rssi = NULL;
+    scan.size = SCAN_TABLE_SIZE;
+    scan.used = 0;
+    scan.hand = 0;
+    scan.top_count = 0;
+    scan.hist_depth = 0;
+
+    pthread_mutex_unlock(&scan.lock);
+}
+
+/* Slot of a device with a history, NULL if none. Must hold scan.lock. */
+static scan_slot_t *scan_hist_slot(const uint8_t *address) {
+    int i;
+
+    if (!scan.hist_depth)
+        return NULL;
+
+    i = scan_index_find(scan_key(address));
+    if (scan.index[i] == SCAN_INDEX_EMPTY)
+        return NULL;
+
+    return &scan.slots[scan.index[i] - 1];
+}
+
+/* Position in the history arrays of the k-th sample of a slot, from the
+ * newest. Must hold scan.lock. */
+static int scan_hist_sample(const scan_slot_t *s, int k) {
+    int i = s->hist_pos - 1 - k;
+
+    if (i < 0)
+        i += scan.hist_depth;
+
+    return (s - scan.slots) * scan.hist_depth + i;
+}
+
+int ble_scan_get_history(const uint8_t *address, int count, uint64_t *times,
+                         int8_t *rssi) {
+    const scan_slot_t *s;
+    int i, n;
+
+    if (!address || count < 0)
+        return -1;
+
+    pthread_mutex_lock(&scan.lock);
+
+    s = scan_hist_slot(address);
+    if (!s) {
+        pthread_mutex_unlock(&scan.lock);
+        return -1;
+    }
+
+    if (count > s->hist_len)
+        count = s->hist_len;
+
+    /* Oldest sample first */
+    for (i = 0; i < count; i++) {
+        n = scan_hist_sample(s, count - 1 - i);
+        if (times)
+            times[i] = scan.hist_time[n];
+        if (rssi)
+            rssi[i] = scan.hist_rssi[n];
+    }
+
+    pthread_mutex_unlock(&scan.lock);
+
+    return count;
+}
+
+int ble_scan_get_rssi_stats(const uint8_t *address, int window,
+                            ble_scan_rssi_stats_t *stats) {
+    const scan_slot_t *s;
+    uint32_t hist[256];
+    uint64_t now = now_us(), since = 0, first = 0, last = 0;
+    int64_t sum = 0;
+    uint32_t seen;
+    int i, n, v;
+
+    if (!address || window < 0 || !stats)
+        return -1;
+
+    if (window && now > (uint64_t) window * 1000)
+        since = now - (uint64_t) window * 1000;
+
+    memset(stats, 0, sizeof(*stats));
+    memset(hist, 0, sizeof(hist));
+
+    pthread_mutex_lock(&scan.lock);
+
+    s = scan_hist_slot(address);
+    if (!s) {
+        pthread_mutex_unlock(&scan.lock);
+        return -1;
+    }
+
+    /* From the newest sample back to the first one out of the window */
+    for (i = 0; i < s->hist_len; i++) {
+        n = scan_hist_sample(s, i);
+        if (scan.hist_time[n] < since)
+            break;
+
+        v = scan.hist_rssi[n];
+        if (!i) {
+            last = scan.hist_time[n];
+            stats->min = v;
+            stats->max = v;
+        }
+        first = scan.hist_time[n];
+        if (v < stats->min)
+            stats->min = v;
+        if (v > stats->max)
+            stats->max = v;
+        sum += v;
+        hist[v + 128]++;
+    }
+
+    pthread_mutex_unlock(&scan.lock);
+
+    stats->count = i;
+    if (!i)
+        return 0;
+
+    stats->mean = sum / i;
+
+    /* The lower median, counted up from the lowest RSSI */
+    for (v = stats->min, seen = 0;; v++) {
+        seen += hist[v + 128];
+        if (2 * seen >= stats->count)
+            break;
+    }
+    stats->median = v;
+
+    if (last > first)
+        stats->rate = (stats->count - 1) * 1000000000ULL / (last - first);
+
+    return 0;
+}
+
+/* Called on the timer thread when a bucket of the presence wheel is due: the
+ * devices not seen for the timeout leave, the others are moved to the bucket
+ * of their new deadline */
+static void presence_timer_cb(void *arg) {
+    ble_scan_entry_t *left = NULL, *tmp;
+    ble_presence_cb_t cb;
+    presence_dev_t *p;
+    uint64_t now = now_us(), tick;
+    int i, b, n, next, expired, count = 0, size = 0;
+
+    pthread_mutex_lock(&scan.presence_lock);
+    pthread_mutex_lock(&scan.lock);
+
+    cb = scan.presence_cb;
+    tick = now / 1000 / scan.tick;
+
+    /* After a whole turn of the wheel, all the buckets are due once */
+    if (tick >= scan.wheel_tick + PRESENCE_WHEEL_SIZE)
+        scan.wheel_tick = tick - PRESENCE_WHEEL_SIZE + 1;
+
+    for (; cb && scan.wheel_tick <= tick; scan.wheel_tick++) {
+        b = scan.wheel_tick % PRESENCE_WHEEL_SIZE;
+        n = scan.wheel[b];
+        scan.wheel[b] = 0;
+
+        for (; n; n = next) {
+            p = &scan.present_devs[n - 1];
+            next = p->wheel_next;
+            expired = p->seen + scan.presence_timeout * 1000ULL <= now;
+
+            /* Without memory to report it, the device leaves next time */
+            if (expired && count == size) {
+                tmp = realloc(left, (size ? 2 * size : 64) * sizeof(*left));
+                if (tmp) {
+                    left = tmp;
+                    size = size ? 2 * size : 64;
+                } else
+                    expired = 0;
+            }
+
+            if (expired) {
+                left[count++] = p->e;
+                presence_remove(n - 1);
+                scan.present--;
+            } else
+                presence_link(n - 1);
+        }
+    }
+
+    /* Sleep until the next bucket holding devices */
+    for (i = 0; scan.present && i < PRESENCE_WHEEL_SIZE; i++)
+        if (scan.wheel[(tick + 1 + i) % PRESENCE_WHEEL_SIZE]) {
+            timer_arm(&scan.presence_timer, (tick + 1 + i) * scan.tick);
+            break;
+        }
+
+    pthread_mutex_unlock(&scan.lock);
+
+    for (i = 0; i < count; i++)
+        cb(&left[i], 0);
+
+    pthread_mutex_unlock(&scan.presence_lock);
+
+    free(left);
+}
+
+int ble_scan_set_presence(int enter_rssi, int exit_rssi, int timeout,
+                          ble_presence_cb_t cb) {
+    if (cb && (enter_rssi < exit_rssi || timeout <= 0))
+        return -1;
+
+    pthread_mutex_lock(&scan.lock);
+
+    scan.presence_cb = cb;
+    scan.enter_rssi = enter_rssi;
+    scan.exit_rssi = exit_rssi;
+    scan.presence_timeout = timeout;
+    scan.tick = timeout / (PRESENCE_WHEEL_SIZE / 2);
+    if (scan.tick < 1)
+        scan.tick = 1;
+    scan.presence_timer.cb = presence_timer_cb;
+    presence_reset();
+
+    pthread_mutex_unlock(&scan.lock);
+
+    return 0;
+}
+
+/* Bytes of the advertising data and scan response used by AD structures */
+static int adv_data_len(const uint8_t *adv_data) {
+    ble_ad_iter_t it;
+    const uint8_t *value;
+    uint8_t type;
+    int len, end = 0;
+
+    ble_ad_iter_init(&it, adv_data, ADV_DATA_LEN);
+    while (ble_ad_next(&it, &type, &value, &len))
+        end = it.pos;
+
+    return end;
+}
+
+/* Whether the caller is the batch callback, with batch.lock held */
+static int scan_batch_in_cb(void) {
+    return batch.delivering && pthread_equal(batch.deliverer, pthread_self());
+}
+
+/* Deliver the reports collected, if any. The ones collected by the callback
+ * itself are delivered once it returns, as the buffer it was passed is not
+ * free yet. */
+static void scan_batch_flush(void) {
+    ble_scan_report_t *reports;
+    ble_scan_batch_cb_t cb;
+    int count;
+
+    pthread_mutex_lock(&batch.lock);
+
+    if (scan_batch_in_cb()) {
+        pthread_mutex_unlock(&batch.lock);
+        return;
+    }
+
+    while (batch.delivering)
+        pthread_cond_wait(&batch.idle, &batch.lock);
+
+    do {
+        reports = batch.buf[batch.cur];
+        count = batch.count;
+        cb = batch.cb;
+        batch.cur ^= 1;
+        batch.count = 0;
+        timer_disarm(&batch.timer);
+
+        if (!count || !cb)
+            break;
+
+        batch.delivering = reports;
+        batch.deliverer = pthread_self();
+        pthread_mutex_unlock(&batch.lock);
+
+        cb(reports, count);
+
+        pthread_mutex_lock(&batch.lock);
+        batch.delivering = NULL;
+
+        /* Replaced by the callback */
+        if (reports != batch.buf[0] && reports != batch.buf[1])
+            free(reports);
+    } while (batch.size && batch.count == batch.size);
+
+    pthread_cond_broadcast(&batch.idle);
+    pthread_mutex_unlock(&batch.lock);
+}
+
+static void scan_batch_timer_cb(void *arg) {
+    scan_batch_flush();
+}
+
+/* Collect a report for batched delivery, returns 0 if batches are off */
+static int scan_batch_add(const uint8_t *address, int rssi,
+                          const uint8_t *adv_data, uint64_t now) {
+    ble_scan_report_t *r;
+    int full;
+
+    for (;;) {
+        pthread_mutex_lock(&batch.lock);
+
+        if (!batch.size) {
+            pthread_mutex_unlock(&batch.lock);
+            return 0;
+        }
+
+        if (batch.count < batch.size)
+            break;
+
+        /* Filled by the callback, which has to return before the buffer can
+         * be delivered, so the report is dropped */
+        if (scan_batch_in_cb()) {
+            pthread_mutex_unlock(&batch.lock);
+            return 1;
+        }
+
+        /* Full, and about to be delivered by another thread */
+        pthread_mutex_unlock(&batch.lock);
+        scan_batch_flush();
+    }
+
+    if (!batch.count)
+        timer_arm(&batch.timer, now / 1000 + batch.interval);
+
+    r = &batch.buf[batch.cur][batch.count++];
+    memcpy(r->address, address, sizeof(r->address));
+    r->rssi = rssi;
+    r->adv_len = adv_data_len(adv_data);
+    memcpy(r->adv_data, adv_data, ADV_DATA_LEN);
+    r->timestamp = now;
+    full = batch.count == batch.size;
+
+    pthread_mutex_unlock(&batch.lock);
+
+    if (full)
+        scan_batch_flush();
+
+    return 1;
+}
+
+int ble_scan_set_batch(int size, int interval, ble_scan_batch_cb_t cb) {
+    ble_scan_report_t *buf[2] = { NULL, NULL }, *old[2], *busy = NULL;
+    ble_scan_batch_cb_t old_cb;
+    int count, i;
+
+    if (size < 0 || (size && (interval <= 0 || !cb)))
+        return -1;
+
+    if (size) {
+        buf[0] = malloc(size * sizeof(ble_scan_report_t));
+        buf[1] = malloc(size * sizeof(ble_scan_report_t));
+        if (!buf[0] || !buf[1]) {
+            free(buf[0]);
+            free(buf[1]);
+            return -1;
+        }
+    }
+
+    /* Reports collected with the previous settings are delivered first. From
+     * the callback, they are delivered right away, and the buffer it was
+     * passed is freed once it returns. */
+    pthread_mutex_lock(&batch.lock);
+
+    if (scan_batch_in_cb())
+        busy = batch.delivering;
+    else
+        while (batch.delivering)
+            pthread_cond_wait(&batch.idle, &batch.lock);
+
+    old[0] = batch.buf[batch.cur];
+    old[1] = batch.buf[batch.cur ^ 1];
+    old_cb = batch.cb;
+    count = batch.count;
+    batch.buf[0] = buf[0];
+    batch.buf[1] = buf[1];
+    batch.cur = 0;
+    batch.count = 0;
+    batch.size = size;
+    batch.interval = interval;
+    batch.cb = cb;
+    batch.timer.cb = scan_batch_timer_cb;
+    timer_disarm(&batch.timer);
+
+    if (!count || !old_cb) {
+        count = 0;
+    } else if (!busy) {
+        batch.delivering = old[0];
+        batch.deliverer = pthread_self();
+    }
+
+    pthread_mutex_unlock(&batch.lock);
+
+    if (count)
+        old_cb(old[0], count);
+
+    if (count && !busy) {
+        pthread_mutex_lock(&batch.lock);
+        batch.delivering = NULL;
+        pthread_cond_broadcast(&batch.idle);
+        pthread_mutex_unlock(&batch.lock);
+    }
+
+    for (i = 0; i < 2; i++)
+        if (old[i] != busy)
+            free(old[i]);
+
+    return 0;
+}
+
+/* Called every time an advertising report is seen */
+static void fast_connect_check(bt_bdaddr_t *bda, const uint8_t *adv_data);
+
+static void scan_result_cb(bt_bdaddr_t *bda, int rssi, uint8_t *adv_data) {
+    presence_event_t ev;
+    bt_bdaddr_t identity;
+    uint64_t now = now_us();
+    int deliver;
+
+    if (fast.count)
+        fast_connect_check(bda, adv_data);
+
+    /* Resolved reports go on with the identity address */
+    if (rpa.count && rpa_resolve(bda->address, identity.address, now))
+        bda = &identity;
+
+    if (__atomic_load_n(&allow.cur, __ATOMIC_RELAXED) &&
+        !allowlist_lookup(bda->address))
+        return;
+
+    if (!scan_filter_match(bda->address, rssi, adv_data))
+        return;
+
+    if (decoders.active)
+        decoders_run(bda->address, rssi, adv_data);
+
+    /* Presence changes are delivered in order with the ones of the timer */
+    pthread_mutex_lock(&scan.presence_lock);
+
+    ev.cb = NULL;
+    deliver = scan_table_update(bda->address, rssi, adv_data, now, &ev);
+    if (ev.cb)
+        ev.cb(&ev.entry, 1);
+
+    pthread_mutex_unlock(&scan.presence_lock);
+
+    if (!deliver)
+        return;
+
+    if (scan_batch_add(bda->address, rssi, adv_data, now))
+        return;
+
+    if (data.cbs.scan_cb)
+        data.cbs.scan_cb(bda->address, rssi, adv_data,
+                         adv_data_len(adv_data));
+}
+
+int ble_scan_inject(const ble_scan_report_t *reports, int count) {
+    bt_bdaddr_t bda;
+    uint8_t adv_data[ADV_DATA_LEN];
+    int i;
+
+    if (count < 0 || (count && !reports))
+        return -1;
+
+    for (i = 0; i < count; i++) {
+        memcpy(bda.address, reports[i].address, sizeof(bda.address));
+        memcpy(adv_data, reports[i].adv_data, sizeof(adv_data));
+        scan_result_cb(&bda, reports[i].rssi, adv_data);
+    }
+
+    return 0;
+}
+
+static int ble_scan(uint8_t start) {
+    bt_status_t s;
+
+    if (!data.client)
+        return -1;
+
+    if (data.gattiface == NULL)
+        return -1;
+
+    if (!data.adapter_state)
+        return -1;
+
+    if (data.scan_state == start)
+        return 1;
+
+    s = data.gattiface->client->scan(data.client, start);
+    if (s != BT_STATUS_SUCCESS)
+        return -s;
+
+    data.scan_state = start;
+
+    return 0;
+}
+
+int ble_start_scan() {
+    return ble_scan(1);
+}
+
+int ble_stop_scan() {
+    return ble_scan(0);
+}
+
+static ble_device_t *find_device_by_address(const uint8_t *address) {
+    ble_device_t *dev;
+
+    for (dev = __atomic_load_n(&data.devices, __ATOMIC_ACQUIRE); dev;
+         dev = dev->next)
+        if (!memcmp(dev->bda.address, address, sizeof(dev->bda.address)))
+            break;
+
+    return dev;
+}
+
+/* Find a device or add it to the list of known devices */
+static ble_device_t *get_device(const uint8_t *address) {
+    ble_device_t *dev;
+
+    dev = find_device_by_address(address);
+    if (dev)
+        return dev;
+
+    pthread_mutex_lock(&devices_lock);
+
+    /* Added by another thread meanwhile */
+    dev = find_device_by_address(address);
+    if (dev)
+        goto done;
+
+    dev = calloc(1, sizeof(ble_device_t));
+    if (!dev)
+        goto done;
+
+    dev->incl_walk = -1;
+    memcpy(dev->bda.address, address, sizeof(dev->bda.address));
+
+    /* Published once initialized, for the threads walking the list */
+    dev->next = data.devices;
+    __atomic_store_n(&data.devices, dev, __ATOMIC_RELEASE);
+
+done:
+    pthread_mutex_unlock(&devices_lock);
+    return dev;
+}
+
+static void discovery_set_state(ble_device_t *dev,
+                                ble_discovery_state_t state, int status);
+static void incl_walk_start(ble_device_t *dev);
+static void gatt_req_flush(ble_device_t *dev, int status);
+static int gatt_req_match(ble_device_t *dev, gatt_req_type_t type, int id);
+static void gatt_req_finish(ble_device_t *dev, int status);
+static void gatt_req_done(ble_device_t *dev);
+static void subs_replay(ble_device_t *dev);
+static void subs_reset(ble_device_t *dev);
+static void ccc_sync(ble_device_t *dev);
+static ble_gatt_sub_t *find_sub(ble_device_t *dev, int char_id);
+static int find_characteristic(ble_device_t *dev, btgatt_srvc_id_t *srvc_id,
+                               btgatt_char_id_t *char_id);
+static void sweep_connected(ble_device_t *dev, int status);
+static int sweep_late(ble_device_t *dev, int conn_id, int status);
+static void sweep_disconnected(ble_device_t *dev);
+static void sweep_services_finished(ble_device_t *dev, int status);
+static void sweep_chars_finished(ble_device_t *dev, btgatt_srvc_id_t *srvc_id);
+
+/* Account for the outcome of a connection requested on an advertisement */
+static void fast_connect_done(ble_device_t *dev, int status) {
+    uint32_t latency;
+    uint8_t resume = 0;
+
+    pthread_mutex_lock(&fast.lock);
+
+    if (!dev->fast_pending) {
+        pthread_mutex_unlock(&fast.lock);
+        return;
+    }
+
+    dev->fast_pending = 0;
+    fast.pending--;
+
+    if (status == 0) {
+        latency = now_us() - dev->fast_advert;
+        fast.stats.connected++;
+        fast.stats.latency_last = latency;
+        if (!fast.stats.latency_min || latency < fast.stats.latency_min)
+            fast.stats.latency_min = latency;
+        if (latency > fast.stats.latency_max)
+            fast.stats.latency_max = latency;
+        fast.latency_sum += latency;
+    } else
+        fast.stats.failed++;
+
+    if (fast.paused && !fast.pending) {
+        fast.paused = 0;
+        resume = 1;
+    }
+
+    pthread_mutex_unlock(&fast.lock);
+
+    if (resume && data.scan_state)
+        data.gattiface->client->scan(data.client, 1);
+}
+
+/* Report the outcome of a connection attempt */
+static void connect_report(ble_device_t *dev, int conn_id, int status) {
+    fast_connect_done(dev, status);
+
+    if (data.cbs.connect_cb)
+        data.cbs.connect_cb(dev->bda.address, conn_id, status);
+
+    if (dev->sweep)
+        sweep_connected(dev, status);
+}
+
+/* Called on the timer thread when the pending connection takes too long */
+static void conn_sched_timer_cb(void *arg);
+
+/* Issue the next queued connection request if none is pending and a link is
+ * available */
+static void conn_sched_run(void) {
+    ble_device_t *dev;
+    bt_status_t s;
+
+    for (;;) {
+        pthread_mutex_lock(&conn_sched.lock);
+
+        dev = NULL;
+        if (!conn_sched.pending && conn_sched.queue &&
+            conn_sched.links + conn_sched.background < conn_sched.max_links) {
+            dev = conn_sched.queue;
+            conn_sched.queue = dev->conn_next;
+            dev->conn_state = CONN_PENDING;
+            conn_sched.pending = dev;
+            conn_sched.deadline = now_ms() + dev->conn_attempt_timeout;
+            conn_sched.timer.cb = conn_sched_timer_cb;
+            timer_arm(&conn_sched.timer, conn_sched.deadline);
+        }
+
+        pthread_mutex_unlock(&conn_sched.lock);
+
+        if (!dev)
+            return;
+
+        s = data.gattiface->client->connect(data.client, &dev->bda, true);
+        if (s == BT_STATUS_SUCCESS)
+            return;
+
+        pthread_mutex_lock(&conn_sched.lock);
+        if (conn_sched.pending == dev) {
+            conn_sched.pending = NULL;
+            dev->conn_state = CONN_IDLE;
+            timer_disarm(&conn_sched.timer);
+        }
+        pthread_mutex_unlock(&conn_sched.lock);
+
+        connect_report(dev, 0, -1);
+    }
+}
+
+static void conn_sched_timer_cb(void *arg) {
+    ble_device_t *dev = NULL;
+
+    pthread_mutex_lock(&conn_sched.lock);
+
+    if (conn_sched.pending && conn_sched.deadline <= now_ms()) {
+        dev = conn_sched.pending;
+        conn_sched.pending = NULL;
+        dev->conn_state = CONN_IDLE;
+        dev->conn_cancelled = 1;
+    }
+
+    pthread_mutex_unlock(&conn_sched.lock);
+
+    if (dev) {
+        /* Connection id 0 cancels a pending connection */
+        data.gattiface->client->disconnect(data.client, &dev->bda, 0);
+        connect_report(dev, 0, -1);
+    }
+
+    conn_sched_run();
+}
+
+/* Queue a connection request, by decreasing priority */
+static int conn_sched_push(ble_device_t *dev, int priority, int timeout) {
+    ble_device_t **p;
+
+    pthread_mutex_lock(&conn_sched.lock);
+
+    if (dev->conn_id > 0 || dev->conn_state != CONN_IDLE ||
+        dev->reconnect_state != RECONNECT_IDLE) {
+        pthread_mutex_unlock(&conn_sched.lock);
+        return 1;
+    }
+
+    for (p = &conn_sched.queue; *p && (*p)->conn_priority >= priority;
+         p = &(*p)->conn_next);
+
+    /* A new request supersedes a cancelled one */
+    dev->conn_cancelled = 0;
+    dev->conn_state = CONN_QUEUED;
+    dev->conn_priority = priority;
+    dev->conn_attempt_timeout = timeout;
+    dev->conn_next = *p;
+    *p = dev;
+
+    pthread_mutex_unlock(&conn_sched.lock);
+
+    return 0;
+}
+
+/* Withdraw a queued connection request or cancel the pending one. Returns
+ * whether there was one. */
+static int conn_sched_cancel(ble_device_t *dev) {
+    ble_device_t **p;
+    conn_state_t state;
+
+    pthread_mutex_lock(&conn_sched.lock);
+
+    state = dev->conn_state;
+    if (state == CONN_QUEUED) {
+        for (p = &conn_sched.queue; *p && *p != dev; p = &(*p)->conn_next);
+        if (*p)
+            *p = dev->conn_next;
+    } else if (state == CONN_PENDING) {
+        conn_sched.pending = NULL;
+        dev->conn_cancelled = 1;
+        timer_disarm(&conn_sched.timer);
+    }
+    dev->conn_state = CONN_IDLE;
+
+    pthread_mutex_unlock(&conn_sched.lock);
+
+    if (state == CONN_PENDING) {
+        data.gattiface->client->disconnect(data.client, &dev->bda, 0);
+        conn_sched_run();
+    }
+
+    return state != CONN_IDLE;
+}
+
+/* Next value of the xorshift generator of the jitter of a device */
+static uint32_t reconnect_rand(ble_device_t *dev) {
+    uint32_t x = dev->reconnect_seed;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+
+    return dev->reconnect_seed = x;
+}
+
+/* Schedule the next attempt to recover a lost link, after the backoff */
+static void reconnect_retry(ble_device_t *dev) {
+    uint64_t backoff;
+
+    pthread_mutex_lock(&conn_sched.lock);
+
+    if (!dev->reconnect) {
+        dev->reconnect_state = RECONNECT_IDLE;
+        pthread_mutex_unlock(&conn_sched.lock);
+        return;
+    }
+
+    backoff = dev->reconnect_min;
+    if (dev->reconnect_attempts > 1)
+        backoff <<= dev->reconnect_attempts - 1 < 16 ?
+                    dev->reconnect_attempts - 1 : 16;
+    if (backoff > (uint64_t) dev->reconnect_max)
+        backoff = dev->reconnect_max;
+
+    /* Spread the attempts of devices lost at the same time */
+    backoff -= reconnect_rand(dev) % (backoff / 2 + 1);
+
+    dev->reconnect_state = RECONNECT_WAITING;
+    timer_arm(&dev->reconnect_timer, now_ms() + backoff);
+
+    pthread_mutex_unlock(&conn_sched.lock);
+}
+
+/* Request a background connection to recover a lost link */
+static void reconnect_issue(ble_device_t *dev) {
+    bt_status_t s;
+
+    pthread_mutex_lock(&conn_sched.lock);
+
+    if (!dev->reconnect || dev->conn_id > 0) {
+        dev->reconnect_state = RECONNECT_IDLE;
+        pthread_mutex_unlock(&conn_sched.lock);
+        return;
+    }
+
+    /* The stack may complete a background connection at any time, so it
+     * holds a link until then. Without one, check again later. */
+    if (conn_sched.links + conn_sched.background >= conn_sched.max_links) {
+        dev->reconnect_state = RECONNECT_WAITING;
+        timer_arm(&dev->reconnect_timer, now_ms() + dev->reconnect_min);
+        pthread_mutex_unlock(&conn_sched.lock);
+        return;
+    }
+
+    dev->reconnect_state = RECONNECT_CONNECTING;
+    dev->reconnect_attempts++;
+    /* A new request supersedes a cancelled one */
+    dev->conn_cancelled = 0;
+    conn_sched.background++;
+
+    pthread_mutex_unlock(&conn_sched.lock);
+
+    s = data.gattiface->client->connect(data.client, &dev->bda, false);
+    if (s == BT_STATUS_SUCCESS)
+        return;
+
+    pthread_mutex_lock(&conn_sched.lock);
+    if (dev->reconnect_state == RECONNECT_CONNECTING) {
+        dev->reconnect_state = RECONNECT_WAITING;
+        conn_sched.background--;
+    }
+    pthread_mutex_unlock(&conn_sched.lock);
+
+    reconnect_retry(dev);
+}
+
+/* Called on the timer thread when the backoff of a device has elapsed */
+static void reconnect_timer_cb(void *arg) {
+    ble_device_t *dev = arg;
+    int issue;
+
+    pthread_mutex_lock(&conn_sched.lock);
+    issue = dev->reconnect_state == RECONNECT_WAITING;
+    pthread_mutex_unlock(&conn_sched.lock);
+
+    if (issue)
+        reconnect_issue(dev);
+}
+
+/* Stop the recovery of a lost link. Returns whether there was one. */
+static int reconnect_cancel(ble_device_t *dev) {
+    reconnect_state_t state;
+
+    pthread_mutex_lock(&conn_sched.lock);
+
+    state = dev->reconnect_state;
+    if (state == RECONNECT_WAITING)
+        timer_disarm(&dev->reconnect_timer);
+    else if (state == RECONNECT_CONNECTING) {
+        dev->conn_cancelled = 1;
+        conn_sched.background--;
+    }
+    dev->reconnect_state = RECONNECT_IDLE;
+
+    pthread_mutex_unlock(&conn_sched.lock);
+
+    /* Connection id 0 also takes the device off the background connection
+     * list, freeing its link for the queued requests */
+    if (state == RECONNECT_CONNECTING) {
+        data.gattiface->client->disconnect(data.client, &dev->bda, 0);
+        conn_sched_run();
+    }
+
+    return state != RECONNECT_IDLE;
+}
+
+/* Whether a rule matches the advertisement of a device */
+static int fast_rule_match(const fast_rule_t *r, const uint8_t *address,
+                           const uint8_t *adv_data) {
+    ble_ad_iter_t it;
+    const uint8_t *value;
+    uint8_t type;
+    int len, i;
+
+    if (r->has_address && memcmp(r->address, address, sizeof(r->address)))
+        return 0;
+
+    if (!r->ad_type)
+        return 1;
+
+    ble_ad_iter_init(&it, adv_data, ADV_DATA_LEN);
+    while (ble_ad_next(&it, &type, &value, &len)) {
+        if (type != r->ad_type || len < r->len)
+            continue;
+
+        for (i = 0; i < r->len; i++)
+            if ((value[i] ^ r->value[i]) & r->mask[i])
+                break;
+        if (i == r->len)
+            return 1;
+    }
+
+    return 0;
+}
+
+/* Connect to a device right away if its advertisement matches a rule */
+static void fast_connect_check(bt_bdaddr_t *bda, const uint8_t *adv_data) {
+    uint64_t advert = now_us();
+    ble_device_t *dev;
+    uint8_t pause = 0;
+    int i, match = 0;
+
+    pthread_mutex_lock(&fast.lock);
+    for (i = 0; i < FAST_CONNECT_MAX_RULES && !match; i++)
+        if (fast.rules[i].used)
+            match = fast_rule_match(&fast.rules[i], bda->address, adv_data);
+    pthread_mutex_unlock(&fast.lock);
+
+    if (!match)
+        return;
+
+    dev = get_device(bda->address);
+    if (!dev)
+        return;
+
+    if (conn_sched_push(dev, FAST_CONNECT_PRIORITY, FAST_CONNECT_TIMEOUT))
+        return;
+
+    pthread_mutex_lock(&fast.lock);
+    dev->fast_pending = 1;
+    dev->fast_advert = advert;
+    fast.pending++;
+    fast.stats.triggered++;
+    if (fast.pause_scan && !fast.paused) {
+        fast.paused = 1;
+        pause = 1;
+    }
+    pthread_mutex_unlock(&fast.lock);
+
+    if (pause)
+        data.gattiface->client->scan(data.client, 0);
+
+    conn_sched_run();
+}
+
+/* Called every time a device gets connected */
+static void connect_cb(int conn_id, int status, int client_if,
+                       bt_bdaddr_t *bda) {
+    ble_device_t *dev, **p;
+    uint8_t cancelled, requested, reconnected = 0;
+    int downtime = 0, attempts = 0;
+
+    dev = find_device_by_address(bda->address);
+    if (!dev)
+        return;
+
+    pthread_mutex_lock(&conn_sched.lock);
+    if (dev->reconnect_state == RECONNECT_CONNECTING) {
+        reconnected = status == 0 ? 1 : 2;
+        dev->reconnect_state = RECONNECT_WAITING;
+        conn_sched.background--;
+        if (status == 0) {
+            dev->reconnect_state = RECONNECT_IDLE;
+            dev->reconnect_up = now_ms();
+            downtime = dev->reconnect_up - dev->reconnect_down;
+            attempts = dev->reconnect_attempts;
+        }
+    }
+    requested = reconnected || dev->conn_state != CONN_IDLE;
+    if (conn_sched.pending == dev) {
+        conn_sched.pending = NULL;
+        dev->conn_state = CONN_IDLE;
+        timer_disarm(&conn_sched.timer);
+    }
+    /* A link completing late satisfies a request queued meanwhile */
+    if (status == 0 && dev->conn_state == CONN_QUEUED) {
+        for (p = &conn_sched.queue; *p && *p != dev; p = &(*p)->conn_next);
+        if (*p)
+            *p = dev->conn_next;
+        dev->conn_state = CONN_IDLE;
+    }
+    if (status == 0 && dev->conn_id <= 0)
+        conn_sched.links++;
+    cancelled = dev->conn_cancelled;
+    if (status != 0)
+        dev->conn_cancelled = 0;
+    pthread_mutex_unlock(&conn_sched.lock);
+
+    dev->conn_id = status == 0 ? conn_id : 0;
+    dev->mtu = ATT_DEFAULT_MTU;
+
+    /* Failed background connections are retried without being reported */
+    if (reconnected == 2 && !cancelled) {
+        reconnect_retry(dev);
+        conn_sched_run();
+        return;
+    }
+
+    /* The attempt has already been reported as failed: drop the link, and
+     * its disconnection, silently */
+    if (cancelled) {
+        if (status == 0)
+            data.gattiface->client->disconnect(data.client, &dev->bda,
+                                               conn_id);
+        conn_sched_run();
+        return;
+    }
+
+    if (!requested && sweep_late(dev, conn_id, status)) {
+        conn_sched_run();
+        return;
+    }
+
+    /* Restore notifications before anything else goes on the link */
+    if (status == 0)
+        subs_replay(dev);
+
+    connect_report(dev, conn_id, status);
+
+    if (reconnected && data.cbs.reconnect_cb)
+        data.cbs.reconnect_cb(bda->address, conn_id, downtime, attempts);
+
+    conn_sched_run();
+}
+
+int ble_connect_with_priority(const uint8_t *address, int priority,
+                              int timeout) {
+    ble_device_t *dev;
+    int r;
+
+    if (!data.client)
+        return -1;
+
+    if (!data.gattiface)
+        return -1;
+
+    if (!data.adapter_state)
+        return -1;
+
+    dev = get_device(address);
+    if (!dev)
+        return -1;
+
+    r = conn_sched_push(dev, priority, timeout);
+    conn_sched_run();
+
+    return r;
+}
+
+int ble_connect(const uint8_t *address) {
+    return ble_connect_with_priority(address, 0, CONN_DEFAULT_TIMEOUT);
+}
+
+int ble_set_auto_reconnect(const uint8_t *address, int enable,
+                           int min_backoff, int max_backoff) {
+    ble_device_t *dev;
+
+    if (!address)
+        return -1;
+
+    if (enable && (min_backoff <= 0 || max_backoff < min_backoff))
+        return -1;
+
+    if (!enable) {
+        dev = find_device_by_address(address);
+        if (!dev)
+            return 0;
+
+        pthread_mutex_lock(&conn_sched.lock);
+        dev->reconnect = 0;
+        pthread_mutex_unlock(&conn_sched.lock);
+
+        reconnect_cancel(dev);
+
+        return 0;
+    }
+
+    dev = get_device(address);
+    if (!dev)
+        return -1;
+
+    dev->reconnect_timer.cb = reconnect_timer_cb;
+    dev->reconnect_timer.arg = dev;
+
+    pthread_mutex_lock(&conn_sched.lock);
+    if (!dev->reconnect_seed)
+        dev->reconnect_seed = ((uint32_t) now_us() ^ dev->bda.address[3] << 16 ^
+                               dev->bda.address[4] << 8 ^
+                               dev->bda.address[5]) | 1;
+    dev->reconnect = 1;
+    dev->reconnect_min = min_backoff;
+    dev->reconnect_max = max_backoff;
+    pthread_mutex_unlock(&conn_sched.lock);
+
+    return 0;
+}
+
+int ble_fast_connect_add(const uint8_t *address, uint8_t ad_type,
+                         const uint8_t *value, const uint8_t *mask, int len) {
+    fast_rule_t *r;
+    int i;
+
+    if (!address && !ad_type)
+        return -1;
+
+    if (ad_type && (len < 0 || len > ADV_PACKET_LEN - 2 || (len && !value)))
+        return -1;
+
+    pthread_mutex_lock(&fast.lock);
+
+    for (i = 0; i < FAST_CONNECT_MAX_RULES && fast.rules[i].used; i++);
+    if (i == FAST_CONNECT_MAX_RULES) {
+        pthread_mutex_unlock(&fast.lock);
+        return -1;
+    }
+
+    r = &fast.rules[i];
+    memset(r, 0, sizeof(*r));
+    r->used = 1;
+    if (address) {
+        r->has_address = 1;
+        memcpy(r->address, address, sizeof(r->address));
+    }
+    if (ad_type) {
+        r->ad_type = ad_type;
+        r->len = len;
+        memcpy(r->value, value, len);
+        if (mask)
+            memcpy(r->mask, mask, len);
+        else
+            memset(r->mask, 0xff, len);
+    }
+    fast.count++;
+
+    pthread_mutex_unlock(&fast.lock);
+
+    return i;
+}
+
+int ble_fast_connect_remove(int rule_id) {
+    if (rule_id < 0 || rule_id >= FAST_CONNECT_MAX_RULES)
+        return -1;
+
+    pthread_mutex_lock(&fast.lock);
+
+    if (!fast.rules[rule_id].used) {
+        pthread_mutex_unlock(&fast.lock);
+        return -1;
+    }
+
+    fast.rules[rule_id].used = 0;
+    fast.count--;
+
+    pthread_mutex_unlock(&fast.lock);
+
+    return 0;
+}
+
+void ble_fast_connect_set_pause_scan(int pause) {
+    pthread_mutex_lock(&fast.lock);
+    fast.pause_scan = pause ? 1 : 0;
+    pthread_mutex_unlock(&fast.lock);
+}
+
+int ble_fast_connect_get_stats(ble_fast_connect_stats_t *stats, int reset) {
+    if (!stats)
+        return -1;
+
+    pthread_mutex_lock(&fast.lock);
+
+    *stats = fast.stats;
+    if (fast.stats.connected)
+        stats->latency_mean = fast.latency_sum / fast.stats.connected;
+
+    if (reset) {
+        memset(&fast.stats, 0, sizeof(fast.stats));
+        fast.latency_sum = 0;
+    }
+
+    pthread_mutex_unlock(&fast.lock);
+
+    return 0;
+}
+
+int ble_connect_set_max_links(int max_links) {
+    if (max_links <= 0)
+        return -1;
+
+    pthread_mutex_lock(&conn_sched.lock);
+    conn_sched.max_links = max_links;
+    pthread_mutex_unlock(&conn_sched.lock);
+
+    conn_sched_run();
+
+    return 0;
+}
+
+/* Called every time a device gets disconnected */
+static void disconnect_cb(int conn_id, int status, int client_if,
+                          bt_bdaddr_t *bda) {
+    ble_device_t *dev;
+    uint8_t cancelled, recover = 0;
+    uint64_t now;
+
+    dev = find_device_by_address(bda->address);
+    if (!dev)
+        return;
+
+    pthread_mutex_lock(&conn_sched.lock);
+    if (dev->conn_id > 0)
+        conn_sched.links--;
+    cancelled = dev->conn_cancelled;
+    dev->conn_cancelled = 0;
+    if (dev->reconnect && dev->conn_id > 0 && !dev->user_disconnect &&
+        !cancelled && dev->reconnect_state == RECONNECT_IDLE) {
+        now = now_ms();
+        /* A link which did not hold keeps backing off */
+        if (now - dev->reconnect_up >= RECONNECT_STABLE_MS)
+            dev->reconnect_attempts = 0;
+        dev->reconnect_down = now;
+        recover = 1;
+    }
+    dev->user_disconnect = 0;
+    pthread_mutex_unlock(&conn_sched.lock);
+
+    /* Fails the discovery of the device if it is running */
+    discovery_set_state(dev, BLE_DISCOVERY_FAILED, -1);
+
+    dev->incl_walk = -1;
+    gatt_req_flush(dev, -1);
+    subs_reset(dev);
+    dev->conn_id = 0;
+    dev->mtu = ATT_DEFAULT_MTU;
+    dev->conn_interval = 0;
+    dev->conn_latency = 0;
+    dev->conn_timeout = 0;
+
+    if (!cancelled) {
+        if (data.cbs.disconnect_cb)
+            data.cbs.disconnect_cb(bda->address, conn_id, status);
+
+        if (dev->sweep)
+            sweep_disconnected(dev);
+    }
+
+    if (recover) {
+        if (dev->reconnect_attempts == 0)
+            reconnect_issue(dev);
+        else
+            reconnect_retry(dev);
+    }
+
+    conn_sched_run();
+}
+
+int ble_disconnect(const uint8_t *address) {
+    ble_device_t *dev;
+    bt_status_t s;
+
+    if (!data.client)
+        return -1;
+
+    if (!data.gattiface)
+        return -1;
+
+    if (!data.adapter_state)
+        return -1;
+
+    if (!address)
+        return -1;
+
+    dev = find_device_by_address(address);
+    if (!dev)
+        return -1;
+
+    if (conn_sched_cancel(dev) || reconnect_cancel(dev))
+        return 0;
+
+    pthread_mutex_lock(&conn_sched.lock);
+    dev->user_disconnect = 1;
+    pthread_mutex_unlock(&conn_sched.lock);
+
+    s = data.gattiface->client->disconnect(data.client, &dev->bda,
+                                           dev->conn_id);
+    if (s != BT_STATUS_SUCCESS)
+        return -s;
+
+    return 0;
+}
+
+/* Called every time the bond state with a device changes */
+static void bond_state_changed_cb(bt_status_t status, bt_bdaddr_t *bda,
+                                  bt_bond_state_t state) {
+    ble_bond_state_t s;
+    ble_device_t *dev;
+
+    switch (state) {
+        case BT_BOND_STATE_NONE:
+            s = BLE_BOND_NONE;
+            break;
+        case BT_BOND_STATE_BONDING:
+            s = BLE_BOND_BONDING;
+            break;
+        case BT_BOND_STATE_BONDED:
+            s = BLE_BOND_BONDED;
+            break;
+        default:
+            return;
+    }
+
+    dev = find_device_by_address(bda->address);
+    if (dev && data.cbs.bond_state_cb)
+        data.cbs.bond_state_cb(bda->address, s, status);
+}
+
+static int ble_pair_internal(const uint8_t *address, uint8_t operation) {
+    ble_device_t *dev;
+    bt_status_t s = BT_STATUS_UNSUPPORTED;
+
+    if (!data.btiface)
+        return -1;
+
+    if (!data.adapter_state)
+        return -1;
+
+    dev = get_device(address);
+    if (!dev)
+        return -1;
+
+    switch (operation) {
+        case 0: /* Pair */
+            s = data.btiface->create_bond(&dev->bda);
+            break;
+        case 1: /* Cancel pairing */
+            s = data.btiface->cancel_bond(&dev->bda);
+            break;
+        case 2: /* Remove bond */
+            s = data.btiface->remove_bond(&dev->bda);
+            break;
+    }
+
+    if (s != BT_STATUS_SUCCESS)
+        return -s;
+
+    return 0;
+}
+
+int ble_pair(const uint8_t *address) {
+    return ble_pair_internal(address, 0);
+}
+
+int ble_cancel_pairing(const uint8_t *address) {
+    return ble_pair_internal(address, 1);
+}
+
+int ble_remove_bond(const uint8_t *address) {
+    return ble_pair_internal(address, 2);
+}
+
+static ble_device_t *find_device_by_conn_id(int conn_id) {
+    ble_device_t *dev;
+
+    for (dev = __atomic_load_n(&data.devices, __ATOMIC_ACQUIRE); dev;
+         dev = dev->next)
+        if (dev->conn_id == conn_id)
+            break;
+
+    return dev;
+}
+
+/* Called in response of a read remote RSSI operation */
+void read_remote_rssi_cb(int client_if, bt_bdaddr_t *bda, int rssi,
+                         int status) {
+    ble_device_t *dev;
+    int conn_id = -1;
+
+    if (!status) {
+        dev = find_device_by_address(bda->address);
+        if (dev)
+            conn_id = dev->conn_id;
+    }
+
+    if (data.cbs.rssi_cb)
+        data.cbs.rssi_cb(conn_id, rssi, status);
+}
+
+int ble_read_remote_rssi(int conn_id) {
+    ble_device_t *dev;
+    bt_status_t s;
+
+    if (!data.client)
+        return -1;
+
+    if (conn_id <= 0)
+        return -1;
+
+    if (!data.gattiface)
+        return -1;
+
+    dev = find_device_by_conn_id(conn_id);
+    if (!dev)
+        return -1;
+
+    s = data.gattiface->client->read_remote_rssi(data.client, &dev->bda);
+    if (s != BT_STATUS_SUCCESS)
+        return -s;
+
+    return 0;
+}
+
+static int find_service(ble_device_t *dev, btgatt_srvc_id_t *srvc_id) {
+    int id;
+
+    for (id = 0; id < dev->srvc_count; id++)
+        if (!memcmp(&dev->srvcs[id], srvc_id, sizeof(btgatt_srvc_id_t)))
+            return id;
+
+    return -1;
+}
+
+/* Find a service or add it to the device attribute table */
+static int add_service(ble_device_t *dev, btgatt_srvc_id_t *srvc_id) {
+    btgatt_srvc_id_t *srvcs;
+    uint8_t *flags;
+    int id;
+
+    id = find_service(dev, srvc_id);
+    if (id >= 0)
+        return id;
+
+    if (dev->srvc_count == UINT8_MAX)
+        return -1;
+
+    srvcs = realloc(dev->srvcs, (dev->srvc_count + 1) * sizeof(*srvcs));
+    if (!srvcs)
+        return -1;
+    dev->srvcs = srvcs;
+
+    flags = realloc(dev->srvc_flags, (dev->srvc_count + 1) * sizeof(*flags));
+    if (!flags)
+        return -1;
+    dev->srvc_flags = flags;
+
+    id = dev->srvc_count++;
+    memcpy(&dev->srvcs[id], srvc_id, sizeof(btgatt_srvc_id_t));
+    dev->srvc_flags[id] = 0;
+
+    return id;
+}
+
+/* Move the discovery of a device to a new stage. Devices which are not part
+ * of the running discovery, or have finished it, are left alone. */
+static void discovery_set_state(ble_device_t *dev,
+                                ble_discovery_state_t state, int status) {
+    ble_discovery_ready_cb_t ready_cb = NULL;
+    ble_discovery_cb_t cb;
+    int count = 0, failed = 0;
+
+    pthread_mutex_lock(&disc_lock);
+
+    if (!dev->disc_counted) {
+        pthread_mutex_unlock(&disc_lock);
+        return;
+    }
+
+    dev->disc_state = state;
+    cb = data.disc_cb;
+
+    if (state == BLE_DISCOVERY_DONE || state == BLE_DISCOVERY_FAILED) {
+        dev->disc_counted = 0;
+        if (state == BLE_DISCOVERY_FAILED)
+            data.disc_failed++;
+        if (--data.disc_pending == 0) {
+            ready_cb = data.disc_ready_cb;
+            count = data.disc_count;
+            failed = data.disc_failed;
+        }
+    }
+
+    pthread_mutex_unlock(&disc_lock);
+
+    if (cb)
+        cb(dev->conn_id, state, status);
+
+    if (ready_cb)
+        ready_cb(count, failed);
+}
+
+/* Request the descriptors of the next characteristic or finish discovery */
+static void discovery_next_char(ble_device_t *dev) {
+    bt_status_t s;
+
+    for (; dev->disc_idx < dev->char_count; dev->disc_idx++) {
+        s = data.gattiface->client->get_descriptor(dev->conn_id,
+                                                   &dev->chars[dev->disc_idx].s,
+                                                   &dev->chars[dev->disc_idx].c,
+                                                   NULL);
+        if (s == BT_STATUS_SUCCESS)
+            return;
+    }
+
+    discovery_set_state(dev, BLE_DISCOVERY_DONE, 0);
+}
+
+/* Request the characteristics of the next service or move to descriptors */
+static void discovery_next_service(ble_device_t *dev) {
+    bt_status_t s;
+
+    for (; dev->disc_idx < dev->srvc_count; dev->disc_idx++) {
+        s = data.gattiface->client->get_characteristic(dev->conn_id,
+                                                       &dev->srvcs[dev->disc_idx],
+                                                       NULL);
+        if (s == BT_STATUS_SUCCESS)
+            return;
+    }
+
+    dev->disc_idx = 0;
+    discovery_set_state(dev, BLE_DISCOVERY_DESCRIPTORS, 0);
+    discovery_next_char(dev);
+}
+
+/* Called when the characteristics of a service have all been found */
+static void discovery_chars_finished(int conn_id, btgatt_srvc_id_t *srvc_id) {
+    ble_device_t *dev;
+
+    dev = find_device_by_conn_id(conn_id);
+    if (dev && dev->sweep) {
+        sweep_chars_finished(dev, srvc_id);
+        return;
+    }
+
+    if (!dev || dev->disc_state != BLE_DISCOVERY_CHARACTERISTICS)
+        return;
+
+    /* Ignore characteristic discoveries not started by the discovery chain */
+    if (srvc_id && memcmp(&dev->srvcs[dev->disc_idx], srvc_id,
+                          sizeof(btgatt_srvc_id_t)))
+        return;
+
+    dev->disc_idx++;
+    discovery_next_service(dev);
+}
+
+/* Called when the descriptors of a characteristic have all been found */
+static void discovery_descs_finished(int conn_id, btgatt_char_id_t *char_id) {
+    ble_device_t *dev;
+
+    dev = find_device_by_conn_id(conn_id);
+    if (!dev || dev->disc_state != BLE_DISCOVERY_DESCRIPTORS)
+        return;
+
+    /* Ignore descriptor discoveries not started by the discovery chain */
+    if (char_id && memcmp(&dev->chars[dev->disc_idx].c, char_id,
+                          sizeof(btgatt_char_id_t)))
+        return;
+
+    dev->disc_idx++;
+    discovery_next_char(dev);
+}
+
+/* Called when the descriptors of a characteristic have all been found */
+static void ccc_descs_finished(int conn_id, btgatt_srvc_id_t *srvc_id,
+                               btgatt_char_id_t *char_id) {
+    ble_device_t *dev;
+    ble_gatt_sub_t *sub;
+    int id;
+
+    dev = find_device_by_conn_id(conn_id);
+    if (!dev || !dev->subs)
+        return;
+
+    id = find_characteristic(dev, srvc_id, char_id);
+    sub = id >= 0 ? find_sub(dev, id) : NULL;
+    if (sub && sub->lookup == CCC_LOOKUP_PENDING)
+        sub->lookup = CCC_LOOKUP_DONE;
+
+    ccc_sync(dev);
+}
+
+/* Called when the included services walk has reached every service */
+static void incl_walk_finished(ble_device_t *dev) {
+    dev->incl_walk = -1;
+
+    if (dev->disc_state == BLE_DISCOVERY_INCLUDED) {
+        dev->disc_idx = 0;
+        discovery_set_state(dev, BLE_DISCOVERY_CHARACTERISTICS, 0);
+        discovery_next_service(dev);
+    } else if (data.cbs.srvc_finished_cb)
+        data.cbs.srvc_finished_cb(dev->conn_id, 0);
+}
+
+/* Request the included services of the next service queued for the walk */
+static void incl_walk_next(ble_device_t *dev) {
+    bt_status_t s;
+    int id;
+
+    /* Services included later may have a lower id, so always rescan */
+    for (id = 0; id < dev->srvc_count; id++) {
+        if (dev->srvc_flags[id] != INCL_QUEUED)
+            continue;
+
+        dev->srvc_flags[id] |= INCL_WALKED;
+        dev->incl_walk = id;
+
+        s = data.gattiface->client->get_included_service(dev->conn_id,
+                                                         &dev->srvcs[id],
+                                                         NULL);
+        if (s == BT_STATUS_SUCCESS)
+            return;
+    }
+
+    incl_walk_finished(dev);
+}
+
+/* Start walking the inclusion graph from all services */
+static void incl_walk_start(ble_device_t *dev) {
+    int id;
+
+    for (id = 0; id < dev->srvc_count; id++)
+        dev->srvc_flags[id] = INCL_QUEUED;
+
+    incl_walk_next(dev);
 }
 
 /* Called when the service discovery finishes */
 void service_discovery_complete_cb(int conn_id, int status) {
+    ble_device_t *dev;
+
     if (data.cbs.srvc_finished_cb)
         data.cbs.srvc_finished_cb(conn_id, status);
+
+    dev = find_device_by_conn_id(conn_id);
+    if (!dev)
+        return;
+
+    /* CCC writes refused before the stack had the attributes cached */
+    if (status == 0)
+        ccc_sync(dev);
+
+    if (dev->sweep) {
+        sweep_services_finished(dev, status);
+        return;
+    }
+
+    if (dev->disc_state != BLE_DISCOVERY_SERVICES)
+        return;
+
+    if (status != 0) {
+        discovery_set_state(dev, BLE_DISCOVERY_FAILED, status);
+        return;
+    }
+
+    discovery_set_state(dev, BLE_DISCOVERY_INCLUDED, 0);
+    incl_walk_start(dev);
+}
+
+/* Called for each service discovery result */
+void service_discovery_result_cb(int conn_id, btgatt_srvc_id_t *srvc_id) {
+    int id;
+    ble_device_t *dev;
+
+    dev = find_device_by_conn_id(conn_id);
+    if (!dev)
+        return;
+
+    id = add_service(dev, srvc_id);
+    if (id < 0)
+        return;
+
+    if (data.cbs.srvc_found_cb)
+        data.cbs.srvc_found_cb(conn_id, id, srvc_id->id.uuid.uu,
+                               srvc_id->is_primary);
+}
+
+int ble_gatt_discover_services(int conn_id, const uint8_t *uuid) {
+    bt_status_t s;
+    bt_uuid_t uu, *u = NULL;
+
+    if (conn_id <= 0)
+        return -1;
+
+    if (!data.gattiface)
+        return -1;
+
+    if (uuid) {
+        memcpy(uu.uu, uuid, 16 * sizeof(uint8_t));
+        u = &uu;
+    }
+
+    s = data.gattiface->client->search_service(conn_id, u);
+    if (s != BT_STATUS_SUCCESS)
+        return -s;
+
+    return 0;
+}
+
+/* Record that service srvc includes service incl, if not known yet */
+static void add_inclusion(ble_device_t *dev, int srvc, int incl) {
+    ble_gatt_incl_t *incls;
+    int i;
+
+    for (i = 0; i < dev->incl_count; i++)
+        if (dev->incls[i].srvc == srvc && dev->incls[i].incl == incl)
+            return;
+
+    incls = realloc(dev->incls, (dev->incl_count + 1) * sizeof(*incls));
+    if (!incls)
+        return;
+
+    dev->incls = incls;
+    dev->incls[dev->incl_count].srvc = srvc;
+    dev->incls[dev->incl_count].incl = incl;
+    dev->incl_count++;
+}
+
+/* Called for each included service found, and once at the end of the list */
+static void get_included_service_cb(int conn_id, int status,
+                                    btgatt_srvc_id_t *srvc_id,
+                                    btgatt_srvc_id_t *incl_srvc_id) {
+    ble_device_t *dev;
+    bt_status_t s;
+    int id;
+
+    dev = find_device_by_conn_id(conn_id);
+    if (!dev || dev->incl_walk < 0)
+        return;
+
+    if (memcmp(&dev->srvcs[dev->incl_walk], srvc_id, sizeof(btgatt_srvc_id_t)))
+        return;
+
+    if (status != 0) {
+        incl_walk_next(dev);
+        return;
+    }
+
+    id = add_service(dev, incl_srvc_id);
+    if (id >= 0) {
+        add_inclusion(dev, dev->incl_walk, id);
+
+        /* Services already reached are not walked again, which breaks
+         * inclusion cycles */
+        if (!dev->srvc_flags[id]) {
+            dev->srvc_flags[id] = INCL_QUEUED;
+
+            if (data.cbs.srvc_found_cb)
+                data.cbs.srvc_found_cb(conn_id, id, incl_srvc_id->id.uuid.uu,
+                                       incl_srvc_id->is_primary);
+        }
+    }
+
+    /* Get next included service */
+    s = data.gattiface->client->get_included_service(conn_id, srvc_id,
+                                                     incl_srvc_id);
+    if (s != BT_STATUS_SUCCESS)
+        incl_walk_next(dev);
+}
+
+int ble_gatt_get_included_services(int conn_id, int service_id) {
+    ble_device_t *dev;
+    bt_status_t s;
+    int id;
+
+    if (conn_id <= 0)
+        return -1;
+
+    if (!data.gattiface)
+        return -1;
+
+    dev = find_device_by_conn_id(conn_id);
+    if (!dev)
+        return -1;
+
+    if (dev->srvc_count <= 0)
+        return -1;
+
+    if (service_id < 0 || service_id >= dev->srvc_count)
+        return -1;
+
+    if (dev->incl_walk >= 0)
+        return -1;
+
+    /* The root is requested here so that a failure reaches the caller, the
+     * rest of the walk goes on from the callbacks */
+    for (id = 0; id < dev->srvc_count; id++)
+        dev->srvc_flags[id] = 0;
+    dev->srvc_flags[service_id] = INCL_QUEUED | INCL_WALKED;
+
+    s = data.gattiface->client->get_included_service(conn_id,
+                                                     &dev->srvcs[service_id],
+                                                     NULL);
+    if (s != BT_STATUS_SUCCESS)
+        return -s;
+
+    dev->incl_walk = service_id;
+
+    return 0;
+}
+
+int ble_gatt_get_service_includes(int conn_id, int service_id, int *ids,
+                                  int max) {
+    ble_device_t *dev;
+    int i, n = 0;
+
+    if (conn_id <= 0)
+        return -1;
+
+    dev = find_device_by_conn_id(conn_id);
+    if (!dev)
+        return -1;
+
+    if (service_id < 0 || service_id >= dev->srvc_count)
+        return -1;
+
+    for (i = 0; i < dev->incl_count; i++) {
+        if (dev->incls[i].srvc != service_id)
+            continue;
+
+        if (ids && n < max)
+            ids[n] = dev->incls[i].incl;
+        n++;
+    }
+
+    return n;
+}
+
+static int find_characteristic(ble_device_t *dev, btgatt_srvc_id_t *srvc_id,
+                               btgatt_char_id_t *char_id) {
+    int id;
+
+    for (id = 0; id < dev->char_count; id++)
+        if (!memcmp(&dev->chars[id].c, char_id, sizeof(btgatt_char_id_t)) &&
+            !memcmp(&dev->chars[id].s, srvc_id, sizeof(btgatt_srvc_id_t)))
+            return id;
+
+    return -1;
+}
+
+/* Called for each characteristic discovery result */
+static void characteristic_discovery_cb(int conn_id, int status,
+                                        btgatt_srvc_id_t *srvc_id,
+                                        btgatt_char_id_t *char_id,
+                                        int char_prop) {
+    ble_device_t *dev;
+    int id;
+    bt_status_t s;
+
+    if (status != 0) {
+        if (data.cbs.char_finished_cb)
+            data.cbs.char_finished_cb(conn_id, status);
+        discovery_chars_finished(conn_id, srvc_id);
+        return;
+    }
+
+    dev = find_device_by_conn_id(conn_id);
+    if (!dev)
+        return;
+
+    id = find_characteristic(dev, srvc_id, char_id);
+    if (id < 0) {
+        id = dev->char_count++;
+        dev->chars = realloc(dev->chars,
+                             dev->char_count * sizeof(ble_gatt_char_t));
+        memcpy(&dev->chars[id].s, srvc_id, sizeof(btgatt_srvc_id_t));
+        memcpy(&dev->chars[id].c, char_id, sizeof(btgatt_char_id_t));
+    }
+    dev->chars[id].props = char_prop;
+
+    if (data.cbs.char_found_cb)
+        data.cbs.char_found_cb(conn_id, id, char_id->uuid.uu, char_prop);
+
+    /* Get next characteristic */
+    s = data.gattiface->client->get_characteristic(conn_id, srvc_id, char_id);
+    if (s != BT_STATUS_SUCCESS) {
+        if (data.cbs.char_finished_cb)
+            data.cbs.char_finished_cb(conn_id, status);
+        discovery_chars_finished(conn_id, srvc_id);
+    }
+}
+
+int ble_gatt_discover_characteristics(int conn_id, int service_id) {
+    ble_device_t *dev;
+    bt_status_t s;
+
+    if (conn_id <= 0)
+        return -1;
+
+    if (!data.gattiface)
+        return -1;
+
+    dev = find_device_by_conn_id(conn_id);
+    if (!dev)
+        return -1;
+
+    if (dev->srvc_count <= 0)
+        return -1;
+
+    if (service_id < 0 || service_id >= dev->srvc_count)
+        return -1;
+
+    s = data.gattiface->client->get_characteristic(conn_id,
+                                                   &dev->srvcs[service_id],
+                                                   NULL);
+    if (s != BT_STATUS_SUCCESS)
+        return -s;
+
+    return 0;
+}
+
+static int find_descriptor(ble_device_t *dev, btgatt_srvc_id_t *srvc_id,
+                           btgatt_char_id_t *char_id, bt_uuid_t *descr_id) {
+    int id;
+
+    for (id = 0; id < dev->desc_count; id++)
+        if (!memcmp(&dev->descs[id].d, descr_id, sizeof(bt_uuid_t)) &&
+            !memcmp(&dev->descs[id].c.c, char_id, sizeof(btgatt_char_id_t)) &&
+            !memcmp(&dev->descs[id].c.s, srvc_id, sizeof(btgatt_srvc_id_t)))
+            return id;
+
+    return -1;
+}
+
+/* Called for each descriptor discovery result */
+static void descriptor_discovery_cb(int conn_id, int status,
+                                    btgatt_srvc_id_t *srvc_id,
+                                    btgatt_char_id_t *char_id,
+                                    bt_uuid_t *descr_id) {
+    ble_device_t *dev;
+    int id;
+    bt_status_t s;
+
+    if (status != 0) {
+        if (data.cbs.desc_finished_cb)
+            data.cbs.desc_finished_cb(conn_id, status);
+        discovery_descs_finished(conn_id, char_id);
+        ccc_descs_finished(conn_id, srvc_id, char_id);
+        return;
+    }
+
+    dev = find_device_by_conn_id(conn_id);
+    if (!dev)
+        return;
+
+    id = find_descriptor(dev, srvc_id, char_id, descr_id);
+    if (id < 0) {
+        id = dev->desc_count++;
+        dev->descs = realloc(dev->descs,
+                             dev->desc_count * sizeof(ble_gatt_desc_t));
+        memcpy(&dev->descs[id].c.s, srvc_id, sizeof(btgatt_srvc_id_t));
+        memcpy(&dev->descs[id].c.c, char_id, sizeof(btgatt_char_id_t));
+        memcpy(&dev->descs[id].d, descr_id, sizeof(bt_uuid_t));
+    }
+
+    if (data.cbs.desc_found_cb)
+        data.cbs.desc_found_cb(conn_id, id, descr_id->uu, 0);
+
+    /* Get next descriptor */
+    s = data.gattiface->client->get_descriptor(conn_id, srvc_id, char_id,
+                                               descr_id);
+    if (s != BT_STATUS_SUCCESS) {
+        if (data.cbs.desc_finished_cb)
+            data.cbs.desc_finished_cb(conn_id, status);
+        discovery_descs_finished(conn_id, char_id);
+        ccc_descs_finished(conn_id, srvc_id, char_id);
+    }
+}
+
+int ble_gatt_discover_descriptors(int conn_id, int char_id) {
+    ble_device_t *dev;
+    bt_status_t s;
+
+    if (conn_id <= 0)
+        return -1;
+
+    if (!data.gattiface)
+        return -1;
+
+    dev = find_device_by_conn_id(conn_id);
+    if (!dev)
+        return -1;
+
+    if (dev->char_count <= 0)
+        return -1;
+
+    if (char_id < 0 || char_id >= dev->char_count)
+        return -1;
+
+    s = data.gattiface->client->get_descriptor(conn_id, &dev->chars[char_id].s,
+                                               &dev->chars[char_id].c, NULL);
+    if (s != BT_STATUS_SUCCESS)
+        return -s;
+
+    return 0;
+}
+
+int ble_gatt_discover_all(ble_discovery_cb_t progress_cb,
+                          ble_discovery_ready_cb_t ready_cb) {
+    ble_device_t *dev;
+    bt_status_t s = BT_STATUS_SUCCESS;
+    int count = 0, refused = 0, conn_id, done, failed;
+
+    if (!data.gattiface)
+        return -1;
+
+    /* The connected devices are counted at once. A device disconnecting
+     * afterwards fails, and one connecting is left out. */
+    pthread_mutex_lock(&disc_lock);
+
+    if (data.disc_pending > 0) {
+        pthread_mutex_unlock(&disc_lock);
+        return 1;
+    }
+
+    for (dev = __atomic_load_n(&data.devices, __ATOMIC_ACQUIRE); dev;
+         dev = dev->next) {
+        dev->disc_state = BLE_DISCOVERY_IDLE;
+        dev->disc_counted = dev->conn_id > 0;
+        count += dev->disc_counted;
+    }
+
+    if (!count) {
+        pthread_mutex_unlock(&disc_lock);
+        return -1;
+    }
+
+    /* One more is held until all requests are issued, so that the devices
+     * finishing early do not trigger the ready callback */
+    data.disc_cb = progress_cb;
+    data.disc_ready_cb = ready_cb;
+    data.disc_count = count;
+    data.disc_failed = 0;
+    data.disc_pending = count + 1;
+
+    pthread_mutex_unlock(&disc_lock);
+
+    for (dev = __atomic_load_n(&data.devices, __ATOMIC_ACQUIRE); dev;
+         dev = dev->next) {
+        pthread_mutex_lock(&disc_lock);
+        conn_id = dev->disc_counted ? dev->conn_id : 0;
+        pthread_mutex_unlock(&disc_lock);
+
+        if (conn_id <= 0)
+            continue;
+
+        discovery_set_state(dev, BLE_DISCOVERY_SERVICES, 0);
+
+        s = data.gattiface->client->search_service(conn_id, NULL);
+        if (s != BT_STATUS_SUCCESS) {
+            refused++;
+            discovery_set_state(dev, BLE_DISCOVERY_FAILED, s);
+        }
+    }
+
+    pthread_mutex_lock(&disc_lock);
+    done = --data.disc_pending == 0;
+    failed = data.disc_failed;
+    pthread_mutex_unlock(&disc_lock);
+
+    /* Nothing was started */
+    if (refused == count)
+        return -s;
+
+    if (done && ready_cb)
+        ready_cb(count, failed);
+
+    return 0;
+}
+
+int ble_gatt_get_discovery_state(int conn_id, ble_discovery_state_t *state,
+                                 int *done, int *total) {
+    ble_device_t *dev;
+    int d = 0, t = 0;
+
+    if (conn_id <= 0 || !state)
+        return -1;
+
+    dev = find_device_by_conn_id(conn_id);
+    if (!dev)
+        return -1;
+
+    *state = dev->disc_state;
+
+    switch (dev->disc_state) {
+        case BLE_DISCOVERY_INCLUDED:
+            for (t = 0; t < dev->srvc_count; t++)
+                if (dev->srvc_flags[t] & INCL_WALKED)
+                    d++;
+            break;
+        case BLE_DISCOVERY_CHARACTERISTICS:
+            d = dev->disc_idx;
+            t = dev->srvc_count;
+            break;
+        case BLE_DISCOVERY_DESCRIPTORS:
+            d = dev->disc_idx;
+            t = dev->char_count;
+            break;
+        default:
+            break;
+    }
+
+    if (done)
+        *done = d;
+    if (total)
+        *total = t;
+
+    return 0;
+}
+
+/* Store the result of the current read of a batch */
+static void read_many_store(ble_gatt_req_t *req, int status, int value_type,
+                            const uint8_t *value, int len) {
+    ble_gatt_read_result_t *r;
+    char *p;
+
+    if (req->len + len > req->size) {
+        p = realloc(req->value, req->len + len);
+        if (!p) {
+            status = BT_STATUS_NOMEM;
+            len = 0;
+        } else {
+            req->value = p;
+            req->size = req->len + len;
+        }
+    }
+
+    r = (ble_gatt_read_result_t *) req->value + req->idx;
+    r->char_id = req->ids[req->idx];
+    r->status = status;
+    r->value_type = value_type;
+    r->offset = req->len - req->count * sizeof(ble_gatt_read_result_t);
+    r->len = len;
+
+    if (len > 0)
+        memcpy(req->value + req->len, value, len);
+    req->len += len;
+    req->idx++;
+}
+
+/* Issue the next read of a batch. Returns BT_STATUS_DONE when no read is left
+ * in flight. */
+static bt_status_t read_many_next(ble_device_t *dev, ble_gatt_req_t *req) {
+    bt_status_t s;
+    int id;
+
+    while (req->idx < req->count) {
+        id = req->ids[req->idx];
+        if (id >= 0 && id < dev->char_count) {
+            req->id = id;
+            s = data.gattiface->client->read_characteristic(dev->conn_id,
+                                                          &dev->chars[id].s,
+                                                          &dev->chars[id].c,
+                                                          req->auth);
+            if (s == BT_STATUS_SUCCESS)
+                return s;
+        } else
+            s = BT_STATUS_PARM_INVALID;
+
+        read_many_store(req, s, 0, NULL, 0);
+    }
+
+    return BT_STATUS_DONE;
+}
+
+/* Called when a GATT read characteristic operation returns */
+void read_characteristic_cb(int conn_id, int status,
+                            btgatt_read_params_t *p_data) {
+    ble_device_t *dev;
+    int id = -1;
+
+    dev = find_device_by_conn_id(conn_id);
+    if (dev)
+        id = find_characteristic(dev, &p_data->srvc_id, &p_data->char_id);
+
+    if (dev && gatt_req_match(dev, GATT_REQ_READ_MANY, id)) {
+        read_many_store(dev->reqs, status, p_data->value_type,
+                        p_data->value.value, status ? 0 : p_data->value.len);
+        if (read_many_next(dev, dev->reqs) != BT_STATUS_SUCCESS)
+            gatt_req_finish(dev, 0);
+        return;
+    }
+
+    if (data.cbs.char_read_cb)
+        data.cbs.char_read_cb(conn_id, id, p_data->value.value,
+                              p_data->value.len, p_data->value_type, status);
+
+    if (dev && gatt_req_match(dev, GATT_REQ_READ_CHAR, id))
+        gatt_req_done(dev);
+}
+
+/* Called when a GATT read descriptor operation returns */
+static void read_descriptor_cb(int conn_id, int status,
+                               btgatt_read_params_t *p_data) {
+    ble_device_t *dev;
+    int id = -1;
+
+    dev = find_device_by_conn_id(conn_id);
+    if (dev)
+        id = find_descriptor(dev, &p_data->srvc_id, &p_data->char_id,
+                             &p_data->descr_id);
+
+    if (data.cbs.desc_read_cb)
+        data.cbs.desc_read_cb(conn_id, id, p_data->value.value,
+                              p_data->value.len, p_data->value_type, status);
+
+    if (dev && gatt_req_match(dev, GATT_REQ_READ_DESC, id))
+        gatt_req_done(dev);
+}
+
+/* Room for a value on a write or a notification with the current MTU */
+static int payload_size(ble_device_t *dev) {
+    return (dev->mtu ? dev->mtu : ATT_DEFAULT_MTU) - ATT_WRITE_HDR_LEN;
+}
+
+/* Send stream chunks until all credits are used. Each chunk is accounted for
+ * before it is sent, as its completion may come right after, and filling
+ * marks the stream being sent so that completions wait for it. */
+static bt_status_t stream_fill(ble_device_t *dev, ble_gatt_req_t *req) {
+    bt_status_t s = BT_STATUS_SUCCESS;
+    int credits, offset, n;
+
+    credits = data.stream_credits ? data.stream_credits
+                                  : STREAM_DEFAULT_CREDITS;
+
+    pthread_mutex_lock(&req_lock);
+    req->filling = 1;
+
+    while (req->in_flight < credits && req->sent < req->len) {
+        offset = req->sent;
+        n = req->len - offset;
+        if (n > req->chunk)
+            n = req->chunk;
+        req->sent += n;
+        req->in_flight++;
+        pthread_mutex_unlock(&req_lock);
+
+        s = data.gattiface->client->write_characteristic(dev->conn_id,
+                                                      &dev->chars[req->id].s,
+                                                      &dev->chars[req->id].c,
+                                                      GATT_WRITE_NO_RSP, n,
+                                                      req->auth,
+                                                      req->value + offset);
+
+        pthread_mutex_lock(&req_lock);
+        if (s != BT_STATUS_SUCCESS) {
+            req->sent -= n;
+            req->in_flight--;
+            break;
+        }
+    }
+
+    req->filling = 0;
+    pthread_cond_broadcast(&req_idle);
+    pthread_mutex_unlock(&req_lock);
+
+    return s;
+}
+
+/* Bytes per second acknowledged by the stack since the stream started */
+static int stream_rate(ble_gatt_req_t *req) {
+    uint64_t elapsed = now_ms() - req->start_ms;
+
+    if (!elapsed)
+        return 0;
+
+    return (int) ((uint64_t) req->acked * 1000 / elapsed);
+}
+
+/* Send a single read or write to the stack */
+static bt_status_t gatt_op_issue(ble_device_t *dev, ble_gatt_req_t *req) {
+    int id = req->id;
+
+    switch (req->op) {
+        case 0: /* Read characteristic */
+            if (id >= dev->char_count)
+                return BT_STATUS_PARM_INVALID;
+
+            return data.gattiface->client->read_characteristic(dev->conn_id,
+                                                           &dev->chars[id].s,
+                                                           &dev->chars[id].c,
+                                                           req->auth);
+
+        case 1: /* Read descriptor */
+            if (id >= dev->desc_count)
+                return BT_STATUS_PARM_INVALID;
+
+            return data.gattiface->client->read_descriptor(dev->conn_id,
+                                                       &dev->descs[id].c.s,
+                                                       &dev->descs[id].c.c,
+                                                       &dev->descs[id].d,
+                                                       req->auth);
+
+        case 4: /* Write characteristic with prepare write */
+            dev->write_prepared = 1;
+            dev->prep_write_type = BLE_GATT_ELEM_CHARACTERISTIC;
+            dev->prep_write_id = id;
+            /* pass-through */
+
+        case 2: /* Write characteristic with write command */
+        case 3: /* Write characteristic with write request */
+            if (id >= dev->char_count)
+                return BT_STATUS_PARM_INVALID;
+
+            return data.gattiface->client->write_characteristic(dev->conn_id,
+                                                           &dev->chars[id].s,
+                                                           &dev->chars[id].c,
+                                                           req->op - 1,
+                                                           req->len, req->auth,
+                                                           req->value);
+
+        case 7: /* Write descriptor with prepare write */
+            dev->write_prepared = 1;
+            dev->prep_write_type = BLE_GATT_ELEM_DESCRIPTOR;
+            dev->prep_write_id = id;
+            /* pass-through */
+
+        case 5: /* Write descriptor with write command */
+        case 6: /* Write descriptor with write request */
+            if (id >= dev->desc_count)
+                return BT_STATUS_PARM_INVALID;
+
+            return data.gattiface->client->write_descriptor(dev->conn_id,
+                                                        &dev->descs[id].c.s,
+                                                        &dev->descs[id].c.c,
+                                                        &dev->descs[id].d,
+                                                        req->op - 4, req->len,
+                                                        req->auth, req->value);
+
+        case 8:
+            if (!req->execute) /* Cancel prepared write */
+                dev->write_prepared = 0;
+            return data.gattiface->client->execute_write(dev->conn_id,
+                                                         req->execute);
+    }
+
+    return BT_STATUS_UNSUPPORTED;
+}
+
+/* Send a queued request to the stack */
+static bt_status_t gatt_req_issue(ble_device_t *dev, ble_gatt_req_t *req) {
+    req->issued = 1;
+
+    switch (req->type) {
+        case GATT_REQ_WRITE_LONG:
+            if (req->id >= dev->char_count)
+                return BT_STATUS_PARM_INVALID;
+
+            /* The stack turns a write request larger than the ATT payload into
+             * a sequence of prepare writes, checking each echoed segment, and
+             * a final execute write */
+            return data.gattiface->client->write_characteristic(dev->conn_id,
+                                                      &dev->chars[req->id].s,
+                                                      &dev->chars[req->id].c,
+                                                      GATT_WRITE_REQ,
+                                                      req->len, req->auth,
+                                                      req->value);
+
+        case GATT_REQ_STREAM:
+            if (req->id >= dev->char_count)
+                return BT_STATUS_PARM_INVALID;
+
+            req->start_ms = req->report_ms = now_ms();
+            return stream_fill(dev, req);
+
+        case GATT_REQ_WRITE_CCC:
+            if (req->id >= dev->desc_count)
+                return BT_STATUS_PARM_INVALID;
+
+            return data.gattiface->client->write_descriptor(dev->conn_id,
+                                                      &dev->descs[req->id].c.s,
+                                                      &dev->descs[req->id].c.c,
+                                                      &dev->descs[req->id].d,
+                                                      GATT_WRITE_REQ,
+                                                      req->len, 0, req->value);
+
+        case GATT_REQ_READ_MANY:
+            return read_many_next(dev, req);
+
+        case GATT_REQ_READ_CHAR:
+        case GATT_REQ_READ_DESC:
+        case GATT_REQ_WRITE_CHAR:
+        case GATT_REQ_WRITE_DESC:
+        case GATT_REQ_EXECUTE:
+            return gatt_op_issue(dev, req);
+    }
+
+    return BT_STATUS_UNSUPPORTED;
+}
+
+static void ccc_written(ble_device_t *dev, ble_gatt_req_t *req, int status);
+
+static void gatt_req_free(ble_gatt_req_t *req) {
+    free(req->ids);
+    free(req->value);
+    free(req);
+}
+
+/* Report the result of a queued request and free it. Single reads and writes
+ * only get here when they fail without a response from the stack. */
+static void gatt_req_complete(ble_device_t *dev, ble_gatt_req_t *req,
+                              int status) {
+    switch (req->type) {
+        case GATT_REQ_WRITE_LONG:
+        case GATT_REQ_WRITE_CHAR:
+            if (data.cbs.char_write_cb)
+                data.cbs.char_write_cb(dev->conn_id, req->id, NULL, 0, 0,
+                                       status);
+            break;
+
+        case GATT_REQ_READ_CHAR:
+            if (data.cbs.char_read_cb)
+                data.cbs.char_read_cb(dev->conn_id, req->id, NULL, 0, 0,
+                                      status);
+            break;
+
+        case GATT_REQ_READ_DESC:
+            if (data.cbs.desc_read_cb)
+                data.cbs.desc_read_cb(dev->conn_id, req->id, NULL, 0, 0,
+                                      status);
+            break;
+
+        case GATT_REQ_WRITE_DESC:
+            if (data.cbs.desc_write_cb)
+                data.cbs.desc_write_cb(dev->conn_id, req->id, NULL, 0, 0,
+                                       status);
+            break;
+
+        case GATT_REQ_EXECUTE:
+            if (!dev->write_prepared)
+                break;
+            if (dev->prep_write_type == BLE_GATT_ELEM_CHARACTERISTIC &&
+                data.cbs.char_write_cb)
+                data.cbs.char_write_cb(dev->conn_id, dev->prep_write_id, NULL,
+                                       0, 0, status);
+            else if (dev->prep_write_type == BLE_GATT_ELEM_DESCRIPTOR &&
+                     data.cbs.desc_write_cb)
+                data.cbs.desc_write_cb(dev->conn_id, dev->prep_write_id, NULL,
+                                       0, 0, status);
+            break;
+
+        case GATT_REQ_STREAM:
+            if (req->stream_cb)
+                req->stream_cb(dev->conn_id, req->id, req->acked, req->len,
+                               stream_rate(req), status);
+            break;
+
+        case GATT_REQ_WRITE_CCC:
+            ccc_written(dev, req, status);
+            break;
+
+        case GATT_REQ_READ_MANY:
+            /* Every read was issued, and failed reads have their status */
+            if (status == BT_STATUS_DONE)
+                status = 0;
+
+            while (req->idx < req->count)
+                read_many_store(req, status, 0, NULL, 0);
+
+            if (req->read_cb)
+                req->read_cb(dev->conn_id,
+                             (ble_gatt_read_result_t *) req->value,
+                             req->count, (uint8_t *) req->value +
+                             req->count * sizeof(ble_gatt_read_result_t),
+                             status);
+            break;
+    }
+
+    gatt_req_free(req);
+}
+
+/* Remove the request at the head of the queue */
+static ble_gatt_req_t *gatt_req_pop(ble_device_t *dev) {
+    ble_gatt_req_t *req;
+
+    pthread_mutex_lock(&req_lock);
+    req = dev->reqs;
+    if (req)
+        dev->reqs = req->next;
+    pthread_mutex_unlock(&req_lock);
+
+    return req;
+}
+
+/* Issue the request at the head of the queue, failing the ones the stack
+ * refuses, until one is in flight or the queue is empty */
+static void gatt_req_run(ble_device_t *dev) {
+    ble_gatt_req_t *req;
+    bt_status_t s;
+
+    for (;;) {
+        pthread_mutex_lock(&req_lock);
+        req = dev->reqs;
+        if (!req)
+            dev->req_running = 0;
+        pthread_mutex_unlock(&req_lock);
+
+        if (!req)
+            return;
+
+        s = gatt_req_issue(dev, req);
+        if (s == BT_STATUS_SUCCESS)
+            return;
+
+        /* A stream partly sent may have been finished by its completions */
+        pthread_mutex_lock(&req_lock);
+        if (dev->reqs == req)
+            dev->reqs = req->next;
+        else
+            req = NULL;
+        pthread_mutex_unlock(&req_lock);
+
+        if (!req)
+            return;
+
+        gatt_req_complete(dev, req, s);
+    }
+}
+
+/* Append a request to the queue of a device, issuing it if the queue is idle */
+static void gatt_req_push(ble_device_t *dev, ble_gatt_req_t *req) {
+    ble_gatt_req_t **p;
+    uint8_t start;
+
+    pthread_mutex_lock(&req_lock);
+    for (p = &dev->reqs; *p; p = &(*p)->next);
+    *p = req;
+    start = !dev->req_running;
+    dev->req_running = 1;
+    pthread_mutex_unlock(&req_lock);
+
+    if (start)
+        gatt_req_run(dev);
+}
+
+/* Whether a stack response belongs to the request in flight */
+static int gatt_req_match(ble_device_t *dev, gatt_req_type_t type, int id) {
+    ble_gatt_req_t *req;
+    int match;
+
+    pthread_mutex_lock(&req_lock);
+    req = dev->reqs;
+    match = req && req->issued && req->type == type && req->id == id;
+    pthread_mutex_unlock(&req_lock);
+
+    return match;
+}
+
+/* Finish the request in flight and issue the next one */
+static void gatt_req_finish(ble_device_t *dev, int status) {
+    ble_gatt_req_t *req;
+
+    req = gatt_req_pop(dev);
+    if (req)
+        gatt_req_complete(dev, req, status);
+
+    gatt_req_run(dev);
+}
+
+/* Remove the request in flight, whose result the stack callback reported, and
+ * issue the next one */
+static void gatt_req_done(ble_device_t *dev) {
+    ble_gatt_req_t *req;
+
+    req = gatt_req_pop(dev);
+    if (req)
+        gatt_req_free(req);
+
+    gatt_req_run(dev);
+}
+
+/* Fail all requests queued on a device */
+static void gatt_req_flush(ble_device_t *dev, int status) {
+    ble_gatt_req_t *req;
+
+    while ((req = gatt_req_pop(dev)))
+        gatt_req_complete(dev, req, status);
+
+    pthread_mutex_lock(&req_lock);
+    dev->req_running = 0;
+    pthread_mutex_unlock(&req_lock);
+}
+
+/* Called when a write command of the stream in flight completes: every
+ * completion gives back a credit for the next chunk. The stream stays at the
+ * head of the queue until it is finished from the stack callback thread, and
+ * only this thread sends chunks once the first ones are sent. */
+static void stream_ack(ble_device_t *dev, int status) {
+    ble_gatt_req_t *req;
+    bt_status_t s;
+    uint64_t now;
+    uint8_t done;
+
+    pthread_mutex_lock(&req_lock);
+
+    /* The first chunks may still be being sent by the application thread,
+     * which fails the stream if the stack refuses one */
+    for (;;) {
+        req = dev->reqs;
+        if (!req || !req->issued || req->type != GATT_REQ_STREAM) {
+            pthread_mutex_unlock(&req_lock);
+            return;
+        }
+        if (!req->filling)
+            break;
+        pthread_cond_wait(&req_idle, &req_lock);
+    }
+
+    req->in_flight--;
+    req->acked += req->chunk;
+    if (req->acked > req->sent)
+        req->acked = req->sent;
+    done = req->acked == req->len;
+    pthread_mutex_unlock(&req_lock);
+
+    if (status != 0) {
+        gatt_req_finish(dev, status);
+        return;
+    }
+
+    if (done) {
+        gatt_req_finish(dev, 0);
+        return;
+    }
+
+    s = stream_fill(dev, req);
+    if (s != BT_STATUS_SUCCESS) {
+        gatt_req_finish(dev, s);
+        return;
+    }
+
+    now = now_ms();
+    if (req->stream_cb && now - req->report_ms >= STREAM_REPORT_INTERVAL) {
+        req->report_ms = now;
+        req->stream_cb(dev->conn_id, req->id, req->acked, req->len,
+                       stream_rate(req), 0);
+    }
+}
+
+/* Called when a GATT write characteristic operation returns */
+static void write_characteristic_cb(int conn_id, int status,
+                                    btgatt_write_params_t *p_data) {
+    ble_device_t *dev;
+    int id = -1;
+
+    dev = find_device_by_conn_id(conn_id);
+    if (dev)
+        id = find_characteristic(dev, &p_data->srvc_id, &p_data->char_id);
+
+    if (dev && gatt_req_match(dev, GATT_REQ_WRITE_LONG, id)) {
+        gatt_req_finish(dev, status);
+        return;
+    }
+
+    if (dev && gatt_req_match(dev, GATT_REQ_STREAM, id)) {
+        stream_ack(dev, status);
+        return;
+    }
+
+    if (data.cbs.char_write_cb)
+        data.cbs.char_write_cb(conn_id, id, NULL, 0, 0, status);
+
+    if (dev && gatt_req_match(dev, GATT_REQ_WRITE_CHAR, id))
+        gatt_req_done(dev);
+}
+
+/* Called when a GATT write descriptor operation returns */
+static void write_descriptor_cb(int conn_id, int status,
+                                btgatt_write_params_t *p_data) {
+    ble_device_t *dev;
+    int id = -1;
+
+    dev = find_device_by_conn_id(conn_id);
+    if (dev)
+        id = find_descriptor(dev, &p_data->srvc_id, &p_data->char_id,
+                             &p_data->descr_id);
+
+    if (dev && gatt_req_match(dev, GATT_REQ_WRITE_CCC, id)) {
+        gatt_req_finish(dev, status);
+        return;
+    }
+
+    if (data.cbs.desc_write_cb)
+        data.cbs.desc_write_cb(conn_id, id, NULL, 0, 0, status);
+
+    if (dev && gatt_req_match(dev, GATT_REQ_WRITE_DESC, id))
+        gatt_req_done(dev);
+}
+
+static void execute_write_cb(int conn_id, int status) {
+    ble_device_t *dev;
+
+    dev = find_device_by_conn_id(conn_id);
+    if (!dev)
+        return;
+
+    if (dev->write_prepared) {
+        if (dev->prep_write_type == BLE_GATT_ELEM_CHARACTERISTIC &&
+            data.cbs.char_write_cb)
+            data.cbs.char_write_cb(conn_id, dev->prep_write_id, NULL, 0, 0,
+                                   status);
+        else if (dev->prep_write_type == BLE_GATT_ELEM_DESCRIPTOR &&
+            data.cbs.desc_write_cb)
+            data.cbs.desc_write_cb(conn_id, dev->prep_write_id, NULL, 0, 0,
+                                   status);
+    }
+
+    if (gatt_req_match(dev, GATT_REQ_EXECUTE, -1))
+        gatt_req_done(dev);
+}
+
+static int ble_gatt_op(int operation, int conn_id, int id, int auth,
+                       const char *value, int len) {
+    static const gatt_req_type_t types[] = {
+        GATT_REQ_READ_CHAR, GATT_REQ_READ_DESC, GATT_REQ_WRITE_CHAR,
+        GATT_REQ_WRITE_CHAR, GATT_REQ_WRITE_CHAR, GATT_REQ_WRITE_DESC,
+        GATT_REQ_WRITE_DESC, GATT_REQ_WRITE_DESC, GATT_REQ_EXECUTE
+    };
+    ble_gatt_req_t *req;
+    ble_device_t *dev;
+
+    if (id < 0)
+        return -1;
+
+    if (conn_id <= 0)
+        return -1;
+
+    if (!data.gattiface)
+        return -1;
+
+    dev = find_device_by_conn_id(conn_id);
+    if (!dev)
+        return -1;
+
+    switch (types[operation]) {
+        case GATT_REQ_READ_CHAR:
+        case GATT_REQ_WRITE_CHAR:
+            if (id >= dev->char_count)
+                return -1;
+            break;
+        case GATT_REQ_READ_DESC:
+        case GATT_REQ_WRITE_DESC:
+            if (id >= dev->desc_count)
+                return -1;
+            break;
+        default:
+            break;
+    }
+
+    req = calloc(1, sizeof(ble_gatt_req_t));
+    if (!req)
+        return -1;
+
+    if (len > 0) {
+        req->value = malloc(len);
+        if (!req->value) {
+            free(req);
+            return -1;
+        }
+        memcpy(req->value, value, len);
+        req->len = len;
+    }
+
+    /* The response to an execute write names no element */
+    req->type = types[operation];
+    req->op = operation;
+    req->id = req->type == GATT_REQ_EXECUTE ? -1 : id;
+    req->execute = req->type == GATT_REQ_EXECUTE && id;
+    req->auth = auth;
+
+    gatt_req_push(dev, req);
+
+    return 0;
+}
+
+int ble_gatt_read_char(int conn_id, int char_id, int auth) {
+    return ble_gatt_op(0, conn_id, char_id, auth, NULL, 0);
+}
+
+int ble_gatt_read_desc(int conn_id, int desc_id, int auth) {
+    return ble_gatt_op(1, conn_id, desc_id, auth, NULL, 0);
+}
+
+int ble_gatt_write_cmd_char(int conn_id, int char_id, int auth,
+                            const char *value, int len) {
+    return ble_gatt_op(2, conn_id, char_id, auth, value, len);
+}
+
+int ble_gatt_write_req_char(int conn_id, int char_id, int auth,
+                            const char *value, int len) {
+    return ble_gatt_op(3, conn_id, char_id, auth, value, len);
+}
+
+int ble_gatt_write_cmd_desc(int conn_id, int desc_id, int auth,
+                            const char *value, int len) {
+    return ble_gatt_op(5, conn_id, desc_id, auth, value, len);
+}
+
+int ble_gatt_write_req_desc(int conn_id, int desc_id, int auth,
+                            const char *value, int len) {
+    return ble_gatt_op(6, conn_id, desc_id, auth, value, len);
+}
+
+int ble_gatt_prep_write_char(int conn_id, int char_id, int auth,
+                             const char *value, int len) {
+    return ble_gatt_op(4, conn_id, char_id, auth, value, len);
+}
+
+int ble_gatt_prep_write_desc(int conn_id, int desc_id, int auth,
+                             const char *value, int len) {
+    return ble_gatt_op(7, conn_id, desc_id, auth, value, len);
+}
+
+int ble_gatt_execute_write(int conn_id, int execute) {
+    return ble_gatt_op(8, conn_id, execute, 0, NULL, 0);
+}
+
+int ble_gatt_write_long(int conn_id, int char_id, int auth, const char *value,
+                        int len) {
+    ble_device_t *dev;
+    ble_gatt_req_t *req;
+
+    if (char_id < 0)
+        return -1;
+
+    if (conn_id <= 0)
+        return -1;
+
+    if (!data.gattiface)
+        return -1;
+
+    if (!value || len <= 0 || len > ATT_MAX_VALUE_LEN)
+        return -1;
+
+    dev = find_device_by_conn_id(conn_id);
+    if (!dev)
+        return -1;
+
+    if (dev->char_count <= 0 || char_id >= dev->char_count)
+        return -1;
+
+    req = calloc(1, sizeof(ble_gatt_req_t));
+    if (!req)
+        return -1;
+
+    req->value = malloc(len);
+    if (!req->value) {
+        free(req);
+        return -1;
+    }
+
+    req->type = GATT_REQ_WRITE_LONG;
+    req->id = char_id;
+    req->auth = auth;
+    req->len = len;
+    memcpy(req->value, value, len);
+
+    gatt_req_push(dev, req);
+
+    return 0;
+}
+
+int ble_gatt_stream_write(int conn_id, int char_id, const char *buffer,
+                          int len, int chunk, ble_gatt_stream_cb_t cb) {
+    ble_device_t *dev;
+    ble_gatt_req_t *req;
+    int max_chunk;
+
+    if (char_id < 0)
+        return -1;
+
+    if (conn_id <= 0)
+        return -1;
+
+    if (!data.gattiface)
+        return -1;
+
+    if (!buffer || len <= 0)
+        return -1;
+
+    dev = find_device_by_conn_id(conn_id);
+    if (!dev)
+        return -1;
+
+    if (dev->char_count <= 0 || char_id >= dev->char_count)
+        return -1;
+
+    max_chunk = payload_size(dev);
+    if (chunk <= 0 || chunk > max_chunk)
+        chunk = max_chunk;
+
+    req = calloc(1, sizeof(ble_gatt_req_t));
+    if (!req)
+        return -1;
+
+    req->value = malloc(len);
+    if (!req->value) {
+        free(req);
+        return -1;
+    }
+
+    req->type = GATT_REQ_STREAM;
+    req->id = char_id;
+    req->len = len;
+    req->chunk = chunk;
+    req->stream_cb = cb;
+    memcpy(req->value, buffer, len);
+
+    gatt_req_push(dev, req);
+
+    return 0;
+}
+
+/* Queue a batch of reads. Invalid ids fail their own read only. */
+static int read_many_push(ble_device_t *dev, const int *ids, int count,
+                          int auth, ble_gatt_read_many_cb_t cb) {
+    ble_gatt_req_t *req;
+
+    req = calloc(1, sizeof(ble_gatt_req_t));
+    if (!req)
+        return -1;
+
+    req->size = count * sizeof(ble_gatt_read_result_t);
+    req->value = malloc(req->size);
+    req->ids = malloc(count * sizeof(int));
+    if (!req->value || !req->ids) {
+        free(req->value);
+        free(req->ids);
+        free(req);
+        return -1;
+    }
+
+    req->type = GATT_REQ_READ_MANY;
+    req->id = -1;
+    req->auth = auth;
+    req->len = req->size;
+    req->count = count;
+    req->read_cb = cb;
+    memcpy(req->ids, ids, count * sizeof(int));
+
+    gatt_req_push(dev, req);
+
+    return 0;
+}
+
+int ble_gatt_read_many(int conn_id, const int *ids, int count, int auth,
+                       ble_gatt_read_many_cb_t cb) {
+    ble_device_t *dev;
+    int i;
+
+    if (conn_id <= 0)
+        return -1;
+
+    if (!data.gattiface)
+        return -1;
+
+    if (!ids || count <= 0 || !cb)
+        return -1;
+
+    dev = find_device_by_conn_id(conn_id);
+    if (!dev)
+        return -1;
+
+    for (i = 0; i < count; i++)
+        if (ids[i] < 0 || ids[i] >= dev->char_count)
+            return -1;
+
+    return read_many_push(dev, ids, count, auth, cb);
+}
+
+/* Report the devices that failed and the end of the sweep, once sweep.lock
+ * is released */
+static void sweep_flush(void) {
+    uint8_t address[6];
+    uint64_t elapsed;
+    int attempts, done, failed, rate = 0;
+    ble_sweep_done_cb_t done_cb;
+    ble_sweep_entry_t *e;
+
+    conn_sched_run();
+
+    for (;;) {
+        pthread_mutex_lock(&sweep.lock);
+        if (!sweep.running || !sweep.r_len)
+            break;
+
+        e = &sweep.entries[sweep.reports[--sweep.r_len]];
+        memcpy(address, e->address, sizeof(address));
+        attempts = e->attempts;
+        pthread_mutex_unlock(&sweep.lock);
+
+        if (sweep.cb)
+            sweep.cb(address, NULL, 0, NULL, attempts, -1);
+    }
+
+    if (!sweep.running || sweep.active > 0 || sweep.q_len > 0) {
+        pthread_mutex_unlock(&sweep.lock);
+        return;
+    }
+
+    timer_disarm(&sweep.timer);
+    sweep.running = 0;
+    free(sweep.entries);
+    free(sweep.queue);
+    free(sweep.reports);
+    free(sweep.chars);
+    sweep.entries = NULL;
+    sweep.queue = NULL;
+    sweep.reports = NULL;
+    sweep.chars = NULL;
+
+    done = sweep.done;
+    failed = sweep.failed;
+    done_cb = sweep.done_cb;
+    elapsed = now_ms() - sweep.start_ms;
+    if (elapsed)
+        rate = (uint64_t) done * 60000 / elapsed;
+
+    pthread_mutex_unlock(&sweep.lock);
+
+    if (done_cb)
+        done_cb(done, failed, rate);
+}
+
+/* Account a failed attempt, queueing the device again if it has retries
+ * left. Must hold sweep.lock. */
+static void sweep_attempt_failed(ble_sweep_entry_t *e) {
+    if (e->dev) {
+        /* The connection may still complete */
+        if (e->state == SWEEP_CONNECTING)
+            e->dev->sweep_dropped = 1;
+        e->dev->sweep = NULL;
+    }
+    e->dev = NULL;
+
+    if (e->state != SWEEP_PENDING)
+        sweep.active--;
+
+    if (e->attempts <= sweep.retries && sweep.q_len < sweep.count &&
+        sweep.queue) {
+        e->state = SWEEP_PENDING;
+        sweep.queue[(sweep.q_head + sweep.q_len++) % sweep.count] =
+                                                            e - sweep.entries;
+        return;
+    }
+
+    e->state = SWEEP_FAILED;
+    sweep.failed++;
+    sweep.reports[sweep.r_len++] = e - sweep.entries;
+}
+
+/* Free the link of a device whose characteristics have been read. Must hold
+ * sweep.lock. */
+static void sweep_release(ble_sweep_entry_t *e) {
+    e->state = SWEEP_DONE;
+    e->dev->sweep = NULL;
+    e->dev = NULL;
+    sweep.active--;
+}
+
+/* Arm the timer for the earliest deadline. Must hold sweep.lock. */
+static void sweep_arm(void) {
+    uint64_t next = 0;
+    int i;
+
+    for (i = 0; i < sweep.count; i++) {
+        ble_sweep_entry_t *e = &sweep.entries[i];
+
+        if (e->state == SWEEP_PENDING || e->state == SWEEP_CONNECTING ||
+            e->state == SWEEP_DONE || e->state == SWEEP_FAILED)
+            continue;
+
+        if (!next || e->deadline < next)
+            next = e->deadline;
+    }
+
+    if (next)
+        timer_arm(&sweep.timer, next);
+    else
+        timer_disarm(&sweep.timer);
+}
+
+/* Start connecting to the next devices while links are available. Failures
+ * to connect are retried right away. Must hold sweep.lock. */
+static void sweep_fill(void) {
+    ble_sweep_entry_t *e;
+    ble_device_t *dev;
+
+    while (sweep.running && sweep.active < sweep.max_links &&
+           sweep.q_len > 0) {
+        e = &sweep.entries[sweep.queue[sweep.q_head]];
+        sweep.q_head = (sweep.q_head + 1) % sweep.count;
+        sweep.q_len--;
+
+        e->attempts++;
+        e->state = SWEEP_CONNECTING;
+        e->ok = 0;
+        sweep.active++;
+
+        dev = get_device(e->address);
+        if (!dev || dev->sweep) {
+            sweep_attempt_failed(e);
+            continue;
+        }
+
+        e->dev = dev;
+        dev->sweep = e;
+        dev->sweep_dropped = 0;
+
+        /* The connection scheduler times the attempt out. Connections are
+         * issued by sweep_flush(), once sweep.lock is released. */
+        if (conn_sched_push(dev, SWEEP_PRIORITY, sweep.timeout) != 0)
+            sweep_attempt_failed(e);
+    }
+
+    sweep_arm();
+}
+
+/* Disconnect a device of the sweep. Must hold sweep.lock. */
+static void sweep_close(ble_sweep_entry_t *e) {
+    bt_status_t s;
+
+    e->state = SWEEP_CLOSING;
+    e->deadline = now_ms() + sweep.timeout;
+
+    s = data.gattiface->client->disconnect(data.client, &e->dev->bda,
+                                           e->dev->conn_id);
+    if (s != BT_STATUS_SUCCESS)
+        sweep_attempt_failed(e);
+}
+
+static void sweep_connected(ble_device_t *dev, int status) {
+    ble_sweep_entry_t *e;
+    bt_status_t s;
+
+    pthread_mutex_lock(&sweep.lock);
+
+    e = dev->sweep;
+    if (!e || e->state != SWEEP_CONNECTING) {
+        pthread_mutex_unlock(&sweep.lock);
+        return;
+    }
+
+    if (status != 0) {
+        sweep_attempt_failed(e);
+    } else {
+        e->state = SWEEP_DISCOVERING;
+        e->deadline = now_ms() + sweep.timeout;
+
+        s = data.gattiface->client->search_service(dev->conn_id,
+                                    sweep.has_service ? &sweep.service : NULL);
+        if (s != BT_STATUS_SUCCESS)
+            sweep_close(e);
+    }
+
+    sweep_fill();
+
+    pthread_mutex_unlock(&sweep.lock);
+
+    sweep_flush();
+}
+
+/* Drop a link completing after the sweep gave up connecting to the device,
+ * if nothing else requested it. Returns whether the link was dropped. */
+static int sweep_late(ble_device_t *dev, int conn_id, int status) {
+    int late;
+
+    pthread_mutex_lock(&sweep.lock);
+    late = dev->sweep_dropped && !dev->sweep;
+    dev->sweep_dropped = 0;
+    pthread_mutex_unlock(&sweep.lock);
+
+    if (!late || status != 0)
+        return late;
+
+    /* Its disconnection is not reported either */
+    pthread_mutex_lock(&conn_sched.lock);
+    dev->conn_cancelled = 1;
+    pthread_mutex_unlock(&conn_sched.lock);
+
+    data.gattiface->client->disconnect(data.client, &dev->bda, conn_id);
+
+    return 1;
+}
+
+static void sweep_disconnected(ble_device_t *dev) {
+    ble_sweep_entry_t *e;
+
+    pthread_mutex_lock(&sweep.lock);
+
+    e = dev->sweep;
+    if (!e) {
+        pthread_mutex_unlock(&sweep.lock);
+        return;
+    }
+
+    if (e->ok)
+        sweep_release(e);
+    else
+        sweep_attempt_failed(e);
+
+    sweep_fill();
+
+    pthread_mutex_unlock(&sweep.lock);
+
+    sweep_flush();
+}
+
+/* Called when all the reads of a device of the sweep complete */
+static void sweep_read_cb(int conn_id, const ble_gatt_read_result_t *results,
+                          int count, const uint8_t *values, int status) {
+    ble_device_t *dev;
+    ble_sweep_entry_t *e;
+    int attempts;
+
+    /* Aborted by a disconnection, which retries the device */
+    if (status != 0)
+        return;
+
+    dev = find_device_by_conn_id(conn_id);
+    if (!dev)
+        return;
+
+    pthread_mutex_lock(&sweep.lock);
+    e = dev->sweep;
+    if (!e || e->state != SWEEP_READING) {
+        pthread_mutex_unlock(&sweep.lock);
+        return;
+    }
+    e->ok = 1;
+    sweep.done++;
+    attempts = e->attempts;
+    pthread_mutex_unlock(&sweep.lock);
+
+    if (sweep.cb)
+        sweep.cb(dev->bda.address, results, count, values, attempts, 0);
+
+    pthread_mutex_lock(&sweep.lock);
+    if (dev->sweep == e)
+        sweep_close(e);
+    pthread_mutex_unlock(&sweep.lock);
+
+    sweep_flush();
+}
+
+/* Find the characteristics of the sweep on a device and read them */
+static void sweep_read(ble_device_t *dev, ble_sweep_entry_t *e) {
+    int *ids, i, j;
+
+    ids = malloc(sweep.char_count * sizeof(int));
+    if (!ids) {
+        sweep_close(e);
+        return;
+    }
+
+    for (i = 0; i < sweep.char_count; i++) {
+        ids[i] = -1;
+        for (j = 0; j < dev->char_count; j++)
+            if (!memcmp(&dev->chars[j].c.uuid, &sweep.chars[i],
+                        sizeof(bt_uuid_t)) &&
+                (!sweep.has_service ||
+                 !memcmp(&dev->chars[j].s.id.uuid, &sweep.service,
+                         sizeof(bt_uuid_t)))) {
+                ids[i] = j;
+                break;
+            }
+    }
+
+    e->state = SWEEP_READING;
+
+    /* Completion is reported through sweep_read_cb(), which takes the lock */
+    pthread_mutex_unlock(&sweep.lock);
+    i = read_many_push(dev, ids, sweep.char_count, 0, sweep_read_cb);
+    pthread_mutex_lock(&sweep.lock);
+
+    free(ids);
+
+    if (i < 0 && dev->sweep == e)
+        sweep_close(e);
+}
+
+/* Request the characteristics of the next service of a device of the sweep,
+ * or read them once all are known. Must hold sweep.lock. */
+static void sweep_next_service(ble_device_t *dev, ble_sweep_entry_t *e) {
+    bt_status_t s;
+
+    for (; e->srvc_idx < dev->srvc_count; e->srvc_idx++) {
+        if (sweep.has_service &&
+            memcmp(&dev->srvcs[e->srvc_idx].id.uuid, &sweep.service,
+                   sizeof(bt_uuid_t)))
+            continue;
+
+        s = data.gattiface->client->get_characteristic(dev->conn_id,
+                                                    &dev->srvcs[e->srvc_idx],
+                                                    NULL);
+        if (s == BT_STATUS_SUCCESS)
+            return;
+    }
+
+    sweep_read(dev, e);
+}
+
+static void sweep_services_finished(ble_device_t *dev, int status) {
+    ble_sweep_entry_t *e;
+
+    pthread_mutex_lock(&sweep.lock);
+
+    e = dev->sweep;
+    if (e && e->state == SWEEP_DISCOVERING) {
+        if (status != 0) {
+            sweep_close(e);
+        } else {
+            e->srvc_idx = 0;
+            sweep_next_service(dev, e);
+        }
+    }
+
+    sweep_fill();
+
+    pthread_mutex_unlock(&sweep.lock);
+
+    sweep_flush();
+}
+
+static void sweep_chars_finished(ble_device_t *dev, btgatt_srvc_id_t *srvc_id) {
+    ble_sweep_entry_t *e;
+
+    pthread_mutex_lock(&sweep.lock);
+
+    e = dev->sweep;
+    if (e && e->state == SWEEP_DISCOVERING && e->srvc_idx < dev->srvc_count &&
+        (!srvc_id || !memcmp(&dev->srvcs[e->srvc_idx], srvc_id,
+                             sizeof(btgatt_srvc_id_t)))) {
+        e->srvc_idx++;
+        sweep_next_service(dev, e);
+    }
+
+    sweep_fill();
+
+    pthread_mutex_unlock(&sweep.lock);
+
+    sweep_flush();
+}
+
+/* Called on the timer thread to abort the attempts that took too long */
+static void sweep_timer_cb(void *arg) {
+    ble_sweep_entry_t *e;
+    uint64_t now;
+    int i, found;
+
+    do {
+        found = 0;
+        now = now_ms();
+
+        pthread_mutex_lock(&sweep.lock);
+
+        for (i = 0; sweep.running && i < sweep.count; i++) {
+            e = &sweep.entries[i];
+
+            if (e->state == SWEEP_PENDING || e->state == SWEEP_CONNECTING ||
+                e->state == SWEEP_DONE || e->state == SWEEP_FAILED ||
+                e->deadline > now)
+                continue;
+
+            found = 1;
+            if (e->state == SWEEP_CLOSING) {
+                if (e->ok)
+                    sweep_release(e);
+                else
+                    sweep_attempt_failed(e);
+            } else
+                sweep_close(e);
+            break;
+        }
+
+        sweep_fill();
+
+        pthread_mutex_unlock(&sweep.lock);
+
+        sweep_flush();
+    } while (found);
+}
+
+int ble_sweep_start(const uint8_t *addresses, int count,
+                    const ble_sweep_params_t *params, ble_sweep_cb_t cb,
+                    ble_sweep_done_cb_t done_cb) {
+    int i;
+
+    if (!data.client || !data.gattiface || !data.adapter_state)
+        return -1;
+
+    if (!addresses || count <= 0 || !params || !cb)
+        return -1;
+
+    if (!params->chars || params->char_count <= 0 || params->max_links <= 0 ||
+        params->timeout <= 0 || params->retries < 0)
+        return -1;
+
+    pthread_mutex_lock(&sweep.lock);
+
+    if (sweep.running) {
+        pthread_mutex_unlock(&sweep.lock);
+        return 1;
+    }
+
+    sweep.entries = calloc(count, sizeof(ble_sweep_entry_t));
+    sweep.queue = malloc(count * sizeof(int));
+    sweep.reports = malloc(count * sizeof(int));
+    sweep.chars = malloc(params->char_count * sizeof(bt_uuid_t));
+    if (!sweep.entries || !sweep.queue || !sweep.reports || !sweep.chars) {
+        free(sweep.entries);
+        free(sweep.queue);
+        free(sweep.reports);
+        free(sweep.chars);
+        sweep.entries = NULL;
+        sweep.queue = NULL;
+        sweep.reports = NULL;
+        sweep.chars = NULL;
+        pthread_mutex_unlock(&sweep.lock);
+        return -1;
+    }
+
+    for (i = 0; i < count; i++) {
+        memcpy(sweep.entries[i].address, addresses + i * 6, 6);
+        sweep.queue[i] = i;
+    }
+
+    for (i = 0; i < params->char_count; i++)
+        memcpy(sweep.chars[i].uu, params->chars + i * 16, 16);
+
+    sweep.has_service = params->service != NULL;
+    if (params->service)
+        memcpy(sweep.service.uu, params->service, 16);
+
+    sweep.count = count;
+    sweep.q_head = 0;
+    sweep.q_len = count;
+    sweep.r_len = 0;
+    sweep.char_count = params->char_count;
+    sweep.max_links = params->max_links;
+    sweep.timeout = params->timeout;
+    sweep.retries = params->retries;
+    sweep.active = 0;
+    sweep.done = 0;
+    sweep.failed = 0;
+    sweep.start_ms = now_ms();
+    sweep.cb = cb;
+    sweep.done_cb = done_cb;
+    sweep.timer.cb = sweep_timer_cb;
+    sweep.timer.arg = NULL;
+    sweep.running = 1;
+
+    sweep_fill();
+
+    pthread_mutex_unlock(&sweep.lock);
+
+    sweep_flush();
+
+    return 0;
+}
+
+/* End the sweep without waiting for the devices being handled, once their
+ * links are gone. They are reported as failed. */
+static void sweep_abort(void) {
+    ble_sweep_entry_t *e;
+    int i;
+
+    pthread_mutex_lock(&sweep.lock);
+
+    if (!sweep.running) {
+        pthread_mutex_unlock(&sweep.lock);
+        return;
+    }
+
+    sweep.q_len = 0;
+    sweep.retries = 0;
+    for (i = 0; i < sweep.count; i++) {
+        e = &sweep.entries[i];
+        if (e->state != SWEEP_PENDING && e->state != SWEEP_DONE &&
+            e->state != SWEEP_FAILED)
+            sweep_attempt_failed(e);
+    }
+
+    pthread_mutex_unlock(&sweep.lock);
+
+    sweep_flush();
+}
+
+int ble_sweep_stop(void) {
+    pthread_mutex_lock(&sweep.lock);
+
+    if (!sweep.running) {
+        pthread_mutex_unlock(&sweep.lock);
+        return -1;
+    }
+
+    /* Devices being handled finish, but are not retried */
+    sweep.q_len = 0;
+    sweep.retries = 0;
+
+    pthread_mutex_unlock(&sweep.lock);
+
+    sweep_flush();
+
+    return 0;
 }
 
-/* Called for each service discovery result */
-void service_discovery_result_cb(int conn_id, btgatt_srvc_id_t *srvc_id) {
-    int id;
+int ble_gatt_stream_set_credits(int credits) {
+    if (credits <= 0 || credits > STREAM_MAX_CREDITS)
+        return -1;
+
+    data.stream_credits = credits;
+
+    return 0;
+}
+
+#ifdef HAVE_GATT_CONFIGURE_MTU
+/* Called when the MTU exchange with a device finishes */
+static void configure_mtu_cb(int conn_id, int status, int mtu) {
     ble_device_t *dev;
 
     dev = find_device_by_conn_id(conn_id);
-    if (!dev)
-        return;
+    if (dev && status == 0)
+        dev->mtu = mtu;
 
-    id = find_service(dev, srvc_id);
-    if (id < 0) {
-        id = dev->srvc_count++;
-        dev->srvcs = realloc(dev->srvcs,
-                             dev->srvc_count * sizeof(btgatt_srvc_id_t));
-        memcpy(&dev->srvcs[id], srvc_id, sizeof(btgatt_srvc_id_t));
+    if (data.cbs.mtu_cb)
+        data.cbs.mtu_cb(conn_id, dev ? dev->mtu : mtu, status);
+}
+#endif
+
+#ifdef HAVE_GATT_CONN_UPDATED_CB
+/* Called when the parameters of a connection change */
+static void conn_updated_cb(int conn_id, int interval, int latency,
+                            int timeout, int status) {
+    ble_device_t *dev;
+
+    dev = find_device_by_conn_id(conn_id);
+    if (dev && status == 0) {
+        dev->conn_interval = interval;
+        dev->conn_latency = latency;
+        dev->conn_timeout = timeout;
     }
 
-    if (data.cbs.srvc_found_cb)
-        data.cbs.srvc_found_cb(conn_id, id, srvc_id->id.uuid.uu,
-                               srvc_id->is_primary);
+    if (data.cbs.conn_params_cb)
+        data.cbs.conn_params_cb(conn_id, interval, latency, timeout, status);
 }
+#endif
 
-int ble_gatt_discover_services(int conn_id, const uint8_t *uuid) {
+int ble_conn_set_params(int conn_id, int min_interval, int max_interval,
+                        int latency, int timeout) {
+#ifdef HAVE_GATT_CONN_PARAMETER_UPDATE
+    ble_device_t *dev;
     bt_status_t s;
-    bt_uuid_t uu, *u = NULL;
 
     if (conn_id <= 0)
         return -1;
@@ -406,42 +6023,73 @@ int ble_gatt_discover_services(int conn_id, const uint8_t *uuid) {
     if (!data.gattiface)
         return -1;
 
-    if (uuid) {
-        memcpy(uu.uu, uuid, 16 * sizeof(uint8_t));
-        u = &uu;
-    }
+    if (min_interval < CONN_MIN_INTERVAL || max_interval > CONN_MAX_INTERVAL ||
+        min_interval > max_interval)
+        return -1;
 
-    s = data.gattiface->client->search_service(conn_id, u);
+    if (latency < 0 || latency > CONN_MAX_LATENCY)
+        return -1;
+
+    if (timeout < CONN_MIN_TIMEOUT || timeout > CONN_MAX_TIMEOUT)
+        return -1;
+
+    /* The supervision timeout must cover two intervals between the events
+     * the slave listens to: timeout * 10 > (1 + latency) * max * 1.25 * 2 */
+    if (timeout * 4 <= (1 + latency) * max_interval)
+        return -1;
+
+    dev = find_device_by_conn_id(conn_id);
+    if (!dev)
+        return -1;
+
+    s = data.gattiface->client->conn_parameter_update(&dev->bda, min_interval,
+                                                      max_interval, latency,
+                                                      timeout);
     if (s != BT_STATUS_SUCCESS)
         return -s;
 
     return 0;
+#else
+    return -1;
+#endif
+}
+
+int ble_conn_set_profile(int conn_id, ble_conn_profile_t profile) {
+    switch (profile) {
+        case BLE_CONN_LOW_LATENCY:
+            return ble_conn_set_params(conn_id, 9, 12, 0, 500);
+        case BLE_CONN_BALANCED:
+            return ble_conn_set_params(conn_id, 24, 40, 0, 500);
+        case BLE_CONN_LOW_POWER:
+            return ble_conn_set_params(conn_id, 80, 100, 2, 500);
+    }
+
+    return -1;
 }
 
-static void get_included_service_cb(int conn_id, int status, btgatt_srvc_id_t *srvc_id, btgatt_srvc_id_t *incl_srvc_id) {
+int ble_conn_get_params(int conn_id, int *interval, int *latency,
+                        int *timeout) {
     ble_device_t *dev;
-    int id;
 
-    if (status != 0)
-        return;
+    if (conn_id <= 0)
+        return -1;
 
     dev = find_device_by_conn_id(conn_id);
     if (!dev)
-        return;
-
-    id = find_service(dev, incl_srvc_id);
-    if (id < 0)
-        return;
+        return -1;
 
-    if (data.cbs.srvc_found_cb)
-        data.cbs.srvc_found_cb(conn_id, id, incl_srvc_id->id.uuid.uu,
-                               incl_srvc_id->is_primary);
+    if (interval)
+        *interval = dev->conn_interval;
+    if (latency)
+        *latency = dev->conn_latency;
+    if (timeout)
+        *timeout = dev->conn_timeout;
 
-    data.gattiface->client->get_included_service(conn_id, srvc_id,
-                                                 incl_srvc_id);
+    return 0;
 }
 
-int ble_gatt_get_included_services(int conn_id, int service_id) {
+int ble_gatt_configure_mtu(int conn_id, int mtu) {
+#ifdef HAVE_GATT_CONFIGURE_MTU
     ble_device_t *dev;
     bt_status_t s;
 
@@ -451,420 +6099,923 @@ int ble_gatt_get_included_services(int conn_id, int service_id) {
     if (!data.gattiface)
         return -1;
 
+    if (mtu < ATT_DEFAULT_MTU || mtu > ATT_MAX_MTU)
+        return -1;
+
     dev = find_device_by_conn_id(conn_id);
     if (!dev)
         return -1;
 
-    if (dev->srvc_count <= 0)
+    s = data.gattiface->client->configure_mtu(conn_id, mtu);
+    if (s != BT_STATUS_SUCCESS)
+        return -s;
+
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+int ble_gatt_get_mtu(int conn_id) {
+    ble_device_t *dev;
+
+    if (conn_id <= 0)
         return -1;
 
-    if (service_id < 0 || service_id >= dev->srvc_count)
+    dev = find_device_by_conn_id(conn_id);
+    if (!dev)
         return -1;
 
-    s = data.gattiface->client->get_included_service(conn_id,
-                                                     &dev->srvcs[service_id],
-                                                     NULL);
-    if (s != BT_STATUS_SUCCESS)
-        return -s;
+    return dev->mtu ? dev->mtu : ATT_DEFAULT_MTU;
+}
 
-    return 0;
+int ble_gatt_get_payload_size(int conn_id) {
+    ble_device_t *dev;
+
+    if (conn_id <= 0)
+        return -1;
+
+    dev = find_device_by_conn_id(conn_id);
+    if (!dev)
+        return -1;
+
+    return payload_size(dev);
 }
 
-static int find_characteristic(ble_device_t *dev, btgatt_srvc_id_t *srvc_id,
-                               btgatt_char_id_t *char_id) {
+int ble_gatt_get_chunk_count(int conn_id, int len) {
+    int payload = ble_gatt_get_payload_size(conn_id);
+
+    if (payload <= 0 || len < 0)
+        return -1;
+
+    return (len + payload - 1) / payload;
+}
+
+static ble_gatt_sub_t *find_sub(ble_device_t *dev, int char_id) {
+    int i;
+
+    if (!dev->subs)
+        return NULL;
+
+    for (i = 0; i < MAX_SUBSCRIPTIONS; i++)
+        if (dev->subs[i].used && dev->subs[i].char_id == char_id)
+            return &dev->subs[i];
+
+    return NULL;
+}
+
+static ble_gatt_sub_t *add_sub(ble_device_t *dev, int char_id) {
+    ble_gatt_sub_t *sub;
+    int i;
+
+    sub = find_sub(dev, char_id);
+    if (sub)
+        return sub;
+
+    /* Allocated once, so that the stack callbacks never see it move */
+    if (!dev->subs) {
+        dev->subs = calloc(MAX_SUBSCRIPTIONS, sizeof(ble_gatt_sub_t));
+        if (!dev->subs)
+            return NULL;
+    }
+
+    for (i = 0; i < MAX_SUBSCRIPTIONS; i++) {
+        if (dev->subs[i].used)
+            continue;
+
+        sub = &dev->subs[i];
+        pthread_mutex_lock(&notify_lock);
+        free(sub->held);
+        memset(sub, 0, sizeof(*sub));
+        sub->char_id = char_id;
+        sub->used = 1;
+        pthread_mutex_unlock(&notify_lock);
+        return sub;
+    }
+
+    return NULL;
+}
+
+/* Find the Client Characteristic Configuration descriptor of a char */
+static int find_ccc(ble_device_t *dev, int char_id) {
+    /* 0x2902 on the Bluetooth base UUID, least-significant byte first */
+    static const uint8_t ccc_uuid[16] = { 0xfb, 0x34, 0x9b, 0x5f, 0x80, 0x00,
+                                          0x00, 0x80, 0x00, 0x10, 0x00, 0x00,
+                                          0x02, 0x29, 0x00, 0x00 };
     int id;
 
-    for (id = 0; id < dev->char_count; id++)
-        if (!memcmp(&dev->chars[id].c, char_id, sizeof(btgatt_char_id_t)) &&
-            !memcmp(&dev->chars[id].s, srvc_id, sizeof(btgatt_srvc_id_t)))
+    for (id = 0; id < dev->desc_count; id++)
+        if (!memcmp(dev->descs[id].d.uu, ccc_uuid, sizeof(ccc_uuid)) &&
+            !memcmp(&dev->descs[id].c.c, &dev->chars[char_id].c,
+                    sizeof(btgatt_char_id_t)) &&
+            !memcmp(&dev->descs[id].c.s, &dev->chars[char_id].s,
+                    sizeof(btgatt_srvc_id_t)))
             return id;
 
     return -1;
 }
 
-/* Called for each characteristic discovery result */
-static void characteristic_discovery_cb(int conn_id, int status,
-                                        btgatt_srvc_id_t *srvc_id,
-                                        btgatt_char_id_t *char_id,
-                                        int char_prop) {
-    ble_device_t *dev;
+/* Queue the write of the CCC descriptor of a characteristic */
+static int ccc_write(ble_device_t *dev, int char_id, uint16_t value) {
+    ble_gatt_req_t *req;
     int id;
-    bt_status_t s;
 
-    if (status != 0) {
-        if (data.cbs.char_finished_cb)
-            data.cbs.char_finished_cb(conn_id, status);
+    id = find_ccc(dev, char_id);
+    if (id < 0)
+        return -1;
+
+    req = calloc(1, sizeof(ble_gatt_req_t));
+    if (!req)
+        return -1;
+
+    req->value = malloc(sizeof(value));
+    if (!req->value) {
+        free(req);
+        return -1;
+    }
+
+    req->type = GATT_REQ_WRITE_CCC;
+    req->id = id;
+    req->char_id = char_id;
+    req->len = sizeof(value);
+    req->value[0] = value & 0xff;
+    req->value[1] = value >> 8;
+
+    gatt_req_push(dev, req);
+
+    return 0;
+}
+
+/* Called when a queued CCC write finishes */
+static void ccc_written(ble_device_t *dev, ble_gatt_req_t *req, int status) {
+    ble_gatt_sub_t *sub;
+    uint8_t enable = req->value[0] || req->value[1];
+
+    sub = find_sub(dev, req->char_id);
+    if (sub) {
+        sub->busy = 0;
+        sub->enabled = enable && status == 0;
+    }
+
+    /* Writes flushed by a disconnection are replayed on the next connection,
+     * and a registration removed while its write was queued is reported when
+     * the CCC descriptor is cleared */
+    if (status < 0 || (sub && !enable))
+        return;
+
+    if (data.cbs.char_notification_register_cb)
+        data.cbs.char_notification_register_cb(dev->conn_id, req->char_id,
+                                               enable, status);
+}
+
+/* Enable the CCC descriptors of all registered characteristics which are not
+ * enabled yet, looking up the descriptors which are still unknown */
+static void ccc_sync(ble_device_t *dev) {
+    ble_gatt_sub_t *sub;
+    uint16_t value;
+    int i, c;
+
+    if (!dev->subs || dev->conn_id <= 0)
         return;
+
+    for (i = 0; i < MAX_SUBSCRIPTIONS; i++) {
+        sub = &dev->subs[i];
+        if (!sub->used || !sub->registered || sub->enabled || sub->busy)
+            continue;
+
+        c = sub->char_id;
+        if (c >= dev->char_count)
+            continue;
+
+        if (dev->chars[c].props & GATT_CHAR_PROP_NOTIFY ||
+            !(dev->chars[c].props & GATT_CHAR_PROP_INDICATE))
+            value = GATT_CCC_NOTIFY;
+        else
+            value = GATT_CCC_INDICATE;
+
+        /* Set first, as a write the stack refuses is finished before
+         * ccc_write() returns */
+        sub->busy = 1;
+        if (!ccc_write(dev, c, value))
+            continue;
+        sub->busy = 0;
+
+        /* Discover the descriptors once per connection; ccc_sync() runs
+         * again when the discovery finishes */
+        if (sub->lookup == CCC_LOOKUP_NONE) {
+            sub->lookup = CCC_LOOKUP_PENDING;
+            if (data.gattiface->client->get_descriptor(dev->conn_id,
+                                                       &dev->chars[c].s,
+                                                       &dev->chars[c].c,
+                                                       NULL) ==
+                BT_STATUS_SUCCESS)
+                continue;
+        } else if (sub->lookup == CCC_LOOKUP_PENDING)
+            continue;
+
+        /* The characteristic has no CCC descriptor to be written */
+        sub->enabled = 1;
+        if (data.cbs.char_notification_register_cb)
+            data.cbs.char_notification_register_cb(dev->conn_id, c, 1, 0);
     }
+}
 
-    dev = find_device_by_conn_id(conn_id);
-    if (!dev)
+/* Register again all notifications of a device that has just connected */
+static void subs_replay(ble_device_t *dev) {
+    int i, c;
+
+    if (!dev->subs || !data.gattiface)
         return;
 
-    id = find_characteristic(dev, srvc_id, char_id);
-    if (id < 0) {
-        id = dev->char_count++;
-        dev->chars = realloc(dev->chars,
-                             dev->char_count * sizeof(ble_gatt_char_t));
-        memcpy(&dev->chars[id].s, srvc_id, sizeof(btgatt_srvc_id_t));
-        memcpy(&dev->chars[id].c, char_id, sizeof(btgatt_char_id_t));
+    for (i = 0; i < MAX_SUBSCRIPTIONS; i++) {
+        if (!dev->subs[i].used)
+            continue;
+
+        c = dev->subs[i].char_id;
+        if (c >= dev->char_count)
+            continue;
+
+        data.gattiface->client->register_for_notification(data.client,
+                                                          &dev->bda,
+                                                          &dev->chars[c].s,
+                                                          &dev->chars[c].c);
     }
+}
 
-    if (data.cbs.char_found_cb)
-        data.cbs.char_found_cb(conn_id, id, char_id->uuid.uu, char_prop);
+/* Forget the per-connection state of the notifications of a device */
+static void subs_reset(ble_device_t *dev) {
+    int i;
 
-    /* Get next characteristic */
-    s = data.gattiface->client->get_characteristic(conn_id, srvc_id, char_id);
-    if (s != BT_STATUS_SUCCESS)
-        if (data.cbs.char_finished_cb)
-            data.cbs.char_finished_cb(conn_id, status);
+    if (!dev->subs)
+        return;
+
+    timer_cancel(&dev->notify_timer);
+
+    pthread_mutex_lock(&stats_lock);
+    for (i = 0; i < MAX_SUBSCRIPTIONS; i++) {
+        dev->subs[i].stats_prev = 0;
+        dev->subs[i].stats_interval = 0;
+        dev->subs[i].seq_valid = 0;
+    }
+    pthread_mutex_unlock(&stats_lock);
+
+    pthread_mutex_lock(&notify_lock);
+    for (i = 0; i < MAX_SUBSCRIPTIONS; i++) {
+        dev->subs[i].registered = 0;
+        dev->subs[i].enabled = 0;
+        dev->subs[i].busy = 0;
+        dev->subs[i].lookup = 0;
+        dev->subs[i].count = 0;
+        dev->subs[i].deadline = 0;
+        dev->subs[i].held_len = 0;
+    }
+    pthread_mutex_unlock(&notify_lock);
 }
 
-int ble_gatt_discover_characteristics(int conn_id, int service_id) {
+/* Called when the registration for notifications on a char finishes */
+static void register_for_notification_cb(int conn_id, int registered,
+                                         int status,
+                                         btgatt_srvc_id_t *srvc_id,
+                                         btgatt_char_id_t *char_id) {
     ble_device_t *dev;
-    bt_status_t s;
+    ble_gatt_sub_t *sub;
+    int id = -1;
 
-    if (conn_id <= 0)
-        return -1;
+    dev = find_device_by_conn_id(conn_id);
+    if (dev)
+        id = find_characteristic(dev, srvc_id, char_id);
 
-    if (!data.gattiface)
-        return -1;
+    if (id >= 0 && status == 0) {
+        sub = find_sub(dev, id);
 
-    dev = find_device_by_conn_id(conn_id);
-    if (!dev)
-        return -1;
+        /* Registration is reported once the CCC descriptor is written */
+        if (registered && sub) {
+            sub->registered = 1;
+            ccc_sync(dev);
+            return;
+        } else if (!registered && !sub && !ccc_write(dev, id, GATT_CCC_NONE))
+            return;
+    }
 
-    if (dev->srvc_count <= 0)
-        return -1;
+    if (data.cbs.char_notification_register_cb)
+        data.cbs.char_notification_register_cb(conn_id, id, registered, status);
+}
 
-    if (service_id < 0 || service_id >= dev->srvc_count)
-        return -1;
+/* Find the subscription a notification refers to */
+static ble_gatt_sub_t *find_notified_sub(ble_device_t *dev,
+                                         btgatt_notify_params_t *p_data) {
+    ble_gatt_char_t *ch;
+    int i;
 
-    s = data.gattiface->client->get_characteristic(conn_id,
-                                                   &dev->srvcs[service_id],
-                                                   NULL);
-    if (s != BT_STATUS_SUCCESS)
-        return -s;
+    if (!dev->subs)
+        return NULL;
+
+    for (i = 0; i < MAX_SUBSCRIPTIONS; i++) {
+        if (!dev->subs[i].used || dev->subs[i].char_id >= dev->char_count)
+            continue;
+
+        ch = &dev->chars[dev->subs[i].char_id];
+        if (!memcmp(&ch->c, &p_data->char_id, sizeof(btgatt_char_id_t)) &&
+            !memcmp(&ch->s, &p_data->srvc_id, sizeof(btgatt_srvc_id_t)))
+            return &dev->subs[i];
+    }
+
+    return NULL;
+}
+
+static int format_size(ble_value_format_t format) {
+    switch (format) {
+        case BLE_FORMAT_UINT8:
+        case BLE_FORMAT_SINT8:
+            return 1;
+        case BLE_FORMAT_UINT16:
+        case BLE_FORMAT_SINT16:
+            return 2;
+        case BLE_FORMAT_UINT32:
+        case BLE_FORMAT_SINT32:
+            return 4;
+    }
 
     return 0;
 }
 
-static int find_descriptor(ble_device_t *dev, btgatt_srvc_id_t *srvc_id,
-                           btgatt_char_id_t *char_id, bt_uuid_t *descr_id) {
-    int id;
+/* Read a little-endian field of a value */
+static int64_t field_get(const uint8_t *p, ble_value_format_t format) {
+    uint32_t v = 0;
+    int i, size = format_size(format);
+
+    for (i = size - 1; i >= 0; i--)
+        v = (v << 8) | p[i];
+
+    switch (format) {
+        case BLE_FORMAT_SINT8:
+            return (int8_t) v;
+        case BLE_FORMAT_SINT16:
+            return (int16_t) v;
+        case BLE_FORMAT_SINT32:
+            return (int32_t) v;
+        default:
+            return v;
+    }
+}
 
-    for (id = 0; id < dev->desc_count; id++)
-        if (!memcmp(&dev->descs[id].d, descr_id, sizeof(bt_uuid_t)) &&
-            !memcmp(&dev->descs[id].c.c, char_id, sizeof(btgatt_char_id_t)) &&
-            !memcmp(&dev->descs[id].c.s, srvc_id, sizeof(btgatt_srvc_id_t)))
-            return id;
+/* Write a little-endian field of a value */
+static void field_put(uint8_t *p, ble_value_format_t format, int64_t v) {
+    int i, size = format_size(format);
 
-    return -1;
+    for (i = 0; i < size; i++, v >>= 8)
+        p[i] = v & 0xff;
+}
+
+/* Hold a notification value back until the policy releases it */
+static void notify_hold(ble_gatt_sub_t *sub, btgatt_notify_params_t *p_data) {
+    if (!sub->held) {
+        sub->held = malloc(BTGATT_MAX_ATTR_LEN);
+        if (!sub->held)
+            return;
+    }
+
+    memcpy(sub->held, p_data->value, p_data->len);
+    sub->held_len = p_data->len;
+    sub->held_ind = !p_data->is_notify;
+}
+
+/* Make sure the timer of a device expires no later than a deadline */
+static void notify_timer_arm(ble_device_t *dev, uint64_t deadline) {
+    if (!dev->notify_timer.armed || deadline < dev->notify_timer.when)
+        timer_arm(&dev->notify_timer, deadline);
+}
+
+/* Apply the delivery policy of a subscription to a notification. Returns
+ * whether the notification should be delivered as is. Must hold
+ * notify_lock. */
+static int notify_filter(ble_device_t *dev, ble_gatt_sub_t *sub,
+                         btgatt_notify_params_t *p_data) {
+    int64_t v;
+    uint64_t now;
+
+    switch (sub->policy) {
+        case BLE_NOTIFY_ALL:
+            return 1;
+
+        case BLE_NOTIFY_NTH:
+            if (++sub->count < sub->param)
+                return 0;
+            sub->count = 0;
+            return 1;
+
+        case BLE_NOTIFY_LATEST:
+            now = now_ms();
+            if (!sub->held_len && now >= sub->deadline) {
+                sub->deadline = now + sub->param;
+                return 1;
+            }
+
+            notify_hold(sub, p_data);
+            notify_timer_arm(dev, sub->deadline);
+            return 0;
+
+        case BLE_NOTIFY_MIN:
+        case BLE_NOTIFY_MAX:
+        case BLE_NOTIFY_MEAN:
+            if (sub->offset + format_size(sub->format) > p_data->len)
+                return 0;
+
+            v = field_get(p_data->value + sub->offset, sub->format);
+            if (!sub->count) {
+                sub->agg_min = sub->agg_max = v;
+                sub->agg_sum = 0;
+                sub->deadline = now_ms() + sub->param;
+                notify_timer_arm(dev, sub->deadline);
+            }
+
+            if (v < sub->agg_min)
+                sub->agg_min = v;
+            if (v > sub->agg_max)
+                sub->agg_max = v;
+            sub->agg_sum += v;
+            sub->count++;
+
+            notify_hold(sub, p_data);
+            return 0;
+    }
+
+    return 1;
+}
+
+/* Take the value held by a subscription whose window is over, replacing the
+ * aggregated field. Must hold notify_lock. */
+static int notify_release(ble_gatt_sub_t *sub, uint8_t *value, uint16_t *len,
+                          uint8_t *is_ind) {
+    int64_t v;
+
+    if (!sub->held_len)
+        return 0;
+
+    memcpy(value, sub->held, sub->held_len);
+    *len = sub->held_len;
+    *is_ind = sub->held_ind;
+    sub->held_len = 0;
+
+    switch (sub->policy) {
+        case BLE_NOTIFY_MIN:
+            v = sub->agg_min;
+            break;
+        case BLE_NOTIFY_MAX:
+            v = sub->agg_max;
+            break;
+        case BLE_NOTIFY_MEAN:
+            v = sub->agg_sum / sub->count;
+            break;
+        default:
+            sub->deadline = now_ms() + sub->param;
+            return 1;
+    }
+
+    field_put(value + sub->offset, sub->format, v);
+    sub->count = 0;
+
+    return 1;
+}
+
+/* Called on the timer thread to deliver the values held by the policies */
+static void notify_timer_cb(void *arg) {
+    ble_device_t *dev = arg;
+    uint8_t value[BTGATT_MAX_ATTR_LEN];
+    uint16_t len;
+    uint8_t is_ind;
+    uint64_t now, next;
+    int conn_id, char_id, i, found;
+
+    do {
+        found = 0;
+        next = 0;
+        now = now_ms();
+
+        pthread_mutex_lock(&notify_lock);
+        conn_id = dev->conn_id;
+        for (i = 0; dev->subs && i < MAX_SUBSCRIPTIONS; i++) {
+            ble_gatt_sub_t *sub = &dev->subs[i];
+
+            if (!sub->used || !sub->held_len)
+                continue;
+
+            if (sub->deadline <= now) {
+                char_id = sub->char_id;
+                found = notify_release(sub, value, &len, &is_ind);
+                break;
+            }
+
+            if (!next || sub->deadline < next)
+                next = sub->deadline;
+        }
+        pthread_mutex_unlock(&notify_lock);
+
+        if (found && conn_id > 0 && data.cbs.char_notification_cb)
+            data.cbs.char_notification_cb(conn_id, char_id, value, len,
+                                          is_ind);
+    } while (found);
+
+    if (next)
+        notify_timer_arm(dev, next);
 }
 
-/* Called for each descriptor discovery result */
-static void descriptor_discovery_cb(int conn_id, int status,
-                                    btgatt_srvc_id_t *srvc_id,
-                                    btgatt_char_id_t *char_id,
-                                    bt_uuid_t *descr_id) {
-    ble_device_t *dev;
-    int id;
-    bt_status_t s;
+/* Size of the record at a stream offset of the ring, which is the whole space
+ * left at the end of the ring when there is no room for a record header */
+static uint64_t rec_size_at(uint64_t off) {
+    uint64_t pos = off % rec.hdr->data_size;
 
-    if (status != 0) {
-        if (data.cbs.desc_finished_cb)
-            data.cbs.desc_finished_cb(conn_id, status);
-        return;
-    }
+    if (rec.hdr->data_size - pos < sizeof(ble_rec_t))
+        return rec.hdr->data_size - pos;
 
-    dev = find_device_by_conn_id(conn_id);
-    if (!dev)
-        return;
+    return ((ble_rec_t *) (rec.ring + pos))->size;
+}
 
-    id = find_descriptor(dev, srvc_id, char_id, descr_id);
-    if (id < 0) {
-        id = dev->desc_count++;
-        dev->descs = realloc(dev->descs,
-                             dev->desc_count * sizeof(ble_gatt_desc_t));
-        memcpy(&dev->descs[id].c.s, srvc_id, sizeof(btgatt_srvc_id_t));
-        memcpy(&dev->descs[id].c.c, char_id, sizeof(btgatt_char_id_t));
-        memcpy(&dev->descs[id].d, descr_id, sizeof(bt_uuid_t));
+/* Append a notification to the recording ring. Must hold rec.lock. */
+static void rec_append(ble_device_t *dev, int char_id,
+                       btgatt_notify_params_t *p_data) {
+    ble_rec_header_t *hdr = rec.hdr;
+    ble_rec_t *r;
+    struct timespec ts;
+    uint64_t head = hdr->head, tail = hdr->tail, pos, gap, size;
+
+    size = (sizeof(ble_rec_t) + p_data->len + 7) & ~7ULL;
+    pos = head % hdr->data_size;
+    gap = pos + size > hdr->data_size ? hdr->data_size - pos : 0;
+
+    /* Drop the oldest records until there is room */
+    while (tail < head && head + gap + size - tail > hdr->data_size) {
+        pos = tail % hdr->data_size;
+        if (hdr->data_size - pos >= sizeof(ble_rec_t) &&
+            !(((ble_rec_t *) (rec.ring + pos))->flags & BLE_REC_PADDING))
+            hdr->overwritten++;
+        tail += rec_size_at(tail);
     }
 
-    if (data.cbs.desc_found_cb)
-        data.cbs.desc_found_cb(conn_id, id, descr_id->uu, 0);
+    /* An empty ring restarts from its beginning, as the padding and the
+     * record may not fit together */
+    if (tail == head && gap) {
+        head += gap;
+        tail = head;
+        gap = 0;
+    }
+    __atomic_store_n(&hdr->tail, tail, __ATOMIC_RELEASE);
 
-    /* Get next descriptor */
-    s = data.gattiface->client->get_descriptor(conn_id, srvc_id, char_id,
-                                               descr_id);
-    if (s != BT_STATUS_SUCCESS)
-        if (data.cbs.desc_finished_cb)
-            data.cbs.desc_finished_cb(conn_id, status);
+    if (gap >= sizeof(ble_rec_t)) {
+        r = (ble_rec_t *) (rec.ring + head % hdr->data_size);
+        memset(r, 0, sizeof(*r));
+        r->size = gap;
+        r->flags = BLE_REC_PADDING;
+    }
+    head += gap;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    r = (ble_rec_t *) (rec.ring + head % hdr->data_size);
+    r->size = size;
+    r->len = p_data->len;
+    r->conn_id = dev->conn_id;
+    r->char_id = char_id;
+    r->flags = p_data->is_notify ? 0 : BLE_REC_INDICATION;
+    memcpy(r->address, dev->bda.address, sizeof(r->address));
+    r->timestamp = (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    memcpy(r + 1, p_data->value, p_data->len);
+
+    hdr->records++;
+    __atomic_store_n(&hdr->head, head + size, __ATOMIC_RELEASE);
 }
 
-int ble_gatt_discover_descriptors(int conn_id, int char_id) {
-    ble_device_t *dev;
-    bt_status_t s;
+/* Account the sequence counter of a notification. Must hold stats_lock. */
+static void stats_seq(ble_gatt_sub_t *sub, btgatt_notify_params_t *p_data) {
+    ble_notify_stats_t *st = &sub->stats;
+    uint32_t seq, diff, mask;
+    int i;
 
-    if (conn_id <= 0)
-        return -1;
+    if (sub->seq_offset + sub->seq_width > p_data->len)
+        return;
 
-    if (!data.gattiface)
-        return -1;
+    for (i = sub->seq_width - 1, seq = 0; i >= 0; i--)
+        seq = (seq << 8) | p_data->value[sub->seq_offset + i];
 
-    dev = find_device_by_conn_id(conn_id);
-    if (!dev)
-        return -1;
+    if (!sub->seq_valid) {
+        sub->seq_last = seq;
+        sub->seq_valid = 1;
+        return;
+    }
 
-    if (dev->char_count <= 0)
-        return -1;
+    mask = sub->seq_width == 4 ? 0xffffffff : (1U << (sub->seq_width * 8)) - 1;
+    diff = (seq - sub->seq_last) & mask;
+
+    if (diff == 0) {
+        st->seq_duplicates++;
+    } else if (diff > mask / 2) {
+        st->seq_reordered++;
+    } else {
+        if (diff > 1) {
+            st->seq_gaps += diff - 1;
+            st->seq_gap_events++;
+        }
+        sub->seq_last = seq;
+    }
+}
 
-    if (char_id < 0 || char_id >= dev->char_count)
-        return -1;
+/* Account a notification in the reception statistics */
+static void stats_update(ble_gatt_sub_t *sub, btgatt_notify_params_t *p_data,
+                         uint64_t now) {
+    ble_notify_stats_t *st = &sub->stats;
+    uint32_t interval, delta, ms;
+    int bucket;
+
+    pthread_mutex_lock(&stats_lock);
+
+    if (!st->count)
+        st->first = now;
+    st->count++;
+    st->bytes += p_data->len;
+    st->last = now;
+
+    if (sub->stats_prev) {
+        interval = now - sub->stats_prev;
+
+        if (!sub->stats_intervals || interval < st->interval_min)
+            st->interval_min = interval;
+        if (interval > st->interval_max)
+            st->interval_max = interval;
+        sub->stats_interval_sum += interval;
+        sub->stats_intervals++;
+
+        bucket = 0;
+        for (ms = interval / 1000; ms && bucket < BLE_STATS_BUCKETS - 1; ms >>= 1)
+            bucket++;
+        st->hist[bucket]++;
+
+        /* Jitter kept in 1/16 us, as in RFC 3550 */
+        if (sub->stats_interval) {
+            delta = interval > sub->stats_interval ?
+                    interval - sub->stats_interval :
+                    sub->stats_interval - interval;
+            sub->stats_jitter += delta - ((sub->stats_jitter + 8) >> 4);
+        }
+        sub->stats_interval = interval;
+    }
+    sub->stats_prev = now;
 
-    s = data.gattiface->client->get_descriptor(conn_id, &dev->chars[char_id].s,
-                                               &dev->chars[char_id].c, NULL);
-    if (s != BT_STATUS_SUCCESS)
-        return -s;
+    if (sub->seq_width)
+        stats_seq(sub, p_data);
 
-    return 0;
+    pthread_mutex_unlock(&stats_lock);
 }
 
-/* Called when a GATT read characteristic operation returns */
-void read_characteristic_cb(int conn_id, int status,
-                            btgatt_read_params_t *p_data) {
+/* Called when notifications of a characteristic are received */
+void notify_cb(int conn_id, btgatt_notify_params_t *p_data) {
     ble_device_t *dev;
-    int id = -1;
+    ble_gatt_sub_t *sub = NULL;
+    int id = -1, deliver = 1;
+    uint64_t now = now_us();
 
     dev = find_device_by_conn_id(conn_id);
-    if (dev)
-        id = find_characteristic(dev, &p_data->srvc_id, &p_data->char_id);
+    if (dev) {
+        sub = find_notified_sub(dev, p_data);
+        if (sub)
+            id = sub->char_id;
+        else
+            id = find_characteristic(dev, &p_data->srvc_id, &p_data->char_id);
+    }
 
-    if (data.cbs.char_read_cb)
-        data.cbs.char_read_cb(conn_id, id, p_data->value.value,
-                              p_data->value.len, p_data->value_type, status);
-}
+    if (sub)
+        stats_update(sub, p_data, now);
 
-/* Called when a GATT read descriptor operation returns */
-static void read_descriptor_cb(int conn_id, int status,
-                               btgatt_read_params_t *p_data) {
-    ble_device_t *dev;
-    int id = -1;
+    if (sub) {
+        pthread_mutex_lock(&rec.lock);
+        if (sub->record && rec.hdr)
+            rec_append(dev, id, p_data);
+        pthread_mutex_unlock(&rec.lock);
+    }
 
-    dev = find_device_by_conn_id(conn_id);
-    if (dev)
-        id = find_descriptor(dev, &p_data->srvc_id, &p_data->char_id,
-                             &p_data->descr_id);
+    if (sub && sub->policy != BLE_NOTIFY_ALL) {
+        pthread_mutex_lock(&notify_lock);
+        deliver = notify_filter(dev, sub, p_data);
+        pthread_mutex_unlock(&notify_lock);
+    }
 
-    if (data.cbs.desc_read_cb)
-        data.cbs.desc_read_cb(conn_id, id, p_data->value.value,
-                              p_data->value.len, p_data->value_type, status);
+    if (deliver && data.cbs.char_notification_cb)
+        data.cbs.char_notification_cb(conn_id, id, p_data->value, p_data->len,
+                                      !p_data->is_notify);
 }
 
-/* Called when a GATT write characteristic operation returns */
-static void write_characteristic_cb(int conn_id, int status,
-                                    btgatt_write_params_t *p_data) {
+int ble_gatt_set_notification_policy(int conn_id, int char_id,
+                                     ble_notify_policy_t policy, int param,
+                                     ble_value_format_t format, int offset) {
     ble_device_t *dev;
-    int id = -1;
+    ble_gatt_sub_t *sub;
+
+    if (conn_id <= 0 || char_id < 0)
+        return -1;
 
     dev = find_device_by_conn_id(conn_id);
-    if (dev)
-        id = find_characteristic(dev, &p_data->srvc_id, &p_data->char_id);
+    if (!dev)
+        return -1;
 
-    if (data.cbs.char_write_cb)
-        data.cbs.char_write_cb(conn_id, id, NULL, 0, 0, status);
-}
+    sub = find_sub(dev, char_id);
+    if (!sub)
+        return -1;
 
-/* Called when a GATT write descriptor operation returns */
-static void write_descriptor_cb(int conn_id, int status,
-                                btgatt_write_params_t *p_data) {
-    ble_device_t *dev;
-    int id = -1;
+    switch (policy) {
+        case BLE_NOTIFY_ALL:
+            break;
+        case BLE_NOTIFY_NTH:
+        case BLE_NOTIFY_LATEST:
+            if (param <= 0)
+                return -1;
+            break;
+        case BLE_NOTIFY_MIN:
+        case BLE_NOTIFY_MAX:
+        case BLE_NOTIFY_MEAN:
+            if (param <= 0 || !format_size(format) || offset < 0 ||
+                offset + format_size(format) > BTGATT_MAX_ATTR_LEN)
+                return -1;
+            break;
+        default:
+            return -1;
+    }
 
-    dev = find_device_by_conn_id(conn_id);
-    if (dev)
-        id = find_descriptor(dev, &p_data->srvc_id, &p_data->char_id,
-                             &p_data->descr_id);
+    dev->notify_timer.cb = notify_timer_cb;
+    dev->notify_timer.arg = dev;
 
-    if (data.cbs.desc_write_cb)
-        data.cbs.desc_write_cb(conn_id, id, NULL, 0, 0, status);
+    pthread_mutex_lock(&notify_lock);
+    sub->policy = policy;
+    sub->param = param;
+    sub->format = format;
+    sub->offset = offset;
+    sub->count = 0;
+    sub->deadline = 0;
+    sub->held_len = 0;
+    pthread_mutex_unlock(&notify_lock);
+
+    return 0;
 }
 
-static void execute_write_cb(int conn_id, int status) {
+int ble_gatt_set_sequence_field(int conn_id, int char_id, int offset,
+                                int width) {
     ble_device_t *dev;
+    ble_gatt_sub_t *sub;
 
-    dev = find_device_by_conn_id(conn_id);
-    if (!dev || !dev->write_prepared)
-        return;
+    if (conn_id <= 0 || char_id < 0)
+        return -1;
 
-    if (dev->prep_write_type == BLE_GATT_ELEM_CHARACTERISTIC &&
-        data.cbs.char_write_cb)
-        data.cbs.char_write_cb(conn_id, dev->prep_write_id, NULL, 0, 0, status);
-    else if (dev->prep_write_type == BLE_GATT_ELEM_DESCRIPTOR &&
-        data.cbs.desc_write_cb)
-        data.cbs.desc_write_cb(conn_id, dev->prep_write_id, NULL, 0, 0, status);
-}
+    if (width != 0 && width != 1 && width != 2 && width != 4)
+        return -1;
 
-static int ble_gatt_op(int operation, int conn_id, int id, int auth,
-                       const char *value, int len) {
-    ble_device_t *dev;
-    bt_status_t s = BT_STATUS_UNSUPPORTED;
+    if (offset < 0 || offset + width > BTGATT_MAX_ATTR_LEN)
+        return -1;
 
-    if (id < 0)
+    dev = find_device_by_conn_id(conn_id);
+    if (!dev)
         return -1;
 
-    if (conn_id <= 0)
+    sub = find_sub(dev, char_id);
+    if (!sub)
         return -1;
 
-    if (!data.gattiface)
+    pthread_mutex_lock(&stats_lock);
+    sub->seq_offset = offset;
+    sub->seq_width = width;
+    sub->seq_valid = 0;
+    pthread_mutex_unlock(&stats_lock);
+
+    return 0;
+}
+
+int ble_gatt_get_notification_stats(int conn_id, int char_id,
+                                    ble_notify_stats_t *stats, int reset) {
+    ble_device_t *dev;
+    ble_gatt_sub_t *sub;
+
+    if (conn_id <= 0 || char_id < 0 || !stats)
         return -1;
 
     dev = find_device_by_conn_id(conn_id);
     if (!dev)
         return -1;
 
-    switch (operation) {
-        case 0: /* Read characteristic */
-            if (dev->char_count <= 0)
-                return -1;
-            if (id >= dev->char_count)
-                return -1;
+    sub = find_sub(dev, char_id);
+    if (!sub)
+        return -1;
 
-            s = data.gattiface->client->read_characteristic(conn_id,
-	                                                    &dev->chars[id].s,
-	                                                    &dev->chars[id].c,
-                                                            auth);
-            break;
+    pthread_mutex_lock(&stats_lock);
+
+    *stats = sub->stats;
+    stats->jitter = sub->stats_jitter >> 4;
+    if (sub->stats_intervals)
+        stats->interval_mean = sub->stats_interval_sum / sub->stats_intervals;
+    if (stats->last > stats->first)
+        stats->rate = (stats->count - 1) * 1000000000ULL /
+                      (stats->last - stats->first);
+
+    if (reset) {
+        memset(&sub->stats, 0, sizeof(sub->stats));
+        sub->stats_interval_sum = 0;
+        sub->stats_intervals = 0;
+        sub->stats_jitter = 0;
+    }
 
-        case 1: /* Read descriptor */
-            if (dev->desc_count <= 0)
-                return -1;
-            if (id >= dev->desc_count)
-                return -1;
+    pthread_mutex_unlock(&stats_lock);
 
-	    s = data.gattiface->client->read_descriptor(conn_id,
-	                                                &dev->descs[id].c.s,
-							&dev->descs[id].c.c,
-							&dev->descs[id].d,
-                                                        auth);
-            break;
+    return 0;
+}
 
-        case 4: /* Write characteristic with prepare write */
-            dev->write_prepared = 1;
-            dev->prep_write_type = BLE_GATT_ELEM_CHARACTERISTIC;
-            dev->prep_write_id = id;
-            /* pass-through */
+int ble_recorder_start(const char *path, size_t size) {
+    ble_rec_header_t *hdr;
+    int fd;
 
-        case 2: /* Write characteristic with write command */
-        case 3: /* Write characteristic with write request */
-            if (dev->char_count <= 0 || id >= dev->char_count)
-                return -1;
+    if (!path || size < sizeof(ble_rec_header_t) + sizeof(ble_rec_t) +
+                        BTGATT_MAX_ATTR_LEN)
+        return -1;
 
-            s = data.gattiface->client->write_characteristic(conn_id,
-	                                                     &dev->chars[id].s,
-	                                                     &dev->chars[id].c,
-                                                             operation-1, len,
-                                                             auth,
-                                                             (char *) value);
-            break;
+    pthread_mutex_lock(&rec.lock);
 
-        case 7: /* Write descriptor with prepare write */
-            dev->write_prepared = 1;
-            dev->prep_write_type = BLE_GATT_ELEM_DESCRIPTOR;
-            dev->prep_write_id = id;
-            /* pass-through */
+    if (rec.hdr)
+        goto fail;
 
-        case 5: /* Write descriptor with write command */
-        case 6: /* Write descriptor with write request */
-            if (dev->desc_count <= 0 || id >= dev->desc_count)
-                return -1;
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        goto fail;
 
-	    s = data.gattiface->client->write_descriptor(conn_id,
-	                                                 &dev->descs[id].c.s,
-							 &dev->descs[id].c.c,
-							 &dev->descs[id].d,
-                                                         operation-4, len,
-                                                         auth, (char *) value);
-            break;
+    if (ftruncate(fd, size) < 0)
+        goto fail_close;
 
-        case 8:
-            if (id == 0) /* Cancel prepared write */
-                dev->write_prepared = 0;
-            s = data.gattiface->client->execute_write(conn_id, id);
-            break;
-    }
+    hdr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (hdr == MAP_FAILED)
+        goto fail_close;
 
-    if (s != BT_STATUS_SUCCESS)
-        return -s;
+    memset(hdr, 0, sizeof(*hdr));
+    memcpy(hdr->magic, BLE_REC_MAGIC, sizeof(hdr->magic));
+    hdr->version = BLE_REC_VERSION;
+    hdr->header_size = sizeof(*hdr);
+    hdr->data_size = (size - sizeof(*hdr)) & ~7ULL;
 
-    return 0;
-}
+    rec.fd = fd;
+    rec.size = size;
+    rec.ring = (uint8_t *) (hdr + 1);
+    rec.hdr = hdr;
 
-int ble_gatt_read_char(int conn_id, int char_id, int auth) {
-    return ble_gatt_op(0, conn_id, char_id, auth, NULL, 0);
-}
+    pthread_mutex_unlock(&rec.lock);
+    return 0;
 
-int ble_gatt_read_desc(int conn_id, int desc_id, int auth) {
-    return ble_gatt_op(1, conn_id, desc_id, auth, NULL, 0);
+fail_close:
+    close(fd);
+fail:
+    pthread_mutex_unlock(&rec.lock);
+    return -1;
 }
 
-int ble_gatt_write_cmd_char(int conn_id, int char_id, int auth,
-                            const char *value, int len) {
-    return ble_gatt_op(2, conn_id, char_id, auth, value, len);
-}
+int ble_recorder_stop(void) {
+    pthread_mutex_lock(&rec.lock);
 
-int ble_gatt_write_req_char(int conn_id, int char_id, int auth,
-                            const char *value, int len) {
-    return ble_gatt_op(3, conn_id, char_id, auth, value, len);
-}
+    if (!rec.hdr) {
+        pthread_mutex_unlock(&rec.lock);
+        return -1;
+    }
 
-int ble_gatt_write_cmd_desc(int conn_id, int desc_id, int auth,
-                            const char *value, int len) {
-    return ble_gatt_op(5, conn_id, desc_id, auth, value, len);
-}
+    msync(rec.hdr, rec.size, MS_SYNC);
+    munmap(rec.hdr, rec.size);
+    close(rec.fd);
 
-int ble_gatt_write_req_desc(int conn_id, int desc_id, int auth,
-                            const char *value, int len) {
-    return ble_gatt_op(6, conn_id, desc_id, auth, value, len);
-}
+    rec.hdr = NULL;
+    rec.ring = NULL;
+    rec.fd = -1;
+    rec.size = 0;
 
-int ble_gatt_prep_write_char(int conn_id, int char_id, int auth,
-                             const char *value, int len) {
-    return ble_gatt_op(4, conn_id, char_id, auth, value, len);
+    pthread_mutex_unlock(&rec.lock);
+    return 0;
 }
 
-int ble_gatt_prep_write_desc(int conn_id, int desc_id, int auth,
-                             const char *value, int len) {
-    return ble_gatt_op(7, conn_id, desc_id, auth, value, len);
-}
+int ble_recorder_set_char(int conn_id, int char_id, int enable) {
+    ble_device_t *dev;
+    ble_gatt_sub_t *sub;
 
-int ble_gatt_execute_write(int conn_id, int execute) {
-    return ble_gatt_op(8, conn_id, execute, 0, NULL, 0);
-}
+    if (conn_id <= 0 || char_id < 0)
+        return -1;
 
-/* Called when the registration for notifications on a char finishes */
-static void register_for_notification_cb(int conn_id, int registered,
-                                         int status,
-                                         btgatt_srvc_id_t *srvc_id,
-                                         btgatt_char_id_t *char_id) {
-    int id = 0;
+    dev = find_device_by_conn_id(conn_id);
+    if (!dev)
+        return -1;
 
-    if (data.cbs.char_notification_register_cb)
-        data.cbs.char_notification_register_cb(conn_id, id, registered, status);
-}
+    sub = find_sub(dev, char_id);
+    if (!sub)
+        return -1;
 
-/* Called when notifications of a characteristic are received */
-void notify_cb(int conn_id, btgatt_notify_params_t *p_data) {
-    int id = 0;
+    pthread_mutex_lock(&rec.lock);
+    sub->record = !!enable;
+    pthread_mutex_unlock(&rec.lock);
 
-    if (data.cbs.char_notification_cb)
-        data.cbs.char_notification_cb(conn_id, id, p_data->value, p_data->len,
-                                      !p_data->is_notify);
+    return 0;
 }
 
 static int ble_gatt_char_notification(uint8_t operation, int conn_id,
                                       int char_id) {
     ble_device_t *dev;
+    ble_gatt_sub_t *sub;
     bt_status_t s = BT_STATUS_UNSUPPORTED;
     btgatt_srvc_id_t *srvc;
     btgatt_char_id_t *ch;
@@ -893,11 +7044,21 @@ static int ble_gatt_char_notification(uint8_t operation, int conn_id,
 
     switch (operation) {
         case 0:
+            sub = add_sub(dev, char_id);
+            if (!sub)
+                return -1;
+
             s = data.gattiface->client->register_for_notification(data.client,
                                                                   &dev->bda,
                                                                   srvc, ch);
+            if (s != BT_STATUS_SUCCESS)
+                sub->used = 0;
             break;
         case 1:
+            sub = find_sub(dev, char_id);
+            if (sub)
+                sub->used = 0;
+
             s = data.gattiface->client->deregister_for_notification(data.client,
                                                                     &dev->bda,
                                                                     srvc, ch);
@@ -930,23 +7091,29 @@ static void register_client_cb(int status, int client_if, bt_uuid_t *app_uuid) {
 
 /* GATT client interface callbacks */
 static const btgatt_client_callbacks_t gattccbs = {
-    register_client_cb,
-    scan_result_cb,
-    connect_cb,
-    disconnect_cb,
-    service_discovery_complete_cb,
-    service_discovery_result_cb,
-    characteristic_discovery_cb,
-    descriptor_discovery_cb,
-    get_included_service_cb,
-    register_for_notification_cb,
-    notify_cb,
-    read_characteristic_cb,
-    write_characteristic_cb,
-    read_descriptor_cb,
-    write_descriptor_cb,
-    execute_write_cb,
-    read_remote_rssi_cb
+    .register_client_cb = register_client_cb,
+    .scan_result_cb = scan_result_cb,
+    .open_cb = connect_cb,
+    .close_cb = disconnect_cb,
+    .search_complete_cb = service_discovery_complete_cb,
+    .search_result_cb = service_discovery_result_cb,
+    .get_characteristic_cb = characteristic_discovery_cb,
+    .get_descriptor_cb = descriptor_discovery_cb,
+    .get_included_service_cb = get_included_service_cb,
+    .register_for_notification_cb = register_for_notification_cb,
+    .notify_cb = notify_cb,
+    .read_characteristic_cb = read_characteristic_cb,
+    .write_characteristic_cb = write_characteristic_cb,
+    .read_descriptor_cb = read_descriptor_cb,
+    .write_descriptor_cb = write_descriptor_cb,
+    .execute_write_cb = execute_write_cb,
+    .read_remote_rssi_cb = read_remote_rssi_cb,
+#ifdef HAVE_GATT_CONFIGURE_MTU
+    .configure_mtu_cb = configure_mtu_cb,
+#endif
+#ifdef HAVE_GATT_CONN_UPDATED_CB
+    .conn_updated_cb = conn_updated_cb,
+#endif
 };
 
 /* GATT interface callbacks */
@@ -956,6 +7123,8 @@ static const btgatt_callbacks_t gattcbs = {
     NULL  /* btgatt_server_callbacks_t */
 };
 
+static void release_all(void);
+
 /* Called every time the adapter state changes */
 static void adapter_state_changed_cb(bt_state_t state) {
     /* Arbitrary UUID used to identify this application with the GATT profile */
@@ -964,6 +7133,11 @@ static void adapter_state_changed_cb(bt_state_t state) {
                                    0x23, 0x36 } };
 
     data.adapter_state = state == BT_STATE_ON ? 1 : 0;
+
+    /* Released before the application is told */
+    if (!data.adapter_state)
+        release_all();
+
     if (data.cbs.adapter_state_cb)
         data.cbs.adapter_state_cb(data.adapter_state);
 
@@ -1055,12 +7229,43 @@ int ble_enable(ble_cbs_t cbs) {
 
 static void remove_all_devices() {
     ble_device_t *dev, *next;
+    int i;
+
+    timer_cancel(&conn_sched.timer);
+    pthread_mutex_lock(&conn_sched.lock);
+    conn_sched.queue = NULL;
+    conn_sched.pending = NULL;
+    conn_sched.links = 0;
+    conn_sched.background = 0;
+    pthread_mutex_unlock(&conn_sched.lock);
+
+    pthread_mutex_lock(&fast.lock);
+    fast.pending = 0;
+    fast.paused = 0;
+    pthread_mutex_unlock(&fast.lock);
 
+    /* With nothing left to connect, before the devices go */
+    sweep_abort();
+
+    pthread_mutex_lock(&devices_lock);
     dev = data.devices;
+    data.devices = NULL;
+    pthread_mutex_unlock(&devices_lock);
+
     while (dev) {
         next = dev->next;
 
+        discovery_set_state(dev, BLE_DISCOVERY_FAILED, -1);
+        gatt_req_flush(dev, -1);
+        timer_cancel(&dev->notify_timer);
+        timer_cancel(&dev->reconnect_timer);
         free(dev->srvcs);
+        free(dev->srvc_flags);
+        free(dev->incls);
+        if (dev->subs)
+            for (i = 0; i < MAX_SUBSCRIPTIONS; i++)
+                free(dev->subs[i].held);
+        free(dev->subs);
         free(dev->chars);
         free(dev->descs);
         free(dev);
@@ -1069,6 +7274,26 @@ static void remove_all_devices() {
     }
 }
 
+/* Release the state of the session once the adapter is off. The scan
+ * settings are reset to their defaults for the next session. */
+static void release_all(void) {
+    remove_all_devices();
+
+    ble_recorder_stop();
+    ble_scan_set_batch(0, 0, NULL);
+    ble_scan_set_presence(0, 0, 0, NULL);
+    ble_scan_set_policy(BLE_SCAN_ALL, 0, NULL);
+    ble_scan_set_top(0, 0);
+    ble_scan_clear();
+    scan_table_free();
+    ble_scan_set_filters(NULL, 0);
+    ble_scan_set_allowlist(NULL, 0, 0);
+    ble_rpa_set_keys(NULL, 0, 0);
+
+    /* Timers only disarmed above may still be running */
+    timer_stop();
+}
+
 int ble_disable() {
     bt_status_t s;
 
@@ -70,10 +70,209 @@ typedef void (*ble_adapter_state_cb_t)(uint8_t state);
  *                most-significant byte is on position 0 and the
  *                least-sifnificant byte is on position 5.
  * @param rssi The RSSI of the found device.
- * @param adv_data A pointer to the advertising data of the found device.
+ * @param adv_data A pointer to the advertising data of the found device,
+ *                 followed by its scan response from byte 31.
+ * @param adv_len The number of bytes of adv_data used by AD structures,
+ *                including the scan response.
  */
 typedef void (*ble_scan_cb_t)(const uint8_t *address, int rssi,
-                              const uint8_t *adv_data);
+                              const uint8_t *adv_data, int adv_len);
+
+/** Iterator over the AD structures of advertising data. */
+typedef struct {
+    const uint8_t *data; /**< The advertising data. */
+    int len;             /**< Length of the advertising data. */
+    int pos;             /**< Position of the next AD structure. */
+} ble_ad_iter_t;
+
+/** Reports of the scan delivered through scan_cb. */
+typedef enum {
+    BLE_SCAN_ALL,     /**< Every report, the default. */
+    BLE_SCAN_NEW,     /**< The first report of each device. */
+    BLE_SCAN_CHANGED, /**< Reports whose advertising data has changed. */
+    BLE_SCAN_DIGEST   /**< None, the devices are reported periodically. */
+} ble_scan_policy_t;
+
+/** Aggregated reports of a device found while scanning. */
+typedef struct {
+    uint8_t address[6]; /**< Address of the device. */
+    int8_t rssi_last;   /**< RSSI of the last report. */
+    int8_t rssi_mean;   /**< Mean RSSI of the reports. */
+    int8_t rssi_min;    /**< Lowest RSSI reported. */
+    int8_t rssi_max;    /**< Highest RSSI reported. */
+    uint32_t count;     /**< Number of reports. */
+    uint32_t adv_hash;  /**< Hash of the last advertising data. */
+    uint64_t first;     /**< Time of the first report, in us. */
+    uint64_t last;      /**< Time of the last report, in us. */
+} ble_scan_entry_t;
+
+/** Length of the advertising data followed by the scan response. */
+#define BLE_ADV_DATA_LEN 62
+
+/** Scan report, as delivered in batches. */
+typedef struct {
+    uint8_t address[6]; /**< Address of the device. */
+    int8_t rssi;        /**< RSSI of the report. */
+    uint8_t adv_len;    /**< Bytes of adv_data used by AD structures. */
+    uint8_t adv_data[BLE_ADV_DATA_LEN]; /**< Advertising data followed by the
+                                             scan response. */
+    uint64_t timestamp; /**< Time of the report, in us. */
+} ble_scan_report_t;
+
+/**
+ * Type that represents a callback function to deliver scan reports in
+ * batches.
+ *
+ * @param reports The reports, valid until the callback returns.
+ * @param count The number of reports.
+ */
+typedef void (*ble_scan_batch_cb_t)(const ble_scan_report_t *reports,
+                                    int count);
+
+/** Kind of advertising data decoded by a decoder. */
+typedef enum {
+    BLE_DECODER_MANUFACTURER, /**< Manufacturer data, by company. */
+    BLE_DECODER_SERVICE_DATA  /**< Service data, by 16-bit service UUID. */
+} ble_decoder_kind_t;
+
+/** Maximum number of decoders registered. */
+#define BLE_DECODER_MAX 32
+
+/**
+ * Type that represents a decoder of manufacturer or service data.
+ *
+ * @param address The address of the device, as passed to scan_cb.
+ * @param rssi The RSSI of the report.
+ * @param id The company identifier or service UUID the decoder was
+ *           registered for.
+ * @param data The data following the identifier, in the advertising data.
+ * @param len The length of data.
+ */
+typedef void (*ble_decoder_cb_t)(const uint8_t *address, int rssi,
+                                 uint16_t id, const uint8_t *data, int len);
+
+/** iBeacon advertisement. */
+typedef struct {
+    uint8_t uuid[16];  /**< Proximity UUID, most-significant byte first. */
+    uint16_t major;    /**< Major value. */
+    uint16_t minor;    /**< Minor value. */
+    int8_t tx_power;   /**< Calibrated RSSI at 1 m. */
+} ble_ibeacon_t;
+
+/**
+ * Type that represents a callback function to report iBeacon advertisements.
+ *
+ * @param address The address of the device, as passed to scan_cb.
+ * @param rssi The RSSI of the report.
+ * @param beacon The decoded advertisement.
+ */
+typedef void (*ble_ibeacon_cb_t)(const uint8_t *address, int rssi,
+                                 const ble_ibeacon_t *beacon);
+
+/** Eddystone frame types. */
+#define BLE_EDDYSTONE_UID 0x00
+#define BLE_EDDYSTONE_URL 0x10
+#define BLE_EDDYSTONE_TLM 0x20
+#define BLE_EDDYSTONE_EID 0x30
+
+/** Size of the URL of an Eddystone-URL frame, expanded, with the NUL. */
+#define BLE_EDDYSTONE_URL_LEN 128
+
+/** Eddystone frame. Only the fields of the frame type are set. */
+typedef struct {
+    uint8_t frame;            /**< Frame type, as BLE_EDDYSTONE_UID. */
+    int8_t tx_power;          /**< Calibrated TX power at 0 m (UID, URL,
+                                   EID). */
+    uint8_t namespace_id[10]; /**< Namespace (UID). */
+    uint8_t instance_id[6];   /**< Instance (UID). */
+    char url[BLE_EDDYSTONE_URL_LEN]; /**< URL, expanded (URL). */
+    uint16_t battery;         /**< Battery voltage in mV, 0 if unknown
+                                   (TLM). */
+    int16_t temperature;      /**< Temperature in 1/256 degrees Celsius,
+                                   -32768 if unknown (TLM). */
+    uint32_t adv_count;       /**< Advertisements sent since boot (TLM). */
+    uint32_t uptime;          /**< Time since boot, in 0.1 s (TLM). */
+    uint8_t eid[8];           /**< Ephemeral identifier (EID). */
+} ble_eddystone_t;
+
+/**
+ * Type that represents a callback function to report Eddystone frames.
+ *
+ * @param address The address of the device, as passed to scan_cb.
+ * @param rssi The RSSI of the report.
+ * @param frame The decoded frame.
+ */
+typedef void (*ble_eddystone_cb_t)(const uint8_t *address, int rssi,
+                                   const ble_eddystone_t *frame);
+
+/** Maximum number of scan filters. */
+#define BLE_SCAN_MAX_FILTERS 32
+
+/** Maximum length of the manufacturer data matched by a scan filter. */
+#define BLE_SCAN_FILTER_DATA_LEN 27
+
+/**
+ * Filter of scan reports. A report matches when it satisfies all the
+ * conditions set in the filter. A filter initialized to zero matches all
+ * reports.
+ */
+typedef struct {
+    uint8_t address[6];  /**< Address prefix, most-significant byte first. */
+    uint8_t address_len; /**< Bytes of address to match, 0 for any. */
+    uint8_t has_uuid;    /**< Whether to match a service UUID. */
+    uint8_t uuid[16];    /**< Service UUID, least-significant byte first, as
+                              for ble_gatt_discover_services(). UUIDs from the
+                              Bluetooth base UUID match both their 16-bit and
+                              128-bit forms. */
+    uint8_t has_company; /**< Whether to match manufacturer data. */
+    int company;         /**< Manufacturer company identifier. */
+    uint8_t data[BLE_SCAN_FILTER_DATA_LEN]; /**< Manufacturer data following
+                                                 the company identifier. */
+    uint8_t mask[BLE_SCAN_FILTER_DATA_LEN]; /**< Bits of data to match. */
+    uint8_t data_len;    /**< Bytes of data to match. */
+    int rssi;            /**< Minimum RSSI, 0 for any. */
+} ble_scan_filter_t;
+
+/**
+ * Type that represents a callback function to report the devices entering or
+ * leaving the area set by ble_scan_set_presence().
+ *
+ * @param entry The aggregated reports of the device.
+ * @param present 1 if the device entered, 0 if it left.
+ */
+typedef void (*ble_presence_cb_t)(const ble_scan_entry_t *entry, int present);
+
+/** Maximum number of devices present at once. */
+#define BLE_SCAN_MAX_PRESENT 65536
+
+/** Maximum number of strongest devices tracked. */
+#define BLE_SCAN_MAX_TOP 32
+
+/** Maximum number of RSSI samples kept per device. */
+#define BLE_SCAN_MAX_HISTORY 1024
+
+/** Maximum number of devices kept in the table of the devices found. */
+#define BLE_SCAN_MAX_DEVICES 65536
+
+/** RSSI statistics of the recent reports of a device. */
+typedef struct {
+    uint32_t count; /**< Number of reports in the window. */
+    int8_t mean;    /**< Mean RSSI. */
+    int8_t median;  /**< Median RSSI, the lower one for an even count. */
+    int8_t min;     /**< Lowest RSSI. */
+    int8_t max;     /**< Highest RSSI. */
+    uint32_t rate;  /**< Rate of the reports, in reports per 1000 s. */
+} ble_scan_rssi_stats_t;
+
+/**
+ * Type that represents a callback function to report the devices found while
+ * scanning, when the BLE_SCAN_DIGEST policy is used.
+ *
+ * @param entries The devices reported since the previous digest.
+ * @param count The number of entries.
+ */
+typedef void (*ble_scan_digest_cb_t)(const ble_scan_entry_t *entries,
+                                     int count);
 
 /**
  * Type that represents a callback function to notify of a new connection with
@@ -186,8 +385,316 @@ typedef void (*ble_gatt_notification_cb_t)(int conn_id, int char_id,
                                            uint16_t value_len,
                                            uint8_t is_indication);
 
+/** Delivery policy of the notifications of a characteristic. */
+typedef enum {
+    BLE_NOTIFY_ALL,    /**< Deliver every notification. */
+    BLE_NOTIFY_NTH,    /**< Deliver one out of every N notifications. */
+    BLE_NOTIFY_LATEST, /**< Deliver at most one notification every T ms: the
+                            latest one received. */
+    BLE_NOTIFY_MIN,    /**< Deliver the minimum of a field over windows of
+                            T ms. */
+    BLE_NOTIFY_MAX,    /**< Deliver the maximum of a field over windows of
+                            T ms. */
+    BLE_NOTIFY_MEAN    /**< Deliver the mean of a field over windows of
+                            T ms. */
+} ble_notify_policy_t;
+
+/** Format of a little-endian numeric field inside an attribute value. */
+typedef enum {
+    BLE_FORMAT_UINT8,
+    BLE_FORMAT_SINT8,
+    BLE_FORMAT_UINT16,
+    BLE_FORMAT_SINT16,
+    BLE_FORMAT_UINT32,
+    BLE_FORMAT_SINT32
+} ble_value_format_t;
+
+/** Number of buckets of the notification inter-arrival histogram. */
+#define BLE_STATS_BUCKETS 16
+
+/**
+ * Reception statistics of the notifications of a characteristic.
+ *
+ * Times are taken from a monotonic clock when each notification reaches
+ * libble. Intervals between notifications separated by a reconnection are
+ * not accounted.
+ */
+typedef struct {
+    uint64_t count;          /**< Notifications received. */
+    uint64_t bytes;          /**< Bytes of value received. */
+    uint64_t first;          /**< Time of the first notification, in us. */
+    uint64_t last;           /**< Time of the last notification, in us. */
+    uint32_t rate;           /**< Mean rate, in notifications per 1000 s. */
+    uint32_t interval_mean;  /**< Mean inter-arrival time, in us. */
+    uint32_t interval_min;   /**< Shortest inter-arrival time, in us. */
+    uint32_t interval_max;   /**< Longest inter-arrival time, in us. */
+    uint32_t jitter;         /**< Smoothed variation between consecutive
+                                  inter-arrival times, in us, computed as in
+                                  RFC 3550. */
+    uint32_t hist[BLE_STATS_BUCKETS]; /**< Inter-arrival histogram: bucket 0
+                                  counts intervals under 1 ms, bucket i > 0
+                                  intervals from 2^(i-1) ms to 2^i ms, and
+                                  the last bucket everything longer. */
+    uint64_t seq_gaps;       /**< Sequence numbers missing. */
+    uint64_t seq_gap_events; /**< Times one or more sequence numbers were
+                                  missing. */
+    uint64_t seq_duplicates; /**< Sequence numbers received again. */
+    uint64_t seq_reordered;  /**< Sequence numbers older than the newest one
+                                  received. */
+} ble_notify_stats_t;
+
+/** Magic string at the beginning of a notification recording file. */
+#define BLE_REC_MAGIC "BLEREC\0\0"
+
+/** Version of the notification recording file format. */
+#define BLE_REC_VERSION 1
+
+/**
+ * Header of a notification recording file, followed by the ring of records.
+ *
+ * head and tail are byte offsets in the stream of records ever written: the
+ * valid records start at tail and end at head, and a stream offset maps to
+ * data_size bytes after the header modulo data_size. All fields are in host
+ * byte order.
+ */
+typedef struct {
+    char magic[8];           /**< BLE_REC_MAGIC. */
+    uint32_t version;        /**< BLE_REC_VERSION. */
+    uint32_t header_size;    /**< Size of this header. */
+    uint64_t data_size;      /**< Size of the ring of records. */
+    uint64_t head;           /**< Stream offset of the end of the records. */
+    uint64_t tail;           /**< Stream offset of the oldest record. */
+    uint64_t records;        /**< Records ever written. */
+    uint64_t overwritten;    /**< Records overwritten by newer ones. */
+    uint64_t reserved;
+} ble_rec_header_t;
+
+/** The record was an indication. */
+#define BLE_REC_INDICATION 0x01
+/** The record only pads the end of the ring and holds no notification. */
+#define BLE_REC_PADDING    0x80
+
+/**
+ * Record of a notification, followed by the value. Records are aligned to 8
+ * bytes. A record never wraps around the end of the ring: the space left is
+ * filled by a padding record, or just skipped when smaller than a record
+ * header. A record holds at most BTGATT_MAX_ATTR_LEN bytes of value, so its
+ * size fits 16 bits.
+ */
+typedef struct {
+    uint16_t size;           /**< Size of the record, including padding. */
+    uint16_t len;            /**< Length of the value. */
+    uint16_t conn_id;        /**< Connection the notification came from. */
+    uint16_t char_id;        /**< Characteristic the notification refers to. */
+    uint8_t flags;           /**< BLE_REC_INDICATION or BLE_REC_PADDING. */
+    uint8_t reserved;
+    uint8_t address[6];      /**< Address of the remote device. */
+    uint64_t timestamp;      /**< Reception time, in us since the epoch. */
+} ble_rec_t;
+
+/**
+ * Type that represents a callback function to inform the ATT MTU of a
+ * connection after an MTU exchange.
+ *
+ * @param conn_id The identifier of the connected remote device.
+ * @param mtu The MTU in use on the connection.
+ * @param status The status in which the MTU exchange has finished.
+ */
+typedef void (*ble_gatt_mtu_cb_t)(int conn_id, int mtu, int status);
+
+/**
+ * Type that represents a callback function to inform the parameters of a
+ * connection after they have been updated.
+ *
+ * @param conn_id The identifier of the connected remote device.
+ * @param interval The connection interval, in units of 1.25 ms.
+ * @param latency The slave latency, in connection events.
+ * @param timeout The supervision timeout, in units of 10 ms.
+ * @param status The status in which the update has finished.
+ */
+typedef void (*ble_conn_params_cb_t)(int conn_id, int interval, int latency,
+                                     int timeout, int status);
+
+/**
+ * Type that represents a callback function to inform that a device has been
+ * reconnected after its link was lost.
+ *
+ * @param address A pointer to a 6 element array representing each part of the
+ *                Bluetooth address of the remote device.
+ * @param conn_id The identifier of the new connection.
+ * @param downtime Time elapsed since the link was lost, in ms.
+ * @param attempts The number of connection attempts it took.
+ */
+typedef void (*ble_reconnect_cb_t)(const uint8_t *address, int conn_id,
+                                   int downtime, int attempts);
+
+/** Connection parameter profiles. */
+typedef enum {
+    BLE_CONN_LOW_LATENCY, /**< 11.25 to 15 ms interval, no slave latency. */
+    BLE_CONN_BALANCED,    /**< 30 to 50 ms interval, no slave latency. */
+    BLE_CONN_LOW_POWER    /**< 100 to 125 ms interval, slave latency 2. */
+} ble_conn_profile_t;
+
+/** Statistics of the connections issued on matching advertisements. */
+typedef struct {
+    uint32_t triggered;    /**< Connections issued. */
+    uint32_t connected;    /**< Connections established. */
+    uint32_t failed;       /**< Connections failed or timed out. */
+    uint32_t latency_last; /**< Last advertisement to connection time, us. */
+    uint32_t latency_min;  /**< Minimum advertisement to connection time. */
+    uint32_t latency_max;  /**< Maximum advertisement to connection time. */
+    uint32_t latency_mean; /**< Mean advertisement to connection time. */
+} ble_fast_connect_stats_t;
+
+/** Maximum number of identity resolving keys. */
+#define BLE_RPA_MAX_KEYS 65536
+
+/** Default lifetime of resolved private addresses, in s. */
+#define BLE_RPA_DEFAULT_PERIOD 900
+
+/** Identity resolving key of a device using resolvable private addresses. */
+typedef struct {
+    uint8_t irk[16];     /**< Key, most-significant byte first. */
+    uint8_t identity[6]; /**< Identity address of the device. */
+} ble_irk_t;
+
+/** Statistics of the resolution of private addresses. */
+typedef struct {
+    uint32_t cache_hits; /**< Addresses found in the cache. */
+    uint32_t resolved;   /**< Addresses resolved with one of the keys. */
+    uint32_t unresolved; /**< Addresses resolved with none of the keys. */
+} ble_rpa_stats_t;
+
+/** State of the GATT discovery of a connected device. */
+typedef enum {
+    BLE_DISCOVERY_IDLE,            /**< No discovery has been requested. */
+    BLE_DISCOVERY_SERVICES,        /**< Searching for services. */
+    BLE_DISCOVERY_INCLUDED,        /**< Resolving included services. */
+    BLE_DISCOVERY_CHARACTERISTICS, /**< Discovering characteristics. */
+    BLE_DISCOVERY_DESCRIPTORS,     /**< Discovering descriptors. */
+    BLE_DISCOVERY_DONE,            /**< Discovery finished successfully. */
+    BLE_DISCOVERY_FAILED           /**< Discovery has been aborted. */
+} ble_discovery_state_t;
+
+/**
+ * Type that represents a callback function to notify the progress of the
+ * discovery of a device started by ble_gatt_discover_all().
+ *
+ * @param conn_id The identifier of the connected remote device.
+ * @param state The discovery stage the device has just entered.
+ * @param status The status of the last GATT operation: nonzero only when state
+ *               is BLE_DISCOVERY_FAILED.
+ */
+typedef void (*ble_discovery_cb_t)(int conn_id, ble_discovery_state_t state,
+                                   int status);
+
+/**
+ * Type that represents a callback function to notify that the discovery of all
+ * devices started by ble_gatt_discover_all() has finished.
+ *
+ * @param count The number of devices whose discovery was requested.
+ * @param failed How many of these devices failed to be discovered.
+ */
+typedef void (*ble_discovery_ready_cb_t)(int count, int failed);
+
+/**
+ * Type that represents a callback function to report the progress of a stream
+ * of writes started by ble_gatt_stream_write().
+ *
+ * @param conn_id The identifier of the connected remote device.
+ * @param char_id ID of the characteristic being written.
+ * @param sent How many bytes have already been handed to the link.
+ * @param total The length of the whole stream.
+ * @param rate Sustained throughput since the stream started, in bytes per
+ *             second.
+ * @param status Nonzero if the stream has been aborted.
+ */
+typedef void (*ble_gatt_stream_cb_t)(int conn_id, int char_id, int sent,
+                                     int total, int rate, int status);
+
+/**
+ * Result of one of the reads of ble_gatt_read_many().
+ */
+typedef struct {
+    int char_id;             /**< The characteristic read. */
+    int status;              /**< The status of the read. */
+    int value_type;          /**< The type of the value. */
+    uint16_t offset;         /**< Offset of the value in the values buffer. */
+    uint16_t len;            /**< Length of the value. */
+} ble_gatt_read_result_t;
+
+/**
+ * Type that represents a callback function to deliver the values read by
+ * ble_gatt_read_many().
+ *
+ * The results and the values are packed in a single buffer, valid only until
+ * the callback returns.
+ *
+ * @param conn_id The identifier of the connected remote device.
+ * @param results One result per characteristic, in the order requested.
+ * @param count The number of results.
+ * @param values The values read, referenced by the offsets of the results.
+ * @param status Nonzero if the batch has been aborted, in which case the
+ *               results not read yet have a nonzero status.
+ */
+typedef void (*ble_gatt_read_many_cb_t)(int conn_id,
+                                        const ble_gatt_read_result_t *results,
+                                        int count, const uint8_t *values,
+                                        int status);
+
+/**
+ * Parameters of a sweep started by ble_sweep_start().
+ */
+typedef struct {
+    const uint8_t *service;  /**< UUID of the service holding the
+                                  characteristics, to limit the service
+                                  search, or NULL to search all services. */
+    const uint8_t *chars;    /**< UUIDs of the characteristics to read, 16
+                                  bytes each. */
+    int char_count;          /**< Number of characteristics to read. */
+    int max_links;           /**< Connections open at the same time. */
+    int timeout;             /**< Time allowed to each attempt, in ms. */
+    int retries;             /**< Attempts after the first one failed. */
+} ble_sweep_params_t;
+
+/**
+ * Type that represents a callback function to deliver the result of a device
+ * of a sweep.
+ *
+ * The results and the values are packed as for ble_gatt_read_many_cb_t, with
+ * one result per characteristic of the sweep, in the same order. A
+ * characteristic missing on the device has a char_id of -1.
+ *
+ * @param address The address of the device.
+ * @param results The results of the reads, or NULL if the device failed.
+ * @param count The number of results.
+ * @param values The values read.
+ * @param attempts How many times the device has been connected to.
+ * @param status 0 if the characteristics have been read, nonzero if every
+ *               attempt failed.
+ */
+typedef void (*ble_sweep_cb_t)(const uint8_t *address,
+                               const ble_gatt_read_result_t *results,
+                               int count, const uint8_t *values, int attempts,
+                               int status);
+
+/**
+ * Type that represents a callback function to notify that a sweep finished.
+ *
+ * @param done The number of devices read.
+ * @param failed The number of devices that failed.
+ * @param rate The throughput of the sweep, in devices per minute.
+ */
+typedef void (*ble_sweep_done_cb_t)(int done, int failed, int rate);
+
 /**
  * List of callbacks for BLE operations.
+ *
+ * Callbacks are called from the stack callback thread, except for
+ * char_notification_cb when delivering notifications held by a policy of
+ * ble_gatt_set_notification_policy(), and connect_cb when reporting a connection
+ * request that timed out, which are called from a thread of libble. These may
+ * run concurrently with the callbacks of the stack callback thread.
  */
 typedef struct ble_cbs {
     ble_enable_cb_t enable_cb;
@@ -209,6 +716,9 @@ typedef struct ble_cbs {
     ble_gatt_response_cb_t desc_write_cb;
     ble_gatt_notification_register_cb_t char_notification_register_cb;
     ble_gatt_notification_cb_t char_notification_cb;
+    ble_gatt_mtu_cb_t mtu_cb;
+    ble_conn_params_cb_t conn_params_cb;
+    ble_reconnect_cb_t reconnect_cb;
 } ble_cbs_t;
 
 /**
@@ -224,6 +734,13 @@ int ble_enable(ble_cbs_t cbs);
 /**
  * Power off the adapter, cleanup the BLE features and shutdown the stack.
  *
+ * Once the adapter is off, the devices are released along with their
+ * pending requests, which fail, a sweep in progress ends, the recorder is
+ * stopped and the scan settings are reset to their defaults, delivering any
+ * batched reports. The timer thread exits. Connection rules and decoders are
+ * kept. No other function may be called until this is done, as reported to
+ * ble_cbs_t.adapter_state_cb.
+ *
  * @return 0 on success.
  * @return Negative value on failure.
  */
@@ -249,22 +766,591 @@ int ble_start_scan();
  */
 int ble_stop_scan();
 
+/**
+ * Start iterating over the AD structures of advertising data.
+ *
+ * @param it The iterator.
+ * @param adv_data The advertising data, as passed to scan_cb.
+ * @param adv_len The length of adv_data, as passed to scan_cb.
+ */
+void ble_ad_iter_init(ble_ad_iter_t *it, const uint8_t *adv_data,
+                      int adv_len);
+
+/**
+ * Get the next AD structure of advertising data.
+ *
+ * A zero length before byte 31 ends the advertising data, and iteration goes
+ * on with the scan response. Iteration stops at a structure running past
+ * the end of the data.
+ *
+ * @param it The iterator.
+ * @param type Filled with the AD type.
+ * @param value Filled with a pointer to the AD data, in the advertising
+ *              data.
+ * @param len Filled with the length of the AD data.
+ *
+ * @return 1 if an AD structure has been found.
+ * @return 0 at the end of the advertising data.
+ */
+int ble_ad_next(ble_ad_iter_t *it, uint8_t *type, const uint8_t **value,
+                int *len);
+
+/**
+ * Get the local name from advertising data, complete or else shortened.
+ *
+ * @param adv_data The advertising data, as passed to scan_cb.
+ * @param adv_len The length of adv_data, as passed to scan_cb.
+ * @param name Filled with the name, null-terminated, and truncated if
+ *             needed.
+ * @param size The size of name.
+ *
+ * @return The length of the name copied.
+ * @return -1 if there is no name.
+ */
+int ble_ad_get_name(const uint8_t *adv_data, int adv_len, char *name,
+                    int size);
+
+/**
+ * Get the service UUIDs listed in advertising data.
+ *
+ * 16 and 32-bit UUIDs are expanded with the Bluetooth base UUID.
+ *
+ * @param adv_data The advertising data, as passed to scan_cb.
+ * @param adv_len The length of adv_data, as passed to scan_cb.
+ * @param uuids Filled with up to max UUIDs of 16 bytes, least-significant
+ *              byte first.
+ * @param max The number of UUIDs uuids can hold.
+ *
+ * @return The number of UUIDs listed, which may be more than max.
+ */
+int ble_ad_get_uuids(const uint8_t *adv_data, int adv_len, uint8_t *uuids,
+                     int max);
+
+/**
+ * Get the TX power level from advertising data.
+ *
+ * @param adv_data The advertising data, as passed to scan_cb.
+ * @param adv_len The length of adv_data, as passed to scan_cb.
+ * @param tx_power Filled with the TX power level, in dBm.
+ *
+ * @return 0 on success.
+ * @return -1 if there is no TX power level.
+ */
+int ble_ad_get_tx_power(const uint8_t *adv_data, int adv_len, int *tx_power);
+
+/**
+ * Get the manufacturer specific data from advertising data.
+ *
+ * @param adv_data The advertising data, as passed to scan_cb.
+ * @param adv_len The length of adv_data, as passed to scan_cb.
+ * @param company Filled with the company identifier.
+ * @param data Filled with a pointer to the data following the company
+ *             identifier, in the advertising data.
+ * @param len Filled with the length of data.
+ *
+ * @return 0 on success.
+ * @return -1 if there is no manufacturer specific data.
+ */
+int ble_ad_get_manufacturer_data(const uint8_t *adv_data, int adv_len,
+                                 int *company, const uint8_t **data,
+                                 int *len);
+
+/**
+ * Register a decoder of manufacturer or service data.
+ *
+ * Decoders are called from the stack callback thread for each AD structure
+ * they were registered for, in every scan report passing the allowlist and
+ * the filters, before the report is delivered. The decoder of an identifier
+ * is found in constant time. Registering a decoder for an identifier replaces
+ * the previous one. The built-in decoders set by ble_decoder_set_ibeacon_cb()
+ * and ble_decoder_set_eddystone_cb() are kept apart: they run after any
+ * decoder registered for their identifier, and do not count against
+ * BLE_DECODER_MAX.
+ *
+ * @param kind The kind of data decoded.
+ * @param id The company identifier or 16-bit service UUID.
+ * @param cb The decoder, NULL to remove the decoder of id.
+ *
+ * @return 0 on success.
+ * @return -1 on invalid parameters or if BLE_DECODER_MAX decoders are
+ *         registered.
+ */
+int ble_decoder_register(ble_decoder_kind_t kind, uint16_t id,
+                         ble_decoder_cb_t cb);
+
+/**
+ * Decode the iBeacon advertisements, in the manufacturer data of company
+ * 0x004C.
+ *
+ * @param cb The callback receiving the advertisements, NULL to stop decoding
+ *           them.
+ *
+ * @return 0.
+ */
+int ble_decoder_set_ibeacon_cb(ble_ibeacon_cb_t cb);
+
+/**
+ * Decode the Eddystone frames, in the service data of UUID 0xFEAA. Encrypted
+ * TLM frames are not decoded.
+ *
+ * @param cb The callback receiving the frames, NULL to stop decoding them.
+ *
+ * @return 0.
+ */
+int ble_decoder_set_eddystone_cb(ble_eddystone_cb_t cb);
+
+/**
+ * Choose which scan reports are delivered through scan_cb.
+ *
+ * The reports of each device are aggregated in a table of 1024 devices by
+ * default, sized by ble_scan_set_history(), whatever the policy is. The
+ * devices seen the least recently are replaced when it is full. With BLE_SCAN_DIGEST, the devices reported
+ * since the previous digest are passed to cb every interval ms, from a
+ * thread of libble, instead of calling scan_cb.
+ *
+ * @param policy The reports to deliver.
+ * @param interval The period of the digest, in ms. Ignored by other policies.
+ * @param cb The callback receiving the digest. Ignored by other policies.
+ *
+ * @return 0 on success.
+ * @return -1 on invalid parameters.
+ */
+int ble_scan_set_policy(ble_scan_policy_t policy, int interval,
+                        ble_scan_digest_cb_t cb);
+
+/**
+ * Deliver scan reports in batches.
+ *
+ * The reports which would be passed to scan_cb are collected instead, and
+ * passed to cb once size of them have been collected or interval ms after
+ * the first one, whichever comes first. Batches are delivered from the
+ * stack callback thread when full, and from a thread of libble otherwise.
+ * They are delivered one at a time, in order, and cb may call this function
+ * to change the settings.
+ *
+ * @param size The number of reports per batch, 0 to call scan_cb again.
+ * @param interval The longest time a report is held, in ms.
+ * @param cb The callback receiving the batches.
+ *
+ * @return 0 on success.
+ * @return -1 on invalid parameters or if out of memory.
+ */
+int ble_scan_set_batch(int size, int interval, ble_scan_batch_cb_t cb);
+
+/**
+ * Feed scan reports to libble as if they had been received by the stack.
+ *
+ * Meant for tests and benchmarks of the scan processing and delivery. The
+ * adv_len field of the reports is ignored.
+ *
+ * @param reports The reports to feed.
+ * @param count The number of reports.
+ *
+ * @return 0 on success.
+ * @return -1 on invalid parameters.
+ */
+int ble_scan_inject(const ble_scan_report_t *reports, int count);
+
+/**
+ * Set the filters of scan reports.
+ *
+ * Filters are checked by libble before scan reports are aggregated or
+ * delivered, and reports matching none of them are dropped. The filters are
+ * copied.
+ *
+ * @param filters The filters, NULL to accept all reports.
+ * @param count The number of filters, up to BLE_SCAN_MAX_FILTERS.
+ *
+ * @return 0 on success.
+ * @return -1 on invalid parameters.
+ */
+int ble_scan_set_filters(const ble_scan_filter_t *filters, int count);
+
+/**
+ * Set the allowlist of scan reports.
+ *
+ * When an allowlist is set, reports from addresses not in it are dropped
+ * before the filters are checked. Lookups take no lock, so the allowlist can
+ * be replaced while scanning; this call returns once the previous allowlist
+ * is no longer used. The addresses are copied.
+ *
+ * A Bloom filter in front of the allowlist makes rejecting addresses cheaper
+ * when the allowlist is too large for the cache: with 8 bits per address it
+ * lets about 3% of the other addresses through to the allowlist itself.
+ *
+ * @param addresses The addresses, 6 bytes each as for ble_connect(), NULL to
+ *                  remove the allowlist.
+ * @param count The number of addresses.
+ * @param bloom_bits Bits of Bloom filter per address, up to 32, 0 for none.
+ *
+ * @return 0 on success.
+ * @return -1 on invalid parameters or if out of memory.
+ */
+int ble_scan_set_allowlist(const uint8_t *addresses, int count,
+                           int bloom_bits);
+
+/**
+ * Load the allowlist of scan reports from a file, as ble_scan_set_allowlist().
+ *
+ * The file has one address per line, as in 00:11:22:AA:BB:CC. Empty lines and
+ * lines starting with '#' are skipped. An empty file drops all the reports.
+ * The current allowlist is kept if the file can't be loaded.
+ *
+ * @param path The path of the file.
+ * @param bloom_bits Bits of Bloom filter per address, up to 32, 0 for none.
+ *
+ * @return The number of distinct addresses loaded.
+ * @return -1 on invalid parameters, if the file can't be read or has a
+ *         malformed line, or if out of memory.
+ */
+int ble_scan_load_allowlist(const char *path, int bloom_bits);
+
+/**
+ * Look up an address in the allowlist of scan reports.
+ *
+ * @param address The address, as for ble_connect().
+ *
+ * @return 1 if the address is in the allowlist.
+ * @return 0 if it is not.
+ * @return -1 if there is no allowlist.
+ */
+int ble_scan_allowlist_contains(const uint8_t *address);
+
+/**
+ * Set the identity resolving keys of the devices using resolvable private
+ * addresses.
+ *
+ * Scan reports from resolvable private addresses, whose two most significant
+ * bits are 01, are resolved with the keys from the stack callback thread.
+ * Resolved reports are then checked against the allowlist and the filters,
+ * aggregated and delivered with the identity address instead, so a device is
+ * seen under a single address across rotations; fast connection rules are
+ * still matched against the address on air. The stack does not tell the type
+ * of the addresses, so public addresses with those bits set are tried too,
+ * and resolve by chance once in 2^24 / count.
+ *
+ * Every key is tried until one matches, so the results, including failures,
+ * are cached for period, meant to be the rotation period of the devices. The
+ * cache holds 4096 addresses. The keys are copied, and the cache emptied.
+ *
+ * @param keys The keys, NULL to stop resolving addresses.
+ * @param count The number of keys, up to BLE_RPA_MAX_KEYS.
+ * @param period The lifetime of the resolved addresses, in s, 0 for
+ *               BLE_RPA_DEFAULT_PERIOD.
+ *
+ * @return 0 on success.
+ * @return -1 on invalid parameters or if out of memory.
+ */
+int ble_rpa_set_keys(const ble_irk_t *keys, int count, int period);
+
+/**
+ * Resolve a private address with the keys set by ble_rpa_set_keys().
+ *
+ * @param address The address, as for ble_connect().
+ * @param identity Filled with the identity address, if resolved.
+ *
+ * @return 1 if the address was resolved.
+ * @return 0 if it is not a resolvable private address, or was not resolved.
+ * @return -1 on invalid parameters.
+ */
+int ble_rpa_resolve(const uint8_t *address, uint8_t *identity);
+
+/**
+ * Get the last private address resolved to an identity address, to connect
+ * to a device reported with its identity address.
+ *
+ * @param identity The identity address.
+ * @param address Filled with the private address.
+ *
+ * @return 0 on success.
+ * @return -1 on invalid parameters or if no address resolved to identity.
+ */
+int ble_rpa_get_address(const uint8_t *identity, uint8_t *address);
+
+/**
+ * Get the statistics of the resolution of private addresses.
+ *
+ * @param stats Filled with the statistics.
+ * @param reset 1 to reset the statistics after they are copied.
+ *
+ * @return 0 on success.
+ * @return -1 if stats is NULL.
+ */
+int ble_rpa_get_stats(ble_rpa_stats_t *stats, int reset);
+
+/**
+ * Get the aggregated reports of a device found while scanning.
+ *
+ * @param address The address of the device, as for ble_connect().
+ * @param entry Filled with the aggregated reports.
+ *
+ * @return 0 on success.
+ * @return -1 if the device is not in the table.
+ */
+int ble_scan_get_entry(const uint8_t *address, ble_scan_entry_t *entry);
+
+/**
+ * Forget all the devices found while scanning.
+ */
+void ble_scan_clear(void);
+
+/**
+ * Size the table of the devices found while scanning, and keep their RSSI
+ * history.
+ *
+ * The table holds up to devices devices. The time and RSSI of the last depth
+ * reports of each are kept, using 9 bytes per report for each device of the
+ * table. Every report passing the allowlist and the filters is added,
+ * whatever the policy set by ble_scan_set_policy(). When the table is full,
+ * the device seen the least recently is replaced and its history is lost:
+ * size it for the devices expected in range. Changing the settings forgets
+ * the devices of the table.
+ *
+ * @param depth The number of reports kept per device, up to
+ *              BLE_SCAN_MAX_HISTORY, 0 to keep none.
+ * @param devices The number of devices of the table, up to
+ *                BLE_SCAN_MAX_DEVICES, 0 for the default of 1024.
+ *
+ * @return 0 on success.
+ * @return -1 on invalid parameters or if out of memory.
+ */
+int ble_scan_set_history(int depth, int devices);
+
+/**
+ * Get the last RSSI samples of a device found while scanning.
+ *
+ * @param address The address of the device, as for ble_connect().
+ * @param count The number of samples wanted.
+ * @param times Filled with the times of the samples, in us, oldest first.
+ *              May be NULL.
+ * @param rssi Filled with the RSSI of the samples. May be NULL.
+ *
+ * @return The number of samples copied, up to count.
+ * @return -1 if there is no history or the device is not in the table.
+ */
+int ble_scan_get_history(const uint8_t *address, int count, uint64_t *times,
+                         int8_t *rssi);
+
+/**
+ * Get the RSSI statistics of the recent reports of a device found while
+ * scanning.
+ *
+ * @param address The address of the device, as for ble_connect().
+ * @param window How far back to look, in ms, 0 for all the history.
+ * @param stats Filled with the statistics of the samples in the window.
+ *
+ * @return 0 on success.
+ * @return -1 if there is no history or the device is not in the table.
+ */
+int ble_scan_get_rssi_stats(const uint8_t *address, int window,
+                            ble_scan_rssi_stats_t *stats);
+
+/**
+ * Report the devices entering and leaving the range of the adapter.
+ *
+ * A device enters on a report with an RSSI of at least enter_rssi. It leaves
+ * when no report with an RSSI of at least exit_rssi was received for timeout
+ * ms. The gap between both thresholds keeps devices at the edge of the range
+ * from entering and leaving all the time.
+ *
+ * Present devices are tracked apart from the table of the devices found,
+ * whatever the number of the other devices, in memory growing with their
+ * number. Up to BLE_SCAN_MAX_PRESENT devices can be present at once: beyond
+ * that, devices only enter once others have left. A device leaving is
+ * reported with the entry of its last report.
+ *
+ * Devices entering are reported from the stack callback thread, and devices
+ * leaving from a thread of libble. The reports of a device are never
+ * reordered.
+ * Changing the settings, as well as ble_scan_clear(), forgets the devices
+ * present without reporting them.
+ *
+ * @param enter_rssi The RSSI from which devices enter.
+ * @param exit_rssi The RSSI from which devices stay, up to enter_rssi.
+ * @param timeout The time after which devices not heard leave, in ms.
+ * @param cb The callback receiving the changes, NULL to stop reporting them.
+ *
+ * @return 0 on success.
+ * @return -1 on invalid parameters.
+ */
+int ble_scan_set_presence(int enter_rssi, int exit_rssi, int timeout,
+                          ble_presence_cb_t cb);
+
+/**
+ * Track the devices heard with the strongest signal while scanning.
+ *
+ * Every report passing the allowlist and the filters updates the list of the
+ * k strongest devices, ordered by their RSSI smoothed over the last reports.
+ * Devices not heard for max_age ms are left out of the list, and are the
+ * first replaced by new devices. A device whose signal weakens is only
+ * replaced once a stronger one is heard. Changing the settings, as well as
+ * ble_scan_clear(), empties the list.
+ *
+ * @param k The number of devices tracked, up to BLE_SCAN_MAX_TOP, 0 to stop.
+ * @param max_age The time after which devices not heard are left out, in ms.
+ *
+ * @return 0 on success.
+ * @return -1 on invalid parameters.
+ */
+int ble_scan_set_top(int k, int max_age);
+
+/**
+ * Get the devices heard with the strongest signal, set by ble_scan_set_top().
+ *
+ * @param entries Filled with the aggregated reports of the devices, the
+ *                strongest first.
+ * @param rssi Filled with the smoothed RSSI of the devices. May be NULL.
+ * @param count The size of entries.
+ *
+ * @return The number of devices copied, up to count.
+ * @return -1 on invalid parameters or if the devices are not tracked.
+ */
+int ble_scan_get_top(ble_scan_entry_t *entries, int8_t *rssi, int count);
+
 /**
  * Connects to a BLE device.
  *
+ * The stack only supports one pending connection at a time, so connection
+ * requests are queued and issued one after the other, as long as fewer links
+ * than the maximum set by ble_connect_set_max_links() are open. This is the
+ * same as ble_connect_with_priority() with priority 0 and a 10 s timeout.
+ *
  * @param address A pointer to a 6 element array representing each part of the
  *                Bluetooth address of the remote device a connection should be
  *                requested, where the most-significant byte is on position 0
  *                and the least-sifnificant byte is on position 5.
  *
  * @return 0 if connection has been successfully requested.
+ * @return 1 if the device is already connected or being connected.
  * @return -1 if failed to request connection.
  */
 int ble_connect(const uint8_t *address);
 
+/**
+ * Connects to a BLE device, with a priority and a timeout.
+ *
+ * Queued requests are issued by decreasing priority, and in the order they
+ * were made for the same priority. An attempt still pending after the timeout
+ * is cancelled and reported through connect_cb with a status of -1, and the
+ * next request is issued. Connection requests can be withdrawn with
+ * ble_disconnect().
+ *
+ * @param address The address of the remote device, as for ble_connect().
+ * @param priority The priority of the request. Sweeps use priority -1.
+ * @param timeout Time allowed to the attempt once issued, in ms.
+ *
+ * @return 0 if connection has been successfully requested.
+ * @return 1 if the device is already connected or being connected.
+ * @return -1 if failed to request connection.
+ */
+int ble_connect_with_priority(const uint8_t *address, int priority,
+                              int timeout);
+
+/**
+ * Reconnect a device automatically when its link is lost.
+ *
+ * A background connection is requested as soon as the link is lost, so the
+ * device is reconnected as soon as it advertises again. It holds one of the
+ * links of ble_connect_set_max_links() until it completes, and waits for one
+ * when all of them are open. Failed attempts are
+ * retried after a delay doubled at each failure, from min_backoff up to
+ * max_backoff, of which a random part up to a half is taken off. A link lost
+ * within 5 s of being recovered keeps the current delay.
+ *
+ * Discovered attributes are kept, and notifications are registered again
+ * before connect_cb is called. Recoveries are then reported through
+ * reconnect_cb. Links closed with ble_disconnect() are not recovered, and
+ * ble_disconnect() also stops a recovery in progress.
+ *
+ * @param address The address of the remote device, as for ble_connect().
+ * @param enable 1 to reconnect the device, 0 to stop doing it.
+ * @param min_backoff The delay after the first failed attempt, in ms.
+ * @param max_backoff The maximum delay between attempts, in ms.
+ *
+ * @return 0 on success.
+ * @return -1 on invalid parameters.
+ */
+int ble_set_auto_reconnect(const uint8_t *address, int enable,
+                           int min_backoff, int max_backoff);
+
+/**
+ * Connect to devices as soon as they are found while scanning.
+ *
+ * The connection is requested from the stack callback reporting the
+ * advertisement, before scan_cb is called, ahead of any other queued
+ * connection request and with a 2 s timeout. Devices already connected or
+ * being connected are left alone.
+ *
+ * A rule matches the advertisements of a device, of an advertising data
+ * structure, or both. An advertising data structure matches when it has type
+ * ad_type and its first len bytes are equal to value on the bits set in
+ * mask.
+ *
+ * @param address The address of the device, as for ble_connect(), or NULL
+ *                for any device.
+ * @param ad_type The type of advertising data structure to match, or 0 for
+ *                any advertisement.
+ * @param value The bytes to match, after the type. Ignored if ad_type is 0.
+ * @param mask The bits of value to match, or NULL to match all of them.
+ * @param len Number of bytes of value, from 0 to 29.
+ *
+ * @return The identifier of the rule, nonnegative, on success.
+ * @return -1 on invalid parameters or if too many rules are set.
+ */
+int ble_fast_connect_add(const uint8_t *address, uint8_t ad_type,
+                         const uint8_t *value, const uint8_t *mask, int len);
+
+/**
+ * Remove a rule set with ble_fast_connect_add().
+ *
+ * @param rule_id The identifier of the rule.
+ *
+ * @return 0 on success.
+ * @return -1 if there is no such rule.
+ */
+int ble_fast_connect_remove(int rule_id);
+
+/**
+ * Pause scanning while fast connections are pending.
+ *
+ * Scanning is resumed as soon as they complete, if it has not been stopped
+ * meanwhile. Disabled by default.
+ *
+ * @param pause 1 to pause scanning, 0 to keep it going.
+ */
+void ble_fast_connect_set_pause_scan(int pause);
+
+/**
+ * Get the statistics of the connections issued on matching advertisements.
+ *
+ * @param stats Filled with the statistics.
+ * @param reset 1 to reset the statistics after they are copied.
+ *
+ * @return 0 on success.
+ * @return -1 if stats is NULL.
+ */
+int ble_fast_connect_get_stats(ble_fast_connect_stats_t *stats, int reset);
+
+/**
+ * Set the maximum number of links open at the same time.
+ *
+ * Connection requests wait in the queue while the maximum is reached,
+ * counting the background connections of ble_set_auto_reconnect(). The
+ * default is 7, the number of links Bluedroid supports.
+ *
+ * @param max_links The maximum number of links.
+ *
+ * @return 0 on success.
+ * @return -1 if max_links is not positive.
+ */
+int ble_connect_set_max_links(int max_links);
+
 /**
  * Disconnects from a BLE device.
  *
+ * A connection request still queued is withdrawn, and a pending one is
+ * cancelled, without calling any callback.
+ *
  * @param address A pointer to a 6 element array representing each part of the
  *                Bluetooth address of the remote device a disconnection should
  *                be requested, where the most-significant byte is on position
@@ -340,6 +1426,12 @@ int ble_gatt_discover_services(int conn_id, const uint8_t *uuid);
 /**
  * Get included services of a certain service.
  *
+ * Inclusion is followed recursively: the included services of each included
+ * service are also obtained, and services not found by a previous service
+ * discovery are added to the device attributes. srvc_found_cb is called once
+ * for each service reached and srvc_finished_cb when the whole inclusion
+ * graph has been walked. Inclusion cycles are detected and walked only once.
+ *
  * There should be an active connection with the device.
  *
  * @param conn_id The identifier of the connected remote device.
@@ -347,10 +1439,29 @@ int ble_gatt_discover_services(int conn_id, const uint8_t *uuid);
  *                   obtained.
  *
  * @return 0 if service discovery has been successfully requested.
- * @return -1 if failed to request service discovery.
+ * @return Negative value if failed to request service discovery.
  */
 int ble_gatt_get_included_services(int conn_id, int service_id);
 
+/**
+ * Get the services directly included by a service.
+ *
+ * Only inclusions already found by ble_gatt_get_included_services() or by
+ * ble_gatt_discover_all() are returned.
+ *
+ * @param conn_id The identifier of the connected remote device.
+ * @param service_id The id of the including service.
+ * @param ids Array where the ids of the included services are stored. May be
+ *            NULL.
+ * @param max The number of elements in ids.
+ *
+ * @return The number of services included by the service, which may be
+ *         greater than max.
+ * @return -1 if the device is not connected or the service is unknown.
+ */
+int ble_gatt_get_service_includes(int conn_id, int service_id, int *ids,
+                                  int max);
+
 /**
  * Discover characteristics in a service of a BLE device.
  *
@@ -382,6 +1493,12 @@ int ble_gatt_discover_descriptors(int conn_id, int char_id);
 /**
  * Read the value of a characteristic.
  *
+ * Reads and writes are queued per connection together with the other queued
+ * GATT requests, and issued once the previous one has completed, so that the
+ * stack never drops one. A request which the stack refuses when its turn
+ * comes is reported through its callback (char_read_cb here) with the status
+ * of the stack.
+ *
  * There should be an active connection with the device.
  *
  * @param conn_id The identifier of the connected remote device.
@@ -397,6 +1514,8 @@ int ble_gatt_read_char(int conn_id, int char_id, int auth);
 /**
  * Read the value of a characteristic descriptor.
  *
+ * Queued as described for ble_gatt_read_char().
+ *
  * There should be an active connection with the device.
  *
  * @param conn_id The identifier of the connected remote device.
@@ -412,6 +1531,8 @@ int ble_gatt_read_desc(int conn_id, int desc_id, int auth);
 /**
  * Write the value of a characteristic using write command (no response).
  *
+ * Queued as described for ble_gatt_read_char().
+ *
  * There should be an active connection with the device.
  *
  * @param conn_id The identifier of the connected remote device.
@@ -431,6 +1552,8 @@ int ble_gatt_write_cmd_char(int conn_id, int char_id, int auth,
 /**
  * Write the value of a characteristic using write request (with response).
  *
+ * Queued as described for ble_gatt_read_char().
+ *
  * There should be an active connection with the device.
  *
  * @param conn_id The identifier of the connected remote device.
@@ -450,6 +1573,8 @@ int ble_gatt_write_req_char(int conn_id, int char_id, int auth,
 /**
  * Write the value of a descriptor using write command (no response).
  *
+ * Queued as described for ble_gatt_read_char().
+ *
  * There should be an active connection with the device.
  *
  * @param conn_id The identifier of the connected remote device.
@@ -469,6 +1594,8 @@ int ble_gatt_write_cmd_desc(int conn_id, int desc_id, int auth,
 /**
  * Write the value of a descriptor using write request (with response).
  *
+ * Queued as described for ble_gatt_read_char().
+ *
  * There should be an active connection with the device.
  *
  * @param conn_id The identifier of the connected remote device.
@@ -489,6 +1616,8 @@ int ble_gatt_write_req_desc(int conn_id, int desc_id, int auth,
  * Prepare to write the value of a characteristic (with response) later, with
  * @func ble_execute_write().
  *
+ * Queued as described for ble_gatt_read_char().
+ *
  * There should be an active connection with the device.
  *
  * @param conn_id The identifier of the connected remote device.
@@ -509,6 +1638,8 @@ int ble_gatt_prep_write_char(int conn_id, int char_id, int auth,
  * Prepare to write the value of a descriptor (with response) later, with
  * @func ble_execute_write().
  *
+ * Queued as described for ble_gatt_read_char().
+ *
  * There should be an active connection with the device.
  *
  * @param conn_id The identifier of the connected remote device.
@@ -528,6 +1659,8 @@ int ble_gatt_prep_write_desc(int conn_id, int desc_id, int auth,
 /**
  * Execute or cancel a previously prepared write operation.
  *
+ * Queued as described for ble_gatt_read_char().
+ *
  * There should be an active connection with the device.
  *
  * @param conn_id The identifier of the connected remote device.
@@ -539,9 +1672,382 @@ int ble_gatt_prep_write_desc(int conn_id, int desc_id, int auth,
  */
 int ble_gatt_execute_write(int conn_id, int execute);
 
+/**
+ * Write a value of up to 512 bytes on a characteristic (with response).
+ *
+ * Values that do not fit in a single ATT payload are written by the stack as
+ * a sequence of prepare writes, each checked against the data echoed back by
+ * the remote device, followed by an execute write. A single char_write_cb is
+ * called when the whole value has been written or the write has failed.
+ *
+ * Long writes are queued per connection and issued one after the other, so
+ * several of them can be requested without waiting for the previous ones to
+ * finish. The value is copied and can be released as soon as the function
+ * returns.
+ *
+ * There should be an active connection with the device.
+ *
+ * @param conn_id The identifier of the connected remote device.
+ * @param char_id The identifier of the characteristic to be written.
+ * @param auth Whether or not link authentication should be requested before
+ *             trying to write the characteristic: 1 request, 0 do not request.
+ * @param value Pointer to the value that should be written on the
+ *              characteristic.
+ * @param len The length of the data pointed by the value parameter.
+ *
+ * @return 0 if characteristic write has been successfully queued.
+ * @return -1 if failed to queue characteristic write.
+ */
+int ble_gatt_write_long(int conn_id, int char_id, int auth, const char *value,
+                        int len);
+
+/**
+ * Stream a buffer to a characteristic using write commands (no response).
+ *
+ * The buffer is split in chunks sent one after the other: by default, each
+ * chunk is only sent once the stack reports the previous one as sent, as
+ * Bluedroid drops write commands sent while another one is pending. More
+ * chunks can be kept in flight with ble_gatt_stream_set_credits(). The
+ * callback is called periodically while the stream runs and once more when
+ * it finishes (sent equal to total) or fails (nonzero status).
+ *
+ * Streams are queued per connection together with the other queued GATT
+ * requests. The buffer is copied and can be released as soon as the function
+ * returns.
+ *
+ * There should be an active connection with the device.
+ *
+ * @param conn_id The identifier of the connected remote device.
+ * @param char_id The identifier of the characteristic to be written.
+ * @param buffer Pointer to the data to be written.
+ * @param len The length of the data pointed by the buffer parameter.
+ * @param chunk Size of each write command. If nonpositive or larger than the
+ *              ATT payload, the largest chunk that fits the payload of the
+ *              negotiated MTU is used.
+ * @param cb Callback to report progress and completion. May be NULL.
+ *
+ * @return 0 if the stream has been successfully queued.
+ * @return -1 if failed to queue the stream.
+ */
+int ble_gatt_stream_write(int conn_id, int char_id, const char *buffer,
+                          int len, int chunk, ble_gatt_stream_cb_t cb);
+
+/**
+ * Read several characteristics with a single completion.
+ *
+ * The reads are issued back to back, each one as soon as the previous one
+ * completes, and the callback is called once with the values and statuses of
+ * all of them. A failed read does not stop the batch. char_read_cb is not
+ * called for these reads.
+ *
+ * Batches are queued per connection together with the other queued GATT
+ * requests. The array of ids is copied.
+ *
+ * There should be an active connection with the device.
+ *
+ * @param conn_id The identifier of the connected remote device.
+ * @param ids The identifiers of the characteristics to be read.
+ * @param count The number of identifiers.
+ * @param auth Authentication method.
+ * @param cb Callback to deliver the values.
+ *
+ * @return 0 if the batch has been successfully queued.
+ * @return -1 if failed to queue the batch.
+ */
+int ble_gatt_read_many(int conn_id, const int *ids, int count, int auth,
+                       ble_gatt_read_many_cb_t cb);
+
+/**
+ * Read a set of characteristics from a list of devices.
+ *
+ * Each device is connected to, its characteristics are discovered and read
+ * back to back, and it is disconnected from as soon as the reads complete.
+ * Up to max_links devices are handled at the same time; since the stack only
+ * accepts one pending connection, connections are requested one at a time,
+ * as soon as the previous one completes. An attempt that does not complete
+ * within the timeout is aborted, and the device is retried at the end of the
+ * list until its retries are exhausted.
+ *
+ * The callbacks of connections, disconnections and discovery are also called
+ * for the devices of the sweep. Only one sweep can run at a time.
+ *
+ * @param addresses The addresses of the devices, 6 bytes each.
+ * @param count The number of devices.
+ * @param params The parameters of the sweep.
+ * @param cb Callback to deliver the result of each device.
+ * @param done_cb Callback to notify that the sweep finished. May be NULL.
+ *
+ * @return 0 if the sweep has been started.
+ * @return 1 if a sweep is already running.
+ * @return -1 on invalid parameters.
+ */
+int ble_sweep_start(const uint8_t *addresses, int count,
+                    const ble_sweep_params_t *params, ble_sweep_cb_t cb,
+                    ble_sweep_done_cb_t done_cb);
+
+/**
+ * Stop a sweep.
+ *
+ * Devices not handled yet are dropped without being reported. Devices being
+ * handled are finished, and done_cb is called when the last one is.
+ *
+ * @return 0 on success.
+ * @return -1 if no sweep is running.
+ */
+int ble_sweep_stop(void);
+
+/**
+ * Set how many write commands of a stream may be in flight at the same time.
+ *
+ * Bluedroid only keeps one pending GATT command per connection, dropping any
+ * other command sent before it completes, so the default of 1 should only be
+ * raised on stacks known to queue commands.
+ *
+ * @param credits Number of write commands in flight, from 1 to 16.
+ *
+ * @return 0 on success.
+ * @return -1 if the number is out of range.
+ */
+int ble_gatt_stream_set_credits(int credits);
+
+/**
+ * Set how the notifications of a characteristic are delivered.
+ *
+ * The policy is applied as soon as each notification arrives, before
+ * char_notification_cb is called, so notifications that are dropped or
+ * coalesced never reach the application. For the MIN, MAX and MEAN policies
+ * the value delivered at the end of each window is the latest value received,
+ * with the field at offset replaced by the aggregate over the window.
+ * Notifications too short to contain the field are dropped.
+ *
+ * Policies stay in place across reconnections, until the characteristic is
+ * unregistered. The default policy is BLE_NOTIFY_ALL.
+ *
+ * There should be an active connection with the device, and notifications of
+ * the characteristic should be registered.
+ *
+ * @param conn_id The identifier of the connected remote device.
+ * @param char_id The identifier of the characteristic.
+ * @param policy The delivery policy.
+ * @param param N for BLE_NOTIFY_NTH, T in ms for the other policies. Ignored
+ *              by BLE_NOTIFY_ALL.
+ * @param format Format of the aggregated field. Only used by the MIN, MAX and
+ *               MEAN policies.
+ * @param offset Offset of the aggregated field in the value. Only used by
+ *               the MIN, MAX and MEAN policies.
+ *
+ * @return 0 on success.
+ * @return -1 if the characteristic is not registered or the policy
+ *            parameters are invalid.
+ */
+int ble_gatt_set_notification_policy(int conn_id, int char_id,
+                                     ble_notify_policy_t policy, int param,
+                                     ble_value_format_t format, int offset);
+
+/**
+ * Describe the application sequence counter of the notifications of a
+ * characteristic.
+ *
+ * The counter is an unsigned little-endian field of the value, expected to be
+ * incremented by one, modulo its width, on every notification. Missing,
+ * repeated and reordered counter values are accounted in the notification
+ * statistics. The counter is restarted on every connection.
+ *
+ * There should be an active connection with the device, and notifications of
+ * the characteristic should be registered.
+ *
+ * @param conn_id The identifier of the connected remote device.
+ * @param char_id The identifier of the characteristic.
+ * @param offset Offset of the counter in the value.
+ * @param width Width of the counter in bytes: 1, 2 or 4, or 0 to stop
+ *              tracking the counter.
+ *
+ * @return 0 on success.
+ * @return -1 if the characteristic is not registered or the field is
+ *            invalid.
+ */
+int ble_gatt_set_sequence_field(int conn_id, int char_id, int offset,
+                                int width);
+
+/**
+ * Get the reception statistics of the notifications of a characteristic.
+ *
+ * Statistics are kept from the registration of the characteristic, across
+ * reconnections, until it is unregistered or the statistics are reset.
+ *
+ * @param conn_id The identifier of the connected remote device.
+ * @param char_id The identifier of the characteristic.
+ * @param stats Filled with the statistics.
+ * @param reset 1 to restart the statistics after reading them.
+ *
+ * @return 0 on success.
+ * @return -1 if the characteristic is not registered.
+ */
+int ble_gatt_get_notification_stats(int conn_id, int char_id,
+                                    ble_notify_stats_t *stats, int reset);
+
+/**
+ * Start recording notifications into a ring file.
+ *
+ * The file is created or truncated to size bytes and mapped in memory, so
+ * recording a notification costs a copy and no system call. When the ring is
+ * full the oldest records are overwritten. Only the characteristics selected
+ * with ble_recorder_set_char() are recorded, before any notification policy
+ * is applied.
+ *
+ * @param path Path of the recording file.
+ * @param size Size of the file, including the header. Should be at least one
+ *             page.
+ *
+ * @return 0 on success.
+ * @return -1 if a recording is already running or the file cannot be mapped.
+ */
+int ble_recorder_start(const char *path, size_t size);
+
+/**
+ * Stop recording notifications and close the recording file.
+ *
+ * @return 0 on success.
+ * @return -1 if no recording is running.
+ */
+int ble_recorder_stop(void);
+
+/**
+ * Select whether the notifications of a characteristic are recorded.
+ *
+ * The selection stays in place across reconnections, until the
+ * characteristic is unregistered. There should be an active connection with
+ * the device, and notifications of the characteristic should be registered.
+ *
+ * @param conn_id The identifier of the connected remote device.
+ * @param char_id The identifier of the characteristic.
+ * @param enable 1 to record the notifications, 0 to stop recording them.
+ *
+ * @return 0 on success.
+ * @return -1 if the characteristic is not registered.
+ */
+int ble_recorder_set_char(int conn_id, int char_id, int enable);
+
+/**
+ * Request an ATT MTU exchange with a BLE device.
+ *
+ * The MTU in use after the exchange is reported through mtu_cb. Only
+ * available when libble is built against a stack with MTU configuration
+ * support (HAVE_GATT_CONFIGURE_MTU).
+ *
+ * There should be an active connection with the device.
+ *
+ * @param conn_id The identifier of the connected remote device.
+ * @param mtu The desired MTU, from 23 to 517.
+ *
+ * @return 0 if the MTU exchange has been successfully requested.
+ * @return -1 if failed to request the MTU exchange.
+ */
+int ble_gatt_configure_mtu(int conn_id, int mtu);
+
+/**
+ * Request new parameters for a connection.
+ *
+ * The parameters applied, which the remote device may choose within the
+ * requested range, are reported through conn_params_cb by stacks reporting
+ * connection updates (HAVE_GATT_CONN_UPDATED_CB). Only available when libble
+ * is built against a stack with connection parameter update support
+ * (HAVE_GATT_CONN_PARAMETER_UPDATE).
+ *
+ * There should be an active connection with the device.
+ *
+ * @param conn_id The identifier of the connected remote device.
+ * @param min_interval The minimum connection interval, in units of 1.25 ms,
+ *                     from 6 to 3200.
+ * @param max_interval The maximum connection interval, in units of 1.25 ms,
+ *                     from min_interval to 3200.
+ * @param latency The slave latency, in connection events, from 0 to 499.
+ * @param timeout The supervision timeout, in units of 10 ms, from 10 to 3200.
+ *                It should be longer than twice the time elapsed over
+ *                latency + 1 connection events at max_interval.
+ *
+ * @return 0 if the update has been successfully requested.
+ * @return -1 if failed to request the update.
+ */
+int ble_conn_set_params(int conn_id, int min_interval, int max_interval,
+                        int latency, int timeout);
+
+/**
+ * Request the parameters of a profile for a connection.
+ *
+ * Same as ble_conn_set_params() with the parameters of the profile, all of
+ * them using a supervision timeout of 5 s.
+ *
+ * @param conn_id The identifier of the connected remote device.
+ * @param profile The profile to be applied.
+ *
+ * @return 0 if the update has been successfully requested.
+ * @return -1 if failed to request the update.
+ */
+int ble_conn_set_profile(int conn_id, ble_conn_profile_t profile);
+
+/**
+ * Get the parameters of a connection, as last reported by the stack.
+ *
+ * @param conn_id The identifier of the connected remote device.
+ * @param interval Filled with the connection interval, in units of 1.25 ms.
+ * @param latency Filled with the slave latency.
+ * @param timeout Filled with the supervision timeout, in units of 10 ms.
+ *
+ * @return 0 on success, with all parameters set to 0 if none has been
+ *         reported yet, or if the stack does not report connection updates
+ *         (HAVE_GATT_CONN_UPDATED_CB).
+ * @return -1 if the device is not connected.
+ */
+int ble_conn_get_params(int conn_id, int *interval, int *latency,
+                        int *timeout);
+
+/**
+ * Get the ATT MTU in use on a connection.
+ *
+ * @param conn_id The identifier of the connected remote device.
+ *
+ * @return The MTU, 23 until a larger one is negotiated.
+ * @return -1 if the device is not connected.
+ */
+int ble_gatt_get_mtu(int conn_id);
+
+/**
+ * Get the largest value that fits a single write or notification on a
+ * connection, which is the MTU minus the ATT header.
+ *
+ * @param conn_id The identifier of the connected remote device.
+ *
+ * @return The payload size in bytes.
+ * @return -1 if the device is not connected.
+ */
+int ble_gatt_get_payload_size(int conn_id);
+
+/**
+ * Get how many writes of the largest payload are needed to send a buffer on a
+ * connection.
+ *
+ * @param conn_id The identifier of the connected remote device.
+ * @param len The length of the buffer.
+ *
+ * @return The number of chunks.
+ * @return -1 if the device is not connected.
+ */
+int ble_gatt_get_chunk_count(int conn_id, int len);
+
 /**
  * Register for notifications of changes in the value of a characteristic.
  *
+ * Once the stack has registered the notifications, the Client Characteristic
+ * Configuration descriptor of the characteristic is written to enable
+ * notifications (or indications, if the characteristic only supports these),
+ * discovering it first if needed, and char_notification_register_cb is called
+ * with the result of that write.
+ *
+ * Registrations are remembered per device address and replayed as soon as
+ * the device connects again, until
+ * ble_gatt_unregister_char_notification() is called.
+ *
  * There should be an active connection with the device.
  *
  * @param conn_id The identifier of the connected remote device.
@@ -558,6 +2064,9 @@ int ble_gatt_register_char_notification(int conn_id, int char_id);
 /**
  * Unregister for notifications of changes in the value of a characteristic.
  *
+ * The Client Characteristic Configuration descriptor of the characteristic
+ * is cleared before char_notification_register_cb is called.
+ *
  * There should be an active connection with the device.
  *
  * @param conn_id The identifier of the connected remote device.
@@ -570,4 +2079,44 @@ int ble_gatt_register_char_notification(int conn_id, int char_id);
  *            notifications.
  */
 int ble_gatt_unregister_char_notification(int conn_id, int char_id);
+
+/**
+ * Discover all services, included services, characteristics and descriptors
+ * of every connected BLE device.
+ *
+ * The discovery of each device is run independently from the others, so the
+ * GATT requests of all connections are in flight at the same time. The
+ * regular srvc_found_cb, char_found_cb and desc_found_cb callbacks are still
+ * called for each element found.
+ *
+ * @param progress_cb Called every time the discovery of a device changes
+ *                    stage. May be NULL.
+ * @param ready_cb Called once the discovery of all devices has finished. May
+ *                 be NULL.
+ *
+ * @return 0 if discovery has been successfully requested.
+ * @return 1 if a discovery is already running.
+ * @return -1 if failed to request discovery or no device is connected.
+ * @return -status if the stack refused the discovery of every device, in
+ *         which case ready_cb is not called.
+ */
+int ble_gatt_discover_all(ble_discovery_cb_t progress_cb,
+                          ble_discovery_ready_cb_t ready_cb);
+
+/**
+ * Get the progress of the discovery of a connected device.
+ *
+ * @param conn_id The identifier of the connected remote device.
+ * @param state Where the current discovery stage is stored.
+ * @param done Where the number of elements already walked in the current stage
+ *             is stored (services while discovering characteristics,
+ *             characteristics while discovering descriptors). May be NULL.
+ * @param total Where the total number of elements to be walked in the current
+ *              stage is stored. May be NULL.
+ *
+ * @return 0 on success.
+ * @return -1 if the device is not connected.
+ */
+int ble_gatt_get_discovery_state(int conn_id, ble_discovery_state_t *state,
+                                 int *done, int *total);
 #endif
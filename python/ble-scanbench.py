@@ -0,0 +1,92 @@
+#!/usr/bin/python
+# -*- coding: utf-8 -*-
+
+##
+#  ble-scanbench.py -- Measure the cost of scan reports in the Python bindings
+#
+#  Copyright (C) 2013 João Paulo Rechi Vita
+#
+#  This program is free software; you can redistribute it and/or modify
+#  it under the terms of the GNU General Public License as published by
+#  the Free Software Foundation; either version 2 of the License, or
+#  (at your option) any later version.
+#
+#  This program is distributed in the hope that it will be useful,
+#  but WITHOUT ANY WARRANTY; without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#  GNU General Public License for more details.
+#
+#  You should have received a copy of the GNU General Public License
+#  along with this program; if not, write to the Free Software
+#  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+# Reports are injected in libble, so neither a device nearby nor the adapter
+# is needed: ble_scan_inject() runs the scan path on the calling thread. The
+# reports come from a few hundred devices in turn, with varying RSSI, as in a
+# crowded area, so that they stay in the table of the devices found. Without
+# ble_enable() there is no scan_cb, so batches of 1 stand for the delivery of
+# each report. The address, RSSI and first AD byte of each report are read in
+# all modes.
+#
+# Run with the bindings of this tree, on a 2.7 interpreter with libble.so on
+# the library path.
+
+import ble
+import time
+
+DEVICES = 300
+REPORTS = 30000
+BATCH_SIZES = [1, 16, 64, 256]
+
+received = 0
+
+def py_scan_batch_cb(reports, count):
+    global received
+    for i in range(count):
+        received += 1
+        a = reports[i].address[5]
+        r = reports[i].rssi
+        d = reports[i].adv_data[0]
+
+def py_scan_batch_unpack_cb(reports, count):
+    global received
+    for address, rssi, adv_len, adv_data, timestamp in ble.scan_batch_unpack(reports, count):
+        received += 1
+        a = address[5]
+        r = rssi
+        d = adv_data[0]
+
+reports = []
+for i in range(REPORTS):
+    n = i % DEVICES
+    r = ble.ble_scan_report_t()
+    r.address[:] = [0xC0, 0x1E, 0x55, n >> 16, (n >> 8) & 0xFF, n & 0xFF]
+    r.rssi = -40 - (n + i / DEVICES) % 50
+    r.adv_data[0:7] = [2, 1, 6, 3, 0xFF, 0x4C, 0]
+    r.adv_len = 7
+    reports.append(r)
+injected = (ble.ble_scan_report_t * REPORTS)(*reports)
+
+def run(label):
+    global received
+    received = 0
+    start = time.time()
+    ble.libble.ble_scan_inject(injected, REPORTS)
+    # Setting the batch size back to 0 flushes the reports left
+    ble.scan_set_batch(0)
+    elapsed = time.time() - start
+    print "%-12s %6d reports, %8.2f us/report" % (label, received, elapsed * 1e6 / REPORTS)
+
+# Reports processed by libble but not delivered, the cost of the binding is
+# what the other modes add to this
+ble.scan_set_policy(ble.SCAN_DIGEST, 3600000, ble.scan_digest_cb_t(lambda e, n: None))
+run("libble only")
+ble.scan_set_policy(ble.SCAN_ALL)
+
+batch_cb = ble.scan_batch_cb_t(py_scan_batch_cb)
+unpack_cb = ble.scan_batch_cb_t(py_scan_batch_unpack_cb)
+for size in BATCH_SIZES:
+    ble.scan_set_batch(size, 1000, batch_cb)
+    run("batch %d" % size)
+    ble.scan_set_batch(size, 1000, unpack_cb)
+    run("unpack %d" % size)
@@ -21,13 +21,14 @@
 #  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 
 from ctypes import *
+import struct
 
 libble = CDLL("libble.so")
 
 ## Callback types
 enable_cb_t = CFUNCTYPE(None)
 adapter_state_cb_t = CFUNCTYPE(None, c_ubyte)
-scan_cb_t = CFUNCTYPE(None, POINTER(c_ubyte), c_int, POINTER(c_ubyte))
+scan_cb_t = CFUNCTYPE(None, POINTER(c_ubyte), c_int, POINTER(c_ubyte), c_int)
 connect_cb_t = CFUNCTYPE(None, POINTER(c_ubyte), c_int, c_int)
 bond_state_cb_t = CFUNCTYPE(None, POINTER(c_ubyte), c_ubyte, c_int)
 rssi_cb_t = CFUNCTYPE(None, c_int, c_int, c_int)
@@ -36,6 +37,173 @@ gatt_finished_cb_t = CFUNCTYPE(None, c_int, c_int)
 gatt_response_cb_t = CFUNCTYPE(None, c_int, c_int, POINTER(c_ubyte), c_ushort, c_ushort, c_int)
 gatt_notification_register_cb_t = CFUNCTYPE(None, c_int, c_int, c_int, c_int)
 gatt_notification_cb_t = CFUNCTYPE(None, c_int, c_int, POINTER(c_ubyte), c_ushort, c_ubyte)
+gatt_mtu_cb_t = CFUNCTYPE(None, c_int, c_int, c_int)
+conn_params_cb_t = CFUNCTYPE(None, c_int, c_int, c_int, c_int, c_int)
+reconnect_cb_t = CFUNCTYPE(None, POINTER(c_ubyte), c_int, c_int, c_int)
+discovery_cb_t = CFUNCTYPE(None, c_int, c_int, c_int)
+discovery_ready_cb_t = CFUNCTYPE(None, c_int, c_int)
+gatt_stream_cb_t = CFUNCTYPE(None, c_int, c_int, c_int, c_int, c_int, c_int)
+
+## Result of a read of ble_gatt_read_many()
+class ble_gatt_read_result_t(Structure):
+    _fields_ = [
+        ("char_id", c_int),
+        ("status", c_int),
+        ("value_type", c_int),
+        ("offset", c_ushort),
+        ("len", c_ushort)]
+
+gatt_read_many_cb_t = CFUNCTYPE(None, c_int, POINTER(ble_gatt_read_result_t), c_int, POINTER(c_ubyte), c_int)
+
+## Sweep over a list of devices
+class ble_sweep_params_t(Structure):
+    _fields_ = [
+        ("service", POINTER(c_ubyte)),
+        ("chars", POINTER(c_ubyte)),
+        ("char_count", c_int),
+        ("max_links", c_int),
+        ("timeout", c_int),
+        ("retries", c_int)]
+
+sweep_cb_t = CFUNCTYPE(None, POINTER(c_ubyte), POINTER(ble_gatt_read_result_t), c_int, POINTER(c_ubyte), c_int, c_int)
+sweep_done_cb_t = CFUNCTYPE(None, c_int, c_int, c_int)
+
+## Notification delivery policies
+NOTIFY_ALL, NOTIFY_NTH, NOTIFY_LATEST, NOTIFY_MIN, NOTIFY_MAX, NOTIFY_MEAN = range(6)
+
+## Value field formats
+FORMAT_UINT8, FORMAT_SINT8, FORMAT_UINT16, FORMAT_SINT16, FORMAT_UINT32, FORMAT_SINT32 = range(6)
+
+## Scan report delivery policies
+SCAN_ALL, SCAN_NEW, SCAN_CHANGED, SCAN_DIGEST = range(4)
+
+## Aggregated reports of a device found while scanning
+class ble_scan_entry_t(Structure):
+    _fields_ = [
+        ("address", 6 * c_ubyte),
+        ("rssi_last", c_byte),
+        ("rssi_mean", c_byte),
+        ("rssi_min", c_byte),
+        ("rssi_max", c_byte),
+        ("count", c_uint32),
+        ("adv_hash", c_uint32),
+        ("first", c_uint64),
+        ("last", c_uint64)]
+
+scan_digest_cb_t = CFUNCTYPE(None, POINTER(ble_scan_entry_t), c_int)
+presence_cb_t = CFUNCTYPE(None, POINTER(ble_scan_entry_t), c_int)
+
+## RSSI statistics of the recent reports of a device
+class ble_scan_rssi_stats_t(Structure):
+    _fields_ = [
+        ("count", c_uint32),
+        ("mean", c_byte),
+        ("median", c_byte),
+        ("min", c_byte),
+        ("max", c_byte),
+        ("rate", c_uint32)]
+
+## Scan report, as delivered in batches
+ADV_DATA_LEN = 62
+
+class ble_scan_report_t(Structure):
+    _fields_ = [
+        ("address", 6 * c_ubyte),
+        ("rssi", c_byte),
+        ("adv_len", c_ubyte),
+        ("adv_data", ADV_DATA_LEN * c_ubyte),
+        ("timestamp", c_uint64)]
+
+scan_batch_cb_t = CFUNCTYPE(None, POINTER(ble_scan_report_t), c_int)
+
+# Reading reports field by field through ctypes is slow, so batches are
+# better copied out at once and unpacked into
+# (address, rssi, adv_len, adv_data, timestamp) tuples. The padding is taken
+# from the layout ctypes gives the fields, which is the one of the C compiler.
+def scan_report_format():
+    adv_end = ble_scan_report_t.adv_data.offset + ADV_DATA_LEN
+    ts_end = ble_scan_report_t.timestamp.offset + sizeof(c_uint64)
+    return "=6sbB%ds%dxQ%dx" % (ADV_DATA_LEN,
+                                ble_scan_report_t.timestamp.offset - adv_end,
+                                sizeof(ble_scan_report_t) - ts_end)
+
+scan_report_struct = struct.Struct(scan_report_format())
+
+def scan_batch_unpack(reports, count):
+    size = sizeof(ble_scan_report_t)
+    buf = string_at(reports, count * size)
+    return [scan_report_struct.unpack_from(buf, i * size) for i in range(count)]
+
+## Filter of scan reports
+SCAN_MAX_FILTERS = 32
+SCAN_FILTER_DATA_LEN = 27
+
+class ble_scan_filter_t(Structure):
+    _fields_ = [
+        ("address", 6 * c_ubyte),
+        ("address_len", c_ubyte),
+        ("has_uuid", c_ubyte),
+        ("uuid", 16 * c_ubyte),
+        ("has_company", c_ubyte),
+        ("company", c_int),
+        ("data", SCAN_FILTER_DATA_LEN * c_ubyte),
+        ("mask", SCAN_FILTER_DATA_LEN * c_ubyte),
+        ("data_len", c_ubyte),
+        ("rssi", c_int)]
+
+## Identity resolving key, and statistics of ble_rpa_get_stats()
+RPA_MAX_KEYS = 65536
+RPA_DEFAULT_PERIOD = 900
+
+class ble_irk_t(Structure):
+    _fields_ = [
+        ("irk", 16 * c_ubyte),
+        ("identity", 6 * c_ubyte)]
+
+class ble_rpa_stats_t(Structure):
+    _fields_ = [
+        ("cache_hits", c_uint32),
+        ("resolved", c_uint32),
+        ("unresolved", c_uint32)]
+
+## Decoders of advertising data
+DECODER_MANUFACTURER = 0
+DECODER_SERVICE_DATA = 1
+DECODER_MAX = 32
+
+decoder_cb_t = CFUNCTYPE(None, POINTER(c_ubyte), c_int, c_uint16,
+                         POINTER(c_ubyte), c_int)
+
+class ble_ibeacon_t(Structure):
+    _fields_ = [
+        ("uuid", 16 * c_ubyte),
+        ("major", c_uint16),
+        ("minor", c_uint16),
+        ("tx_power", c_byte)]
+
+ibeacon_cb_t = CFUNCTYPE(None, POINTER(c_ubyte), c_int, POINTER(ble_ibeacon_t))
+
+EDDYSTONE_UID = 0x00
+EDDYSTONE_URL = 0x10
+EDDYSTONE_TLM = 0x20
+EDDYSTONE_EID = 0x30
+EDDYSTONE_URL_LEN = 128
+
+class ble_eddystone_t(Structure):
+    _fields_ = [
+        ("frame", c_ubyte),
+        ("tx_power", c_byte),
+        ("namespace_id", 10 * c_ubyte),
+        ("instance_id", 6 * c_ubyte),
+        ("url", EDDYSTONE_URL_LEN * c_char),
+        ("battery", c_uint16),
+        ("temperature", c_int16),
+        ("adv_count", c_uint32),
+        ("uptime", c_uint32),
+        ("eid", 8 * c_ubyte)]
+
+eddystone_cb_t = CFUNCTYPE(None, POINTER(c_ubyte), c_int,
+                           POINTER(ble_eddystone_t))
 
 ## BLE callbacks structure
 class ble_cbs_t(Structure):
@@ -58,9 +226,43 @@ class ble_cbs_t(Structure):
         ("char_write_cb", gatt_response_cb_t),
         ("desc_write_cb", gatt_response_cb_t),
         ("char_notification_register_cb", gatt_notification_register_cb_t),
-        ("char_notification_cb", gatt_notification_cb_t)
+        ("char_notification_cb", gatt_notification_cb_t),
+        ("mtu_cb", gatt_mtu_cb_t),
+        ("conn_params_cb", conn_params_cb_t),
+        ("reconnect_cb", reconnect_cb_t)
     ]
 
+## Notification reception statistics
+STATS_BUCKETS = 16
+
+class ble_notify_stats_t(Structure):
+    _fields_ = [
+        ("count", c_uint64),
+        ("bytes", c_uint64),
+        ("first", c_uint64),
+        ("last", c_uint64),
+        ("rate", c_uint32),
+        ("interval_mean", c_uint32),
+        ("interval_min", c_uint32),
+        ("interval_max", c_uint32),
+        ("jitter", c_uint32),
+        ("hist", c_uint32 * STATS_BUCKETS),
+        ("seq_gaps", c_uint64),
+        ("seq_gap_events", c_uint64),
+        ("seq_duplicates", c_uint64),
+        ("seq_reordered", c_uint64)]
+
+## Statistics of ble_fast_connect_get_stats()
+class ble_fast_connect_stats_t(Structure):
+    _fields_ = [
+        ("triggered", c_uint32),
+        ("connected", c_uint32),
+        ("failed", c_uint32),
+        ("latency_last", c_uint32),
+        ("latency_min", c_uint32),
+        ("latency_max", c_uint32),
+        ("latency_mean", c_uint32)]
+
 ## Functions
 def bda_from_string(s): # '01:23:45:67:89:0A'
     l = s.split(':')
@@ -86,9 +288,240 @@ disable = libble.ble_disable
 start_scan = libble.ble_start_scan
 stop_scan = libble.ble_stop_scan
 
+# Keep the digest callback alive as long as it may be called
+scan_digest_cb = None
+
+def scan_set_policy(policy, interval=0, cb=None):
+    global scan_digest_cb
+    r = libble.ble_scan_set_policy(policy, interval, cb if cb else scan_digest_cb_t())
+    if r == 0:
+        scan_digest_cb = cb
+    return r
+
+def scan_get_entry(address):
+    entry = ble_scan_entry_t()
+    if libble.ble_scan_get_entry(bda_from_string(address), byref(entry)) < 0:
+        return None
+    return entry
+
+scan_clear = libble.ble_scan_clear
+
+# Keep the presence callback alive as long as it may be called
+scan_presence_cb = None
+
+def scan_set_presence(enter_rssi, exit_rssi, timeout, cb=None):
+    global scan_presence_cb
+    r = libble.ble_scan_set_presence(enter_rssi, exit_rssi, timeout,
+                                     cb if cb else presence_cb_t())
+    if r == 0:
+        scan_presence_cb = cb
+    return r
+
+scan_set_top = libble.ble_scan_set_top
+
+def scan_get_top(count):
+    entries = (ble_scan_entry_t * count)()
+    rssi = (c_byte * count)()
+    n = libble.ble_scan_get_top(entries, rssi, count)
+    if n < 0:
+        return None
+    return zip(entries[:n], rssi[:n])
+
+scan_set_history = libble.ble_scan_set_history
+
+def scan_get_history(address, count):
+    times = (c_uint64 * count)()
+    rssi = (c_byte * count)()
+    n = libble.ble_scan_get_history(bda_from_string(address), count, times, rssi)
+    if n < 0:
+        return None
+    return zip(times[:n], rssi[:n])
+
+def scan_get_rssi_stats(address, window=0):
+    stats = ble_scan_rssi_stats_t()
+    if libble.ble_scan_get_rssi_stats(bda_from_string(address), window,
+                                      byref(stats)) < 0:
+        return None
+    return stats
+
+# Keep the batch callback alive as long as it may be called
+scan_batch_cb = None
+
+def scan_set_batch(size, interval=0, cb=None):
+    global scan_batch_cb
+    r = libble.ble_scan_set_batch(size, interval, cb if cb else scan_batch_cb_t())
+    if r == 0:
+        scan_batch_cb = cb
+    return r
+
+def scan_inject(reports):
+    a = (ble_scan_report_t * len(reports))(*reports)
+    return libble.ble_scan_inject(a, len(reports))
+
+## Advertising data parsing
+class ble_ad_iter_t(Structure):
+    _fields_ = [
+        ("data", POINTER(c_ubyte)),
+        ("len", c_int),
+        ("pos", c_int)]
+
+def ad_structures(adv_data, adv_len): # yields (type, value) tuples
+    it = ble_ad_iter_t()
+    t = c_ubyte()
+    v = POINTER(c_ubyte)()
+    l = c_int()
+    libble.ble_ad_iter_init(byref(it), adv_data, adv_len)
+    while libble.ble_ad_next(byref(it), byref(t), byref(v), byref(l)):
+        yield (t.value, string_at(v, l.value))
+
+def ad_get_name(adv_data, adv_len):
+    name = create_string_buffer(ADV_DATA_LEN)
+    if libble.ble_ad_get_name(adv_data, adv_len, name, len(name)) < 0:
+        return None
+    return name.value
+
+def ad_get_uuids(adv_data, adv_len):
+    uuids = (16 * ADV_DATA_LEN * c_ubyte)()
+    n = min(libble.ble_ad_get_uuids(adv_data, adv_len, uuids, ADV_DATA_LEN), ADV_DATA_LEN)
+    return [string_at(addressof(uuids) + 16 * i, 16) for i in range(n)]
+
+def ad_get_tx_power(adv_data, adv_len):
+    p = c_int()
+    if libble.ble_ad_get_tx_power(adv_data, adv_len, byref(p)) < 0:
+        return None
+    return p.value
+
+def ad_get_manufacturer_data(adv_data, adv_len): # returns (company, data)
+    company = c_int()
+    data = POINTER(c_ubyte)()
+    l = c_int()
+    if libble.ble_ad_get_manufacturer_data(adv_data, adv_len, byref(company), byref(data), byref(l)) < 0:
+        return None
+    return (company.value, string_at(data, l.value))
+
+# Keep the decoders alive as long as they may be called
+decoders = {}
+
+def decoder_register(kind, id, cb=None):
+    r = libble.ble_decoder_register(kind, id, cb if cb else decoder_cb_t())
+    if r == 0:
+        if cb:
+            decoders[(kind, id)] = cb
+        else:
+            decoders.pop((kind, id), None)
+    return r
+
+# Keep the callbacks of the built-in decoders alive as long as they may be
+# called
+ibeacon_cb = None
+eddystone_cb = None
+
+def decoder_set_ibeacon_cb(cb=None):
+    global ibeacon_cb
+    r = libble.ble_decoder_set_ibeacon_cb(cb if cb else ibeacon_cb_t())
+    if r == 0:
+        ibeacon_cb = cb
+    return r
+
+def decoder_set_eddystone_cb(cb=None):
+    global eddystone_cb
+    r = libble.ble_decoder_set_eddystone_cb(cb if cb else eddystone_cb_t())
+    if r == 0:
+        eddystone_cb = cb
+    return r
+
+def scan_filter(address=None, uuid=None, company=None, data="", mask=None, rssi=0):
+    # address is a prefix such as 'C0:11', data and mask are hex strings
+    f = ble_scan_filter_t()
+    if address:
+        l = address.split(':')
+        for i in range(len(l)):
+            f.address[i] = int(l[i], 16)
+        f.address_len = len(l)
+    if uuid:
+        f.has_uuid = 1
+        f.uuid[:] = uuid_from_string(uuid)[:]
+    if company is not None:
+        f.has_company = 1
+        f.company = company
+    f.data_len = len(data) / 2
+    for i in range(f.data_len):
+        f.data[i] = int(data[2 * i:2 * i + 2], 16)
+        f.mask[i] = int(mask[2 * i:2 * i + 2], 16) if mask else 0xff
+    f.rssi = rssi
+    return f
+
+def scan_set_filters(filters):
+    a = (ble_scan_filter_t * len(filters))(*filters)
+    return libble.ble_scan_set_filters(a, len(filters))
+
+def scan_set_allowlist(addresses, bloom_bits=0):
+    a = (c_ubyte * (6 * len(addresses)))()
+    for i, address in enumerate(addresses):
+        a[6 * i:6 * i + 6] = list(bda_from_string(address))
+    return libble.ble_scan_set_allowlist(a, len(addresses), bloom_bits)
+
+def scan_load_allowlist(path, bloom_bits=0):
+    return libble.ble_scan_load_allowlist(path, bloom_bits)
+
+def scan_allowlist_contains(address):
+    return libble.ble_scan_allowlist_contains(bda_from_string(address))
+
+def rpa_set_keys(keys, period=0):
+    # keys are (irk, identity) tuples, irk being a hex string with the
+    # most-significant byte first
+    k = (ble_irk_t * len(keys))()
+    for i, (irk, identity) in enumerate(keys):
+        k[i].irk[:] = [int(irk[j:j + 2], 16) for j in range(0, 32, 2)]
+        k[i].identity[:] = list(bda_from_string(identity))
+    return libble.ble_rpa_set_keys(k, len(keys), period)
+
+def rpa_resolve(address):
+    identity = (6 * c_ubyte)()
+    if libble.ble_rpa_resolve(bda_from_string(address), identity) != 1:
+        return None
+    return "%02X:%02X:%02X:%02X:%02X:%02X" % tuple(identity)
+
+def rpa_get_address(identity):
+    address = (6 * c_ubyte)()
+    if libble.ble_rpa_get_address(bda_from_string(identity), address) < 0:
+        return None
+    return "%02X:%02X:%02X:%02X:%02X:%02X" % tuple(address)
+
+def rpa_get_stats(reset=0):
+    stats = ble_rpa_stats_t()
+    if libble.ble_rpa_get_stats(byref(stats), reset) < 0:
+        return None
+    return stats
+
 def connect(address):
     libble.ble_connect(bda_from_string(address))
 
+def connect_with_priority(address, priority, timeout):
+    return libble.ble_connect_with_priority(bda_from_string(address),
+                                            priority, timeout)
+
+connect_set_max_links = libble.ble_connect_set_max_links
+
+def fast_connect_add(address, ad_type=0, value="", mask=None):
+    a = bda_from_string(address) if address else None
+    v = create_string_buffer(value, len(value) or 1)
+    m = create_string_buffer(mask, len(value) or 1) if mask else None
+    return libble.ble_fast_connect_add(a, ad_type, v, m, len(value))
+
+fast_connect_remove = libble.ble_fast_connect_remove
+fast_connect_set_pause_scan = libble.ble_fast_connect_set_pause_scan
+
+def fast_connect_get_stats(reset=0):
+    stats = ble_fast_connect_stats_t()
+    if libble.ble_fast_connect_get_stats(byref(stats), reset) < 0:
+        return None
+    return stats
+
+def set_auto_reconnect(address, enable, min_backoff, max_backoff):
+    return libble.ble_set_auto_reconnect(bda_from_string(address), enable,
+                                         min_backoff, max_backoff)
+
 def disconnect(address):
     libble.ble_disconnect(bda_from_string(address))
 
@@ -138,8 +571,91 @@ def gatt_prep_write_desc(conn_id, desc_id, auth, value, l):
     libble.ble_gatt_prep_write_desc
 
 gatt_execute_write = libble.ble_gatt_execute_write
+
+def gatt_write_long(conn_id, char_id, auth, value, l):
+    v = hex_string_to_ubyte_pointer(value, l)
+    return libble.ble_gatt_write_long(conn_id, char_id, auth, v, l)
+
+def gatt_stream_write(conn_id, char_id, data, chunk, cb): # data is a byte string, cb a gatt_stream_cb_t
+    return libble.ble_gatt_stream_write(conn_id, char_id, data, len(data), chunk, cb)
+
+gatt_stream_set_credits = libble.ble_gatt_stream_set_credits
+
+def gatt_read_many(conn_id, ids, auth, cb): # cb is a gatt_read_many_cb_t
+    a = (c_int * len(ids))(*ids)
+    return libble.ble_gatt_read_many(conn_id, a, len(ids), auth, cb)
+
+# Keep the callbacks of the sweep alive as long as they may be called
+sweep_cbs = None
+
+# addresses is a list of 6-byte strings, chars a list of 16-byte UUID strings
+# and service a 16-byte UUID string or None
+def sweep_start(addresses, service, chars, max_links, timeout, retries, cb, done_cb):
+    global sweep_cbs
+    a = create_string_buffer("".join(addresses), 6 * len(addresses))
+    c = create_string_buffer("".join(chars), 16 * len(chars))
+    p = ble_sweep_params_t()
+    if service:
+        s = create_string_buffer(service, 16)
+        p.service = cast(s, POINTER(c_ubyte))
+    p.chars = cast(c, POINTER(c_ubyte))
+    p.char_count = len(chars)
+    p.max_links = max_links
+    p.timeout = timeout
+    p.retries = retries
+    r = libble.ble_sweep_start(a, len(addresses), byref(p), cb, done_cb)
+    if r == 0:
+        sweep_cbs = (cb, done_cb)
+    return r
+
+sweep_stop = libble.ble_sweep_stop
+
+gatt_configure_mtu = libble.ble_gatt_configure_mtu
+gatt_get_mtu = libble.ble_gatt_get_mtu
+gatt_get_payload_size = libble.ble_gatt_get_payload_size
+gatt_get_chunk_count = libble.ble_gatt_get_chunk_count
+
+## Connection parameter profiles
+CONN_LOW_LATENCY, CONN_BALANCED, CONN_LOW_POWER = range(3)
+
+conn_set_params = libble.ble_conn_set_params
+conn_set_profile = libble.ble_conn_set_profile
+
+def conn_get_params(conn_id):
+    interval, latency, timeout = c_int(), c_int(), c_int()
+    if libble.ble_conn_get_params(conn_id, byref(interval), byref(latency), byref(timeout)) < 0:
+        return None
+    return (interval.value, latency.value, timeout.value)
+
 gatt_register_char_notification = libble.ble_gatt_register_char_notification
 gatt_unregister_char_notification = libble.ble_gatt_unregister_char_notification
+gatt_set_notification_policy = libble.ble_gatt_set_notification_policy
+recorder_start = libble.ble_recorder_start
+recorder_stop = libble.ble_recorder_stop
+recorder_set_char = libble.ble_recorder_set_char
+gatt_discover_all = libble.ble_gatt_discover_all
+
+def gatt_get_service_includes(conn_id, service_id):
+    n = libble.ble_gatt_get_service_includes(conn_id, service_id, None, 0)
+    if n <= 0:
+        return []
+    ids = (n * c_int)()
+    libble.ble_gatt_get_service_includes(conn_id, service_id, ids, n)
+    return list(ids)
+
+def gatt_get_discovery_state(conn_id):
+    state, done, total = c_int(), c_int(), c_int()
+    if libble.ble_gatt_get_discovery_state(conn_id, byref(state), byref(done), byref(total)) < 0:
+        return None
+    return (state.value, done.value, total.value)
+
+gatt_set_sequence_field = libble.ble_gatt_set_sequence_field
+
+def gatt_get_notification_stats(conn_id, char_id, reset=0):
+    stats = ble_notify_stats_t()
+    if libble.ble_gatt_get_notification_stats(conn_id, char_id, byref(stats), reset) < 0:
+        return None
+    return stats
 
 ## Utils
 
@@ -157,8 +673,9 @@ def py_adapter_state_cb(state): # void (uint8_t state)
         global enabled
         enabled = 0
 
-def py_scan_cb(address, rssi, adv_data): # void (const uint8_t *address, int rssi, const uint8_t *adv_data)
-    print "Found %02X:%02X:%02X:%02X:%02X:%02X RSSI %d" % (address[0], address[1], address[2], address[3], address[4], address[5], rssi)
+def py_scan_cb(address, rssi, adv_data, adv_len): # void (const uint8_t *address, int rssi, const uint8_t *adv_data, int adv_len)
+    name = ad_get_name(adv_data, adv_len)
+    print "Found %02X:%02X:%02X:%02X:%02X:%02X RSSI %d %s" % (address[0], address[1], address[2], address[3], address[4], address[5], rssi, name or "")
 
 def py_connect_cb(address, conn_id, status): # void (const uint8_t *address, int conn_id, int status):
     print "%02X:%02X:%02X:%02X:%02X:%02X connected: conn_id %d status %d" % (address[0], address[1], address[2], address[3], address[4], address[5], conn_id, status)
@@ -221,6 +738,15 @@ def py_char_notification_register_cb(conn_id, char_id, registered, status): # vo
         action = "unregistered"
     print "Dev conn_id %d %s notifications for characteristic %d status %d" % (conn_id, action, char_id, status)
 
+def py_mtu_cb(conn_id, mtu, status): # void (int conn_id, int mtu, int status)
+    print "Dev conn_id %d MTU %d status %d" % (conn_id, mtu, status)
+
+def py_conn_params_cb(conn_id, interval, latency, timeout, status): # void (int conn_id, int interval, int latency, int timeout, int status)
+    print "Dev conn_id %d interval %d latency %d timeout %d status %d" % (conn_id, interval, latency, timeout, status)
+
+def py_reconnect_cb(address, conn_id, downtime, attempts): # void (const uint8_t *address, int conn_id, int downtime, int attempts)
+    print "%02X:%02X:%02X:%02X:%02X:%02X reconnected: conn_id %d after %d ms, %d attempts" % (address[0], address[1], address[2], address[3], address[4], address[5], conn_id, downtime, attempts)
+
 def py_char_notification_cb(conn_id, char_id, value, value_len, is_indication): # void (int conn_id, int char_id, const uint8_t *value, uint16_t value_len, uint8_t is_indication)
     print "Dev conn_id %d notification for characteristic %d status %d:" % (conn_id, char_id, status),
     for i in range(value_len):
@@ -245,15 +771,47 @@ cbs = ble_cbs_t(enable_cb_t(py_enable_cb),
                 gatt_response_cb_t(py_char_write_cb),
                 gatt_response_cb_t(py_desc_write_cb),
                 gatt_notification_register_cb_t(py_char_notification_register_cb),
-                gatt_notification_cb_t(py_char_notification_cb))
+                gatt_notification_cb_t(py_char_notification_cb),
+                gatt_mtu_cb_t(py_mtu_cb),
+                conn_params_cb_t(py_conn_params_cb),
+                reconnect_cb_t(py_reconnect_cb))
 
 __all__ = [libble, enable_cb_t, adapter_state_cb_t, scan_cb_t, connect_cb_t,
            bond_state_cb_t, rssi_cb_t, gatt_found_cb_t, gatt_finished_cb_t,
            gatt_response_cb_t, gatt_notification_register_cb_t,
            gatt_notification_cb_t, ble_cbs_t, enable, disable, start_scan,
-           stop_scan, connect, disconnect, pair, remove_bond, read_remote_rssi,
+           stop_scan, ble_scan_entry_t, scan_digest_cb_t, scan_set_policy,
+           scan_get_entry, scan_clear, scan_set_history, scan_get_history,
+           ble_scan_rssi_stats_t, scan_get_rssi_stats, presence_cb_t,
+           scan_set_presence, scan_set_top, scan_get_top, ble_scan_filter_t,
+           scan_filter, scan_set_filters, scan_set_allowlist,
+           scan_load_allowlist, scan_allowlist_contains, ble_irk_t,
+           ble_rpa_stats_t, rpa_set_keys, rpa_resolve, rpa_get_address,
+           rpa_get_stats, ble_scan_report_t,
+           scan_batch_cb_t, scan_set_batch, scan_inject, scan_batch_unpack,
+           ble_ad_iter_t, ad_structures, ad_get_name, ad_get_uuids,
+           ad_get_tx_power, ad_get_manufacturer_data, decoder_cb_t,
+           decoder_register, ble_ibeacon_t, ibeacon_cb_t,
+           decoder_set_ibeacon_cb, ble_eddystone_t, eddystone_cb_t,
+           decoder_set_eddystone_cb, connect, connect_with_priority,
+           connect_set_max_links, set_auto_reconnect, reconnect_cb_t,
+           ble_fast_connect_stats_t, fast_connect_add, fast_connect_remove,
+           fast_connect_set_pause_scan, fast_connect_get_stats,
+           disconnect, pair, remove_bond, read_remote_rssi,
            gatt_discover_services, gatt_discover_characteristics,
            gatt_discover_descriptors, gatt_read_char, gatt_read_desc,
            gatt_write_cmd_char, gatt_write_req_char, gatt_write_cmd_desc,
            gatt_write_req_desc, gatt_register_char_notification,
-           gatt_unregister_char_notification]
+           gatt_unregister_char_notification, discovery_cb_t,
+           discovery_ready_cb_t, gatt_discover_all, gatt_get_discovery_state,
+           gatt_get_service_includes, gatt_write_long, gatt_stream_cb_t,
+           gatt_stream_write, gatt_stream_set_credits, gatt_mtu_cb_t,
+           gatt_configure_mtu, gatt_get_mtu, gatt_get_payload_size,
+           gatt_get_chunk_count, gatt_set_notification_policy,
+           recorder_start, recorder_stop, recorder_set_char,
+           ble_notify_stats_t, gatt_set_sequence_field,
+           gatt_get_notification_stats, ble_gatt_read_result_t,
+           gatt_read_many_cb_t, gatt_read_many, ble_sweep_params_t,
+           sweep_cb_t, sweep_done_cb_t, sweep_start, sweep_stop,
+           conn_params_cb_t, conn_set_params, conn_set_profile,
+           conn_get_params]
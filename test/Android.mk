@@ -8,3 +8,52 @@ LOCAL_MODULE_TAGS := eng
 LOCAL_MODULE := libble-scan
 
 include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := libble-recdump.c
+LOCAL_MODULE_TAGS := eng
+LOCAL_MODULE := libble-recdump
+
+include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := libble-fastconnect.c
+LOCAL_SHARED_LIBRARIES := libble
+LOCAL_MODULE_TAGS := eng
+LOCAL_MODULE := libble-fastconnect
+
+include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := libble-rpabench.c
+LOCAL_SHARED_LIBRARIES := libble
+LOCAL_MODULE_TAGS := eng
+LOCAL_MODULE := libble-rpabench
+
+include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+# Built from the sources of libble, with a stub HAL in place of libhardware
+LOCAL_SRC_FILES := libble-mtu-test.c ../lib/ble.c ../lib/aes.c
+# Enable along with the same flag in lib/Android.mk
+#LOCAL_CFLAGS += -DHAVE_GATT_CONFIGURE_MTU
+LOCAL_MODULE_TAGS := eng
+LOCAL_MODULE := libble-mtu-test
+
+include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+# Built from the sources of libble, with a stub HAL in place of libhardware
+LOCAL_SRC_FILES := libble-connparams-test.c ../lib/ble.c ../lib/aes.c
+# Enable along with the same flags in lib/Android.mk
+#LOCAL_CFLAGS += -DHAVE_GATT_CONN_PARAMETER_UPDATE
+#LOCAL_CFLAGS += -DHAVE_GATT_CONN_UPDATED_CB
+LOCAL_MODULE_TAGS := eng
+LOCAL_MODULE := libble-connparams-test
+
+include $(BUILD_EXECUTABLE)
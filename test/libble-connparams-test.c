@@ -0,0 +1,142 @@
+/*
+ *  libble-connparams-test -- Tests the connection parameter updates against a
+ *  stub HAL
+ *
+ *  Copyright (C) 2013 João Paulo Rechi Vita
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <libble/ble.h>
+
+#include "libble-stub-hal.h"
+
+static const uint8_t peer[6] = { 0x00, 0x11, 0x22, 0xaa, 0xbb, 0xcc };
+
+static int enabled;
+static int conn_id;
+static int params_cbs;
+static int params[3];
+static int params_status;
+
+static void enable_cb(void) {
+    enabled = 1;
+}
+
+static void connect_cb(const uint8_t *address, int id, int status) {
+    conn_id = status == 0 ? id : -1;
+}
+
+static void disconnect_cb(const uint8_t *address, int id, int status) {
+    conn_id = 0;
+}
+
+static void conn_params_cb(int id, int interval, int latency, int timeout,
+                           int status) {
+    params_cbs++;
+    params[0] = interval;
+    params[1] = latency;
+    params[2] = timeout;
+    params_status = status;
+}
+
+static int params_are(int interval, int latency, int timeout) {
+    int p[3];
+
+    if (ble_conn_get_params(conn_id, &p[0], &p[1], &p[2]) < 0)
+        return 0;
+
+    return p[0] == interval && p[1] == latency && p[2] == timeout;
+}
+
+int main(void) {
+    ble_cbs_t cbs = {
+        .enable_cb = enable_cb,
+        .connect_cb = connect_cb,
+        .disconnect_cb = disconnect_cb,
+        .conn_params_cb = conn_params_cb,
+    };
+
+    CHECK(ble_enable(cbs) == 0);
+    stub_run();
+    CHECK(enabled);
+
+    CHECK(ble_connect(peer) == 0);
+    stub_run();
+    CHECK(conn_id > 0);
+
+    /* Nothing is known before the stack reports an update */
+    CHECK(params_are(0, 0, 0));
+    CHECK(ble_conn_get_params(conn_id + 1, NULL, NULL, NULL) == -1);
+
+#ifdef HAVE_GATT_CONN_PARAMETER_UPDATE
+    CHECK(ble_conn_set_params(conn_id, 5, 12, 0, 500) == -1);
+    CHECK(ble_conn_set_params(conn_id, 12, 9, 0, 500) == -1);
+    CHECK(ble_conn_set_params(conn_id, 9, 3201, 0, 500) == -1);
+    CHECK(ble_conn_set_params(conn_id, 9, 12, 500, 500) == -1);
+    CHECK(ble_conn_set_params(conn_id, 9, 12, 0, 9) == -1);
+    /* The supervision timeout does not cover two intervals */
+    CHECK(ble_conn_set_params(conn_id, 80, 100, 4, 100) == -1);
+    CHECK(ble_conn_set_params(conn_id + 1, 9, 12, 0, 500) == -1);
+    CHECK(ble_conn_set_profile(conn_id, BLE_CONN_LOW_POWER + 1) == -1);
+
+    CHECK(ble_conn_set_params(conn_id, 9, 12, 0, 500) == 0);
+    CHECK(ble_conn_set_profile(conn_id, BLE_CONN_LOW_POWER) == 0);
+    stub_run();
+#ifdef HAVE_GATT_CONN_UPDATED_CB
+    CHECK(params_cbs == 2 && params_status == 0);
+    CHECK(params[0] == 100 && params[1] == 2 && params[2] == 500);
+    CHECK(params_are(100, 2, 500));
+
+    /* A failed update keeps the parameters in use */
+    stub.status = 0x3b;
+    CHECK(ble_conn_set_profile(conn_id, BLE_CONN_LOW_LATENCY) == 0);
+    stub_run();
+    stub.status = 0;
+    CHECK(params_cbs == 3 && params_status == 0x3b);
+    CHECK(params_are(100, 2, 500));
+
+    /* A new connection starts with unknown parameters */
+    CHECK(ble_disconnect(peer) == 0);
+    stub_run();
+    CHECK(ble_connect(peer) == 0);
+    stub_run();
+    CHECK(conn_id > 0);
+    CHECK(params_are(0, 0, 0));
+#else
+    /* Without the callback, the parameters applied are never known */
+    CHECK(params_cbs == 0);
+    CHECK(params_are(0, 0, 0));
+#endif
+#else
+    /* Without the HAL entry point no update can be requested */
+    CHECK(ble_conn_set_params(conn_id, 9, 12, 0, 500) == -1);
+    CHECK(ble_conn_set_profile(conn_id, BLE_CONN_BALANCED) == -1);
+    CHECK(params_cbs == 0);
+#endif
+
+    CHECK(ble_disconnect(peer) == 0);
+    stub_run();
+    CHECK(ble_disable() == 0);
+    stub_run();
+
+    printf("%s: %d checks failed\n", failures ? "FAIL" : "PASS", failures);
+
+    return failures ? 1 : 0;
+}
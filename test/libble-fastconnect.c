@@ -0,0 +1,239 @@
+/*
+ *  libble-fastconnect -- Measures the time from advertisement to connection
+ *
+ *  Copyright (C) 2013 João Paulo Rechi Vita
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+
+#include <libble/ble.h>
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+
+static uint8_t enabled;
+static uint8_t target[6];
+static uint8_t fast;
+static uint8_t found;
+static int conn_id;
+static int connected;
+static uint64_t advert_us;
+static uint64_t connect_us;
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void enable_cb(void) {
+    printf("BLE enabled.\n");
+    enabled = 1;
+}
+
+static void scan_cb(const uint8_t *address, int rssi, const uint8_t *adv_data,
+                    int adv_len) {
+    if (memcmp(address, target, sizeof(target)))
+        return;
+
+    /* Like an application would: note the device, and let another thread
+     * decide to connect */
+    pthread_mutex_lock(&lock);
+    if (!found) {
+        found = 1;
+        advert_us = now_us();
+        pthread_cond_signal(&cond);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+static void connect_cb(const uint8_t *address, int id, int status) {
+    pthread_mutex_lock(&lock);
+    connect_us = now_us();
+    conn_id = id;
+    connected = status == 0 ? 1 : -1;
+    pthread_cond_signal(&cond);
+    pthread_mutex_unlock(&lock);
+}
+
+static void disconnect_cb(const uint8_t *address, int id, int status) {
+    pthread_mutex_lock(&lock);
+    connected = 0;
+    pthread_cond_signal(&cond);
+    pthread_mutex_unlock(&lock);
+}
+
+static ble_cbs_t ble_cbs = {
+    enable_cb,
+    NULL,
+    scan_cb,
+    connect_cb,
+    disconnect_cb,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL
+};
+
+static void usage(const char *name) {
+    printf("Usage: %s ADDRESS [-f] [-n COUNT]\n"
+           "Connects COUNT times to the device ADDRESS as soon as it is found,\n"
+           "and prints the time from advertisement to connection. With -f the\n"
+           "connection is issued by libble from the scan result, otherwise by\n"
+           "the application from scan_cb.\n", name);
+}
+
+/* One connection, returns the latency in us or -1 on failure */
+static int64_t cycle(void) {
+    int64_t latency = -1;
+    ble_fast_connect_stats_t stats;
+
+    pthread_mutex_lock(&lock);
+    found = 0;
+    connected = 0;
+    pthread_mutex_unlock(&lock);
+
+    ble_start_scan();
+
+    pthread_mutex_lock(&lock);
+    if (!fast) {
+        while (!found)
+            pthread_cond_wait(&cond, &lock);
+        pthread_mutex_unlock(&lock);
+        ble_connect(target);
+        pthread_mutex_lock(&lock);
+    }
+    while (!connected)
+        pthread_cond_wait(&cond, &lock);
+    if (connected > 0 && !fast)
+        latency = connect_us - advert_us;
+    pthread_mutex_unlock(&lock);
+
+    ble_stop_scan();
+
+    if (fast && connected > 0) {
+        ble_fast_connect_get_stats(&stats, 0);
+        latency = stats.latency_last;
+    }
+
+    if (connected > 0) {
+        ble_disconnect(target);
+        pthread_mutex_lock(&lock);
+        while (connected)
+            pthread_cond_wait(&cond, &lock);
+        pthread_mutex_unlock(&lock);
+    }
+
+    return latency;
+}
+
+int main(int argc, char *argv[]) {
+    int64_t latency, min = INT64_MAX, max = 0, sum = 0;
+    int count = 10, ok = 0, opt, i;
+    unsigned int a[6];
+
+    while ((opt = getopt(argc, argv, "fn:h")) != -1) {
+        switch (opt) {
+            case 'f':
+                fast = 1;
+                break;
+            case 'n':
+                count = atoi(optarg);
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (optind != argc - 1 || count <= 0 ||
+        sscanf(argv[optind], "%x:%x:%x:%x:%x:%x", &a[0], &a[1], &a[2], &a[3],
+               &a[4], &a[5]) != 6) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    for (i = 0; i < 6; i++)
+        target[i] = a[i];
+
+    if (getuid() != 0) {
+        printf("Permission denied\n");
+        return 1;
+    }
+
+    if (ble_enable(ble_cbs) != 0) {
+        printf("Failed to initialize libble\n");
+        return 1;
+    }
+    while (!enabled) sleep(1);
+
+    if (fast)
+        ble_fast_connect_add(target, 0, NULL, NULL, 0);
+
+    for (i = 0; i < count; i++) {
+        latency = cycle();
+        if (latency < 0) {
+            printf("Connection %d failed\n", i);
+            continue;
+        }
+
+        printf("Connection %d: %lld us\n", i, (long long) latency);
+        ok++;
+        sum += latency;
+        if (latency < min)
+            min = latency;
+        if (latency > max)
+            max = latency;
+
+        /* Let the device advertise again */
+        sleep(1);
+    }
+
+    if (ok)
+        printf("%s: %d connections, min %lld us, mean %lld us, max %lld us\n",
+               fast ? "fast connect" : "application connect", ok,
+               (long long) min, (long long) (sum / ok), (long long) max);
+
+    ble_disable();
+    sleep(2);
+
+    return 0;
+}
@@ -0,0 +1,126 @@
+/*
+ *  libble-mtu-test -- Tests the ATT MTU negotiation against a stub HAL
+ *
+ *  Copyright (C) 2013 João Paulo Rechi Vita
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <libble/ble.h>
+
+#include "libble-stub-hal.h"
+
+static const uint8_t peer[6] = { 0x00, 0x11, 0x22, 0xaa, 0xbb, 0xcc };
+
+static int enabled;
+static int conn_id;
+static int mtu_cbs;
+static int mtu;
+static int mtu_status;
+
+static void enable_cb(void) {
+    enabled = 1;
+}
+
+static void connect_cb(const uint8_t *address, int id, int status) {
+    conn_id = status == 0 ? id : -1;
+}
+
+static void disconnect_cb(const uint8_t *address, int id, int status) {
+    conn_id = 0;
+}
+
+static void mtu_cb(int id, int value, int status) {
+    mtu_cbs++;
+    mtu = value;
+    mtu_status = status;
+}
+
+int main(void) {
+    ble_cbs_t cbs = {
+        .enable_cb = enable_cb,
+        .connect_cb = connect_cb,
+        .disconnect_cb = disconnect_cb,
+        .mtu_cb = mtu_cb,
+    };
+#ifdef HAVE_GATT_CONFIGURE_MTU
+    int old;
+#endif
+
+    CHECK(ble_enable(cbs) == 0);
+    stub_run();
+    CHECK(enabled);
+
+    CHECK(ble_connect(peer) == 0);
+    stub_run();
+    CHECK(conn_id > 0);
+
+    CHECK(ble_gatt_get_mtu(conn_id) == 23);
+    CHECK(ble_gatt_get_payload_size(conn_id) == 20);
+    CHECK(ble_gatt_get_chunk_count(conn_id, 100) == 5);
+
+#ifdef HAVE_GATT_CONFIGURE_MTU
+    CHECK(ble_gatt_configure_mtu(conn_id, 22) == -1);
+    CHECK(ble_gatt_configure_mtu(conn_id, 518) == -1);
+    CHECK(ble_gatt_configure_mtu(conn_id + 1, 247) == -1);
+
+    /* The remote device accepts less than requested */
+    stub.peer_mtu = 185;
+    CHECK(ble_gatt_configure_mtu(conn_id, 247) == 0);
+    stub_run();
+    CHECK(mtu_cbs == 1 && mtu_status == 0 && mtu == 185);
+    CHECK(ble_gatt_get_mtu(conn_id) == 185);
+    CHECK(ble_gatt_get_payload_size(conn_id) == 182);
+    CHECK(ble_gatt_get_chunk_count(conn_id, 500) == 3);
+
+    /* A failed exchange keeps the MTU in use */
+    stub.status = 0x85;
+    CHECK(ble_gatt_configure_mtu(conn_id, 517) == 0);
+    stub_run();
+    stub.status = 0;
+    CHECK(mtu_cbs == 2 && mtu_status == 0x85 && mtu == 185);
+    CHECK(ble_gatt_get_mtu(conn_id) == 185);
+
+    /* A new connection starts from the default MTU */
+    old = conn_id;
+    CHECK(ble_disconnect(peer) == 0);
+    stub_run();
+    CHECK(conn_id == 0);
+    CHECK(ble_gatt_get_mtu(old) == -1);
+
+    CHECK(ble_connect(peer) == 0);
+    stub_run();
+    CHECK(conn_id > 0);
+    CHECK(ble_gatt_get_mtu(conn_id) == 23);
+#else
+    /* Without the HAL entry point the MTU stays at the default */
+    CHECK(ble_gatt_configure_mtu(conn_id, 247) == -1);
+    CHECK(ble_gatt_get_mtu(conn_id) == 23);
+    CHECK(mtu_cbs == 0);
+#endif
+
+    CHECK(ble_disconnect(peer) == 0);
+    stub_run();
+    CHECK(ble_disable() == 0);
+    stub_run();
+
+    printf("%s: %d checks failed\n", failures ? "FAIL" : "PASS", failures);
+
+    return failures ? 1 : 0;
+}
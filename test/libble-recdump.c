@@ -0,0 +1,176 @@
+/*
+ *  libble-recdump -- Exports notifications from a libble recording file
+ *
+ *  Copyright (C) 2013 João Paulo Rechi Vita
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <hardware/bt_gatt.h>
+
+#include <libble/ble.h>
+
+static void usage(const char *name) {
+    printf("Usage: %s FILE [-s FROM_US] [-e TO_US] [-c CHAR_ID]\n"
+           "Prints the notifications recorded in FILE between the timestamps\n"
+           "FROM_US and TO_US (us since the epoch), one per line:\n"
+           "timestamp,address,conn_id,char_id,type,value\n", name);
+}
+
+int main(int argc, char *argv[]) {
+    const ble_rec_header_t *hdr;
+    const uint8_t *ring;
+    uint8_t value[(sizeof(ble_rec_t) + BTGATT_MAX_ATTR_LEN + 7) & ~7];
+    const ble_rec_t *r = (const ble_rec_t *) value;
+    uint64_t from = 0, to = UINT64_MAX, off, head, size, pos, count = 0;
+    int char_id = -1, fd, opt, len, i;
+    struct stat st;
+
+    while ((opt = getopt(argc, argv, "s:e:c:h")) != -1) {
+        switch (opt) {
+            case 's':
+                from = strtoull(optarg, NULL, 10);
+                break;
+            case 'e':
+                to = strtoull(optarg, NULL, 10);
+                break;
+            case 'c':
+                char_id = atoi(optarg);
+                if (char_id < 0 || char_id > UINT16_MAX) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (optind != argc - 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    fd = open(argv[optind], O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror(argv[optind]);
+        return 1;
+    }
+
+    if ((size_t) st.st_size < sizeof(*hdr)) {
+        fprintf(stderr, "%s: not a recording file\n", argv[optind]);
+        return 1;
+    }
+
+    hdr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (hdr == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+
+    if (memcmp(hdr->magic, BLE_REC_MAGIC, sizeof(hdr->magic)) ||
+        hdr->version != BLE_REC_VERSION ||
+        hdr->header_size + hdr->data_size > (uint64_t) st.st_size) {
+        fprintf(stderr, "%s: not a recording file\n", argv[optind]);
+        return 1;
+    }
+
+    ring = (const uint8_t *) hdr + hdr->header_size;
+
+    /* The file may still be recorded: records are copied out and dropped if
+     * the writer overwrote them meanwhile */
+    off = __atomic_load_n(&hdr->tail, __ATOMIC_ACQUIRE);
+    head = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+
+    while (off < head) {
+        pos = off % hdr->data_size;
+
+        /* No room for a record header at the end of the ring */
+        if (hdr->data_size - pos < sizeof(ble_rec_t)) {
+            off += hdr->data_size - pos;
+            continue;
+        }
+
+        size = ((const ble_rec_t *) (ring + pos))->size;
+        if (size < sizeof(ble_rec_t) || pos + size > hdr->data_size) {
+            fprintf(stderr, "Corrupted record at offset %llu\n",
+                    (unsigned long long) off);
+            break;
+        }
+
+        /* Padding fills the end of the ring, and is skipped without a copy */
+        if (((const ble_rec_t *) (ring + pos))->flags & BLE_REC_PADDING) {
+            off += size;
+            continue;
+        }
+
+        if (size > sizeof(value)) {
+            fprintf(stderr, "Corrupted record at offset %llu\n",
+                    (unsigned long long) off);
+            break;
+        }
+
+        memcpy(value, ring + pos, size);
+        if (__atomic_load_n(&hdr->tail, __ATOMIC_ACQUIRE) > off) {
+            /* Overwritten while copied, restart from the oldest record */
+            off = __atomic_load_n(&hdr->tail, __ATOMIC_ACQUIRE);
+            continue;
+        }
+        off += size;
+
+        if (r->flags & BLE_REC_PADDING)
+            continue;
+        if (r->timestamp < from || r->timestamp > to)
+            continue;
+        if (char_id >= 0 && r->char_id != char_id)
+            continue;
+
+        printf("%llu,%02X:%02X:%02X:%02X:%02X:%02X,%u,%u,%s,",
+               (unsigned long long) r->timestamp, r->address[0],
+               r->address[1], r->address[2], r->address[3], r->address[4],
+               r->address[5], r->conn_id, r->char_id,
+               r->flags & BLE_REC_INDICATION ? "indication" : "notification");
+        /* The length of a corrupted record may exceed its size */
+        len = r->len;
+        if (len > size - sizeof(ble_rec_t))
+            len = size - sizeof(ble_rec_t);
+        for (i = 0; i < len; i++)
+            printf("%02x", ((const uint8_t *) (r + 1))[i]);
+        printf("\n");
+        count++;
+    }
+
+    fprintf(stderr, "%llu records exported, %llu recorded, %llu overwritten\n",
+            (unsigned long long) count, (unsigned long long) hdr->records,
+            (unsigned long long) hdr->overwritten);
+
+    munmap((void *) hdr, st.st_size);
+    close(fd);
+
+    return 0;
+}
@@ -0,0 +1,159 @@
+/*
+ *  libble-rpabench -- Measures the cost of resolving private addresses
+ *
+ *  Copyright (C) 2013 João Paulo Rechi Vita
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <libble/ble.h>
+
+/* Sample data of the Core specification: the address resolves with irk */
+static const uint8_t sample_irk[16] = {
+    0xec, 0x02, 0x34, 0xa3, 0x57, 0xc8, 0xad, 0x05,
+    0x34, 0x10, 0x10, 0xa6, 0x0a, 0x39, 0x7d, 0x9b
+};
+static const uint8_t sample_address[6] = { 0x70, 0x81, 0x94, 0x0d, 0xfb, 0xaa };
+static const uint8_t sample_identity[6] = { 0xc0, 0x11, 0x22, 0x33, 0x44, 0x55 };
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void usage(const char *name) {
+    printf("Usage: %s [-n ADDRESSES] [KEYS...]\n"
+           "Resolves ADDRESSES random private addresses with KEYS random keys\n"
+           "(10, 1000 and 10000 by default), and prints the time taken to set\n"
+           "the keys, to resolve an address not in the cache, which tries all\n"
+           "the keys, and to resolve an address in the cache. No adapter is\n"
+           "needed.\n", name);
+}
+
+/* Returns 0 on success, -1 if the sample address is not resolved */
+static int bench(int count, int addresses) {
+    ble_irk_t *keys;
+    ble_rpa_stats_t stats;
+    uint8_t address[6], identity[6];
+    uint64_t start, setup, miss, hit;
+    int i, j, resolved = 0;
+
+    keys = malloc(count * sizeof(*keys));
+    if (!keys)
+        return -1;
+
+    for (i = 0; i < count; i++) {
+        for (j = 0; j < 16; j++)
+            keys[i].irk[j] = rand();
+        for (j = 0; j < 6; j++)
+            keys[i].identity[j] = rand();
+    }
+
+    /* The sample key last, so that resolving it tries all the keys */
+    memcpy(keys[count - 1].irk, sample_irk, sizeof(sample_irk));
+    memcpy(keys[count - 1].identity, sample_identity, sizeof(sample_identity));
+
+    start = now_us();
+    if (ble_rpa_set_keys(keys, count, 0) < 0) {
+        free(keys);
+        return -1;
+    }
+    setup = now_us() - start;
+    free(keys);
+
+    if (ble_rpa_resolve(sample_address, identity) != 1 ||
+        memcmp(identity, sample_identity, sizeof(identity))) {
+        printf("%d keys: sample address not resolved\n", count);
+        return -1;
+    }
+
+    /* Distinct addresses, none of them in the cache */
+    start = now_us();
+    for (i = 0; i < addresses; i++) {
+        address[0] = 0x40 | (rand() & 0x3f);
+        for (j = 1; j < 6; j++)
+            address[j] = rand();
+        resolved += ble_rpa_resolve(address, identity);
+    }
+    miss = now_us() - start;
+
+    start = now_us();
+    for (i = 0; i < addresses; i++)
+        ble_rpa_resolve(sample_address, identity);
+    hit = now_us() - start;
+
+    ble_rpa_get_stats(&stats, 1);
+
+    printf("%6d keys: setup %8.3f ms, miss %10.3f us/address, "
+           "hit %6.3f us/address, %u hits, %u resolved by chance\n",
+           count, setup / 1000.0, (double) miss / addresses,
+           (double) hit / addresses, stats.cache_hits, resolved);
+
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    static const int default_counts[] = { 10, 1000, 10000 };
+    int addresses = 1000, ret = 0, opt, count, i;
+
+    while ((opt = getopt(argc, argv, "n:h")) != -1) {
+        switch (opt) {
+            case 'n':
+                addresses = atoi(optarg);
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (addresses <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    srand(time(NULL));
+
+    if (optind == argc) {
+        for (i = 0; i < 3; i++)
+            if (bench(default_counts[i], addresses) < 0)
+                ret = 1;
+    }
+
+    for (i = optind; i < argc; i++) {
+        count = atoi(argv[i]);
+        if (count <= 0 || count > BLE_RPA_MAX_KEYS) {
+            usage(argv[0]);
+            return 1;
+        }
+        if (bench(count, addresses) < 0)
+            ret = 1;
+    }
+
+    ble_rpa_set_keys(NULL, 0, 0);
+
+    return ret;
+}
@@ -38,9 +38,16 @@ static void adapter_state_cb(uint8_t state) {
     printf("Adapter state changed: %u\n", state);
 }
 
-static void scan_cb(const uint8_t *address, int rssi, const uint8_t *adv_data) {
-    printf("Device found: %X:%X:%X:%X:%X:%X, RSSI %d\n", address[0], address[1],
-            address[2], address[3], address[4], address[5], rssi);
+static void scan_cb(const uint8_t *address, int rssi, const uint8_t *adv_data,
+                    int adv_len) {
+    char name[32];
+
+    if (ble_ad_get_name(adv_data, adv_len, name, sizeof(name)) < 0)
+        name[0] = '\0';
+
+    printf("Device found: %X:%X:%X:%X:%X:%X, RSSI %d %s\n", address[0],
+            address[1], address[2], address[3], address[4], address[5], rssi,
+            name);
 }
 
 static ble_cbs_t ble_cbs = {
@@ -62,6 +69,9 @@ static ble_cbs_t ble_cbs = {
     NULL,
     NULL,
     NULL,
+    NULL,
+    NULL,
+    NULL,
     NULL
 };
 
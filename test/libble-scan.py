@@ -26,7 +26,7 @@ libble = CDLL("libble.so")
 
 enable_cb_t = CFUNCTYPE(None)
 adapter_state_cb_t = CFUNCTYPE(None, c_ubyte)
-scan_cb_t = CFUNCTYPE(None, 6 * c_ubyte, c_int, POINTER(c_ubyte))
+scan_cb_t = CFUNCTYPE(None, 6 * c_ubyte, c_int, POINTER(c_ubyte), c_int)
 connect_cb_t = CFUNCTYPE(None, 6 * c_ubyte, c_int, c_int)
 bond_state_cb_t = CFUNCTYPE(None, 6 * c_ubyte, c_ubyte, c_int)
 rssi_cb_t = CFUNCTYPE(None, c_int, c_int, c_int)
@@ -35,6 +35,9 @@ gatt_finished_cb_t = CFUNCTYPE(None, c_int, c_int)
 gatt_response_cb_t = CFUNCTYPE(None, c_int, c_int, POINTER(c_ubyte), c_ushort, c_ushort, c_int)
 gatt_notification_register_cb_t = CFUNCTYPE(None, c_int, c_int, c_int, c_int)
 gatt_notification_cb_t = CFUNCTYPE(None, c_int, c_int, POINTER(c_ubyte), c_ushort, c_ubyte)
+gatt_mtu_cb_t = CFUNCTYPE(None, c_int, c_int, c_int)
+conn_params_cb_t = CFUNCTYPE(None, c_int, c_int, c_int, c_int, c_int)
+reconnect_cb_t = CFUNCTYPE(None, POINTER(c_ubyte), c_int, c_int, c_int)
 
 class ble_cbs_t(Structure):
     _fields_ = [
@@ -56,7 +59,10 @@ class ble_cbs_t(Structure):
         ("char_write_cb", gatt_response_cb_t),
         ("desc_write_cb", gatt_response_cb_t),
         ("char_notification_register_cb", gatt_notification_register_cb_t),
-        ("char_notification_cb", gatt_notification_cb_t)
+        ("char_notification_cb", gatt_notification_cb_t),
+        ("mtu_cb", gatt_mtu_cb_t),
+        ("conn_params_cb", conn_params_cb_t),
+        ("reconnect_cb", reconnect_cb_t)
     ]
 
 if (__name__ == "__main__"):
@@ -74,8 +80,9 @@ if (__name__ == "__main__"):
     def py_adapter_state_cb(state):
         print "Adapter state changed: %u." % state
 
-    # void (const uint8_t *address, int rssi, const uint8_t *adv_data)
-    def py_scan_cb(address, rssi, adv_data):
+    # void (const uint8_t *address, int rssi, const uint8_t *adv_data,
+    #       int adv_len)
+    def py_scan_cb(address, rssi, adv_data, adv_len):
         print "Device found: %X:%X:%X:%X:%X:%X, RSSI %d" % (address[0], address[1], address[2], address[3], address[4], address[5], rssi)
 
     # void (const uint8_t *address, int conn_id, int status):
@@ -0,0 +1,291 @@
+/*
+ *  libble-stub-hal -- Stub Bluetooth HAL for the tests of libble
+ *
+ *  Copyright (C) 2013 João Paulo Rechi Vita
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/* Bluetooth HAL module standing in for libhardware, for tests built with the
+ * sources of libble. Calls into the stub queue the callbacks the stack would
+ * make, and the test delivers them with stub_run(), in place of the stack
+ * callback thread. Only the entry points libble needs to enable the adapter
+ * and connect are provided, plus the ones under test. */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <hardware/bluetooth.h>
+#include <hardware/bt_gatt.h>
+#include <hardware/hardware.h>
+
+#define STUB_MAX_EVENTS 64
+#define STUB_CLIENT_IF 1
+
+typedef enum {
+    STUB_THREAD_EVT,
+    STUB_ADAPTER_STATE,
+    STUB_REGISTER_CLIENT,
+    STUB_OPEN,
+    STUB_CLOSE,
+    STUB_MTU,
+    STUB_CONN_UPDATED
+} stub_event_type_t;
+
+typedef struct {
+    stub_event_type_t type;
+    int conn_id;
+    int status;
+    int value;
+    int latency;
+    int timeout;
+    bt_bdaddr_t bda;
+} stub_event_t;
+
+static struct {
+    bt_callbacks_t *cbs;
+    const btgatt_callbacks_t *gatt_cbs;
+    stub_event_t events[STUB_MAX_EVENTS];
+    int head;
+    int tail;
+    int last_conn_id;
+    int status;         /* Status of the next completion */
+    int peer_mtu;       /* Largest MTU the remote device accepts */
+    int conn_id;        /* Last connection opened, for parameter updates */
+} stub = { .peer_mtu = 517 };
+
+/* Test checks, counting the failed ones */
+static int failures;
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+static stub_event_t *stub_push(stub_event_type_t type, int conn_id) {
+    stub_event_t *e = &stub.events[stub.tail++ % STUB_MAX_EVENTS];
+
+    memset(e, 0, sizeof(*e));
+    e->type = type;
+    e->conn_id = conn_id;
+    e->status = stub.status;
+
+    return e;
+}
+
+/* Deliver the queued callbacks, including the ones they queue */
+static void stub_run(void) {
+    bt_uuid_t uuid;
+    stub_event_t e;
+
+    memset(&uuid, 0, sizeof(uuid));
+
+    while (stub.head != stub.tail) {
+        e = stub.events[stub.head++ % STUB_MAX_EVENTS];
+
+        switch (e.type) {
+            case STUB_THREAD_EVT:
+                stub.cbs->thread_evt_cb(ASSOCIATE_JVM);
+                break;
+
+            case STUB_ADAPTER_STATE:
+                stub.cbs->adapter_state_changed_cb(e.value ? BT_STATE_ON
+                                                           : BT_STATE_OFF);
+                break;
+
+            case STUB_REGISTER_CLIENT:
+                stub.gatt_cbs->client->register_client_cb(e.status,
+                                                          STUB_CLIENT_IF,
+                                                          &uuid);
+                break;
+
+            case STUB_OPEN:
+                stub.gatt_cbs->client->open_cb(e.conn_id, e.status,
+                                               STUB_CLIENT_IF, &e.bda);
+                break;
+
+            case STUB_CLOSE:
+                stub.gatt_cbs->client->close_cb(e.conn_id, e.status,
+                                                STUB_CLIENT_IF, &e.bda);
+                break;
+
+            case STUB_MTU:
+#ifdef HAVE_GATT_CONFIGURE_MTU
+                stub.gatt_cbs->client->configure_mtu_cb(e.conn_id, e.status,
+                                                        e.value);
+#endif
+                break;
+
+            case STUB_CONN_UPDATED:
+#ifdef HAVE_GATT_CONN_UPDATED_CB
+                stub.gatt_cbs->client->conn_updated_cb(e.conn_id, e.value,
+                                                       e.latency, e.timeout,
+                                                       e.status);
+#endif
+                break;
+        }
+    }
+}
+
+static bt_status_t stub_register_client(bt_uuid_t *uuid) {
+    stub_push(STUB_REGISTER_CLIENT, 0);
+    return BT_STATUS_SUCCESS;
+}
+
+static bt_status_t stub_unregister_client(int client_if) {
+    return BT_STATUS_SUCCESS;
+}
+
+static bt_status_t stub_connect(int client_if, const bt_bdaddr_t *bd_addr,
+                                bool is_direct) {
+    stub_event_t *e = stub_push(STUB_OPEN, ++stub.last_conn_id);
+
+    e->bda = *bd_addr;
+    stub.conn_id = stub.last_conn_id;
+
+    return BT_STATUS_SUCCESS;
+}
+
+static bt_status_t stub_disconnect(int client_if, const bt_bdaddr_t *bd_addr,
+                                   int conn_id) {
+    stub_event_t *e;
+
+    /* Cancelling a pending connection reports nothing */
+    if (conn_id) {
+        e = stub_push(STUB_CLOSE, conn_id);
+        e->bda = *bd_addr;
+    }
+
+    return BT_STATUS_SUCCESS;
+}
+
+#ifdef HAVE_GATT_CONFIGURE_MTU
+static bt_status_t stub_configure_mtu(int conn_id, int mtu) {
+    stub_push(STUB_MTU, conn_id)->value = mtu < stub.peer_mtu ? mtu
+                                                               : stub.peer_mtu;
+    return BT_STATUS_SUCCESS;
+}
+#endif
+
+#ifdef HAVE_GATT_CONN_PARAMETER_UPDATE
+/* The remote device picks the longest interval of the range */
+static bt_status_t stub_conn_parameter_update(const bt_bdaddr_t *bd_addr,
+                                              int min_interval,
+                                              int max_interval, int latency,
+                                              int timeout) {
+    stub_event_t *e = stub_push(STUB_CONN_UPDATED, stub.conn_id);
+
+    e->value = max_interval;
+    e->latency = latency;
+    e->timeout = timeout;
+
+    return BT_STATUS_SUCCESS;
+}
+#endif
+
+static const btgatt_client_interface_t stub_client = {
+    .register_client = stub_register_client,
+    .unregister_client = stub_unregister_client,
+    .connect = stub_connect,
+    .disconnect = stub_disconnect,
+#ifdef HAVE_GATT_CONFIGURE_MTU
+    .configure_mtu = stub_configure_mtu,
+#endif
+#ifdef HAVE_GATT_CONN_PARAMETER_UPDATE
+    .conn_parameter_update = stub_conn_parameter_update,
+#endif
+};
+
+static bt_status_t stub_gatt_init(const btgatt_callbacks_t *callbacks) {
+    stub.gatt_cbs = callbacks;
+    return BT_STATUS_SUCCESS;
+}
+
+static void stub_gatt_cleanup(void) {
+}
+
+static const btgatt_interface_t stub_gatt = {
+    .size = sizeof(btgatt_interface_t),
+    .init = stub_gatt_init,
+    .cleanup = stub_gatt_cleanup,
+    .client = &stub_client,
+};
+
+static int stub_init(bt_callbacks_t *callbacks) {
+    stub.cbs = callbacks;
+    stub_push(STUB_THREAD_EVT, 0);
+    return BT_STATUS_SUCCESS;
+}
+
+static int stub_enable(void) {
+    stub_push(STUB_ADAPTER_STATE, 0)->value = 1;
+    return BT_STATUS_SUCCESS;
+}
+
+static int stub_disable(void) {
+    stub_push(STUB_ADAPTER_STATE, 0)->value = 0;
+    return BT_STATUS_SUCCESS;
+}
+
+static void stub_cleanup(void) {
+}
+
+static const void *stub_get_profile_interface(const char *profile_id) {
+    if (!strcmp(profile_id, BT_PROFILE_GATT_ID))
+        return &stub_gatt;
+
+    return NULL;
+}
+
+static const bt_interface_t stub_bt = {
+    .size = sizeof(bt_interface_t),
+    .init = stub_init,
+    .enable = stub_enable,
+    .disable = stub_disable,
+    .cleanup = stub_cleanup,
+    .get_profile_interface = stub_get_profile_interface,
+};
+
+static const bt_interface_t *stub_get_bluetooth_interface(void) {
+    return &stub_bt;
+}
+
+static bluetooth_device_t stub_device = {
+    .get_bluetooth_interface = stub_get_bluetooth_interface,
+};
+
+static int stub_open(const hw_module_t *module, const char *id,
+                     hw_device_t **device) {
+    *device = &stub_device.common;
+    return 0;
+}
+
+static hw_module_methods_t stub_methods = {
+    .open = stub_open,
+};
+
+static hw_module_t stub_module = {
+    .methods = &stub_methods,
+};
+
+/* Replaces the one of libhardware, which the tests are not linked with */
+int hw_get_module(const char *id, const hw_module_t **module) {
+    *module = &stub_module;
+    return 0;
+}